@@ -0,0 +1,421 @@
+#include "aot.h"
+#include "cse.h"
+
+#include <dlfcn.h>
+#include <math.h>
+#include <unistd.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+// A node being emitted by compile_node_into_c(), its operands are emitted
+// into `operands` and `child` is the one being emitted now. A conditional
+// keeps the locals in scope before its branches in `saved`.
+typedef struct {
+  Node *node;
+  size_t next;
+  size_t child;
+  size_t operands[3][3];
+  size_t result[3];
+  size_t *saved;
+} Aot_Frame;
+
+typedef struct {
+  Aot_Frame *items;
+  size_t count;
+  size_t capacity;
+} Aot_Frames;
+
+typedef struct {
+  String_Builder *sb;
+  const Math_Funcs *math;
+  size_t next; // number of the next local
+  // Local of every shared node in scope, plus one so zero means not emitted
+  size_t *slot_vars;
+  size_t slot_count;
+  Aot_Frames frames;
+} Aot_Compiler;
+
+typedef enum {
+  AOT_STEP_PUSHED,
+  AOT_STEP_DONE,
+  AOT_STEP_FAILED,
+} Aot_Step;
+
+/// Push operand `child` of the frame on top, a shared node emitted already
+/// is read from its local right away. The push may move the frame.
+static Aot_Step aot_push_operand(Aot_Compiler *ac, Aot_Frame *frame,
+                                 Node *operand, size_t child) {
+  frame->child = child;
+  if (operand->slot > 0 && ac->slot_vars[operand->slot] > 0) {
+    frame->operands[child][0] = ac->slot_vars[operand->slot] - 1;
+    return AOT_STEP_PUSHED;
+  }
+  da_append(&ac->frames, ((Aot_Frame){.node = operand}));
+  return AOT_STEP_PUSHED;
+}
+
+/// Emit the operands first, then one `const float` local for the node
+static Aot_Step aot_node_step(Aot_Compiler *ac, Aot_Frame *frame) {
+  String_Builder *sb = ac->sb;
+  Node *expr = frame->node;
+  Node *children[3];
+  size_t children_count = node_children(expr, children);
+  if (frame->next < children_count) {
+    size_t child = frame->next++;
+    return aot_push_operand(ac, frame, children[child], child);
+  }
+
+  size_t(*operands)[3] = frame->operands;
+  size_t *result = frame->result;
+  switch (expr->kind) {
+  case NK_X:
+  case NK_Y:
+  case NK_T:
+    result[0] = ac->next++;
+    sb_append_cstr(sb, temp_sprintf("    const float v%zu = %s;\n", result[0],
+                                    node_kind_string(expr->kind)));
+    break;
+
+  case NK_NUMBER: {
+    // %a round-trips the exact bits of a finite constant, folding leaves
+    // NaN and infinities too, which %a prints as no valid C literal
+    float number = expr->as.number;
+    const char *sign = signbit(number) ? "-" : "";
+    const char *value = isnan(number)   ? temp_sprintf("%sNAN", sign)
+                        : isinf(number) ? temp_sprintf("%sINFINITY", sign)
+                                        : temp_sprintf("%af", number);
+    result[0] = ac->next++;
+    sb_append_cstr(sb, temp_sprintf("    const float v%zu = %s;\n", result[0],
+                                    value));
+  } break;
+
+  case NK_BOOLEAN:
+    result[0] = ac->next++;
+    sb_append_cstr(sb, temp_sprintf("    const float v%zu = %d;\n", result[0],
+                                    expr->as.boolean));
+    break;
+
+  case NK_SQRT:
+  case NK_ABS:
+  case NK_SIN: {
+    const char *operand = temp_sprintf("v%zu", operands[0][0]);
+    const char *call = expr->kind == NK_SQRT  ? "sqrtf(%s)"
+                       : expr->kind == NK_ABS ? "fabsf(%s)"
+                                              : ac->math->sin_format;
+    result[0] = ac->next++;
+    sb_append_cstr(sb, temp_sprintf("    const float v%zu = ", result[0]));
+    sb_append_cstr(sb, temp_sprintf(call, operand));
+    sb_append_cstr(sb, ";\n");
+  } break;
+
+  case NK_ADD:
+  case NK_MULT:
+  case NK_GT:
+    result[0] = ac->next++;
+    sb_append_cstr(sb, temp_sprintf("    const float v%zu = v%zu %s v%zu;\n",
+                                    result[0], operands[0][0],
+                                    node_kind_operation(expr->kind),
+                                    operands[1][0]));
+    break;
+
+  case NK_MOD:
+    result[0] = ac->next++;
+    sb_append_cstr(
+        sb, temp_sprintf("    const float v%zu = math_mod(v%zu, v%zu);\n",
+                         result[0], operands[0][0], operands[1][0]));
+    break;
+
+  case NK_TRIPLE:
+    result[0] = operands[0][0];
+    result[1] = operands[1][0];
+    result[2] = operands[2][0];
+    break;
+
+  case NK_RULE:
+  case NK_RANDOM:
+    printf("%s:%d: ERROR: cannot compile a node that is only valid for grammar "
+           "definitions\n",
+           expr->file, expr->line);
+    return AOT_STEP_FAILED;
+
+  case NK_IF:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  default:
+    UNREACHABLE_CODE("compile_node_into_c");
+  }
+
+
+  if (expr->slot > 0)
+    ac->slot_vars[expr->slot] = result[0] + 1;
+  return AOT_STEP_DONE;
+}
+
+/// Assign the triple of a branch to the locals of the conditional and close
+/// the block of the branch
+static void aot_emit_branch_result(Aot_Compiler *ac, Aot_Frame *frame,
+                                   size_t branch) {
+  for (size_t i = 0; i < 3; ++i) {
+    sb_append_cstr(ac->sb,
+                   temp_sprintf("    v%zu = v%zu;\n", frame->result[i],
+                                frame->operands[branch][i]));
+  }
+  sb_append_cstr(ac->sb, branch == 1 ? "    } else {\n" : "    }\n");
+  size_t slot_vars_size = (ac->slot_count + 1) * sizeof(*ac->slot_vars);
+  memcpy(ac->slot_vars, frame->saved, slot_vars_size);
+}
+
+/// Only the branch the condition picks runs, and both assign their triple to
+/// the same locals. The locals of a branch end with its block, so shared
+/// nodes first emitted there are emitted anew by whatever comes after.
+static Aot_Step aot_if_step(Aot_Compiler *ac, Aot_Frame *frame) {
+  String_Builder *sb = ac->sb;
+  Node *expr = frame->node;
+  switch (frame->next++) {
+  case 0:
+    return aot_push_operand(ac, frame, expr->as.iff.cond, 0);
+
+  case 1: {
+    size_t *result = frame->result;
+    for (size_t i = 0; i < 3; ++i)
+      result[i] = ac->next++;
+    sb_append_cstr(sb, temp_sprintf("    float v%zu, v%zu, v%zu;\n", result[0],
+                                    result[1], result[2]));
+    sb_append_cstr(sb,
+                   temp_sprintf("    if (v%zu) {\n", frame->operands[0][0]));
+
+    size_t slot_vars_size = (ac->slot_count + 1) * sizeof(*ac->slot_vars);
+    frame->saved = malloc(slot_vars_size);
+    assert(frame->saved != NULL && "Buy more RAM lol");
+    memcpy(frame->saved, ac->slot_vars, slot_vars_size);
+    return aot_push_operand(ac, frame, expr->as.iff.then, 1);
+  }
+
+  case 2:
+    aot_emit_branch_result(ac, frame, 1);
+    return aot_push_operand(ac, frame, expr->as.iff.elze, 2);
+
+  default:
+    aot_emit_branch_result(ac, frame, 2);
+    free(frame->saved);
+    frame->saved = NULL;
+    return AOT_STEP_DONE;
+  }
+}
+
+/// Emit one `const float` local per value of the typechecked expression and
+/// return the locals holding its result (three for a triple). Shared nodes
+/// are emitted once and then read from their local.
+static bool compile_node_into_c(Aot_Compiler *ac, Node *f, size_t result[3]) {
+  da_append(&ac->frames, ((Aot_Frame){.node = f}));
+  while (ac->frames.count > 0) {
+    // The text of a node is in `sb` once its step is done
+    size_t checkpoint = nob_temp_save();
+    Aot_Frame *frame = &ac->frames.items[ac->frames.count - 1];
+    Aot_Step step = frame->node->kind == NK_IF ? aot_if_step(ac, frame)
+                                               : aot_node_step(ac, frame);
+    nob_temp_rewind(checkpoint);
+    if (step == AOT_STEP_FAILED)
+      break;
+    if (step == AOT_STEP_PUSHED)
+      continue;
+
+    frame = &ac->frames.items[--ac->frames.count];
+    size_t *to = result;
+    if (ac->frames.count > 0) {
+      Aot_Frame *parent = &ac->frames.items[ac->frames.count - 1];
+      to = parent->operands[parent->child];
+    }
+    memcpy(to, frame->result, sizeof(frame->result));
+  }
+
+  bool ok = ac->frames.count == 0;
+  for (size_t i = 0; i < ac->frames.count; ++i)
+    free(ac->frames.items[i].saved);
+  return ok;
+}
+
+static bool compile_node_func_into_c(String_Builder *sb, Node *f,
+                                     const Math_Funcs *math) {
+  if (!expect_type(f, NK_TRIPLE))
+    return false;
+
+  sb_append_cstr(sb, "#include <math.h>\n");
+  sb_append_cstr(sb, "#include <stddef.h>\n");
+  sb_append_cstr(sb, math->source);
+  sb_append_cstr(sb, "\n");
+  sb_append_cstr(sb, "void " AOT_ROW_SYMBOL "(const float *restrict xs, "
+                     "float y, float t, size_t n,\n");
+  sb_append_cstr(sb, "                   float *restrict r, float *restrict g, "
+                     "float *restrict b) {\n");
+  sb_append_cstr(sb, "  for (size_t i = 0; i < n; ++i) {\n");
+  sb_append_cstr(sb, "    const float x = xs[i];\n");
+
+  size_t checkpoint = nob_temp_save();
+  Aot_Compiler ac = {.sb = sb, .math = math, .slot_count = node_slot_count(f)};
+  ac.slot_vars = calloc(ac.slot_count + 1, sizeof(*ac.slot_vars));
+  assert(ac.slot_vars != NULL && "Buy more RAM lol");
+  size_t result[3];
+  bool ok = compile_node_into_c(&ac, f, result);
+  free(ac.slot_vars);
+  da_free(ac.frames);
+  if (ok) {
+    sb_append_cstr(sb, temp_sprintf("    r[i] = v%zu;\n", result[0]));
+    sb_append_cstr(sb, temp_sprintf("    g[i] = v%zu;\n", result[1]));
+    sb_append_cstr(sb, temp_sprintf("    b[i] = v%zu;\n", result[2]));
+  }
+  nob_temp_rewind(checkpoint);
+  if (!ok)
+    return false;
+
+  sb_append_cstr(sb, "  }\n");
+  sb_append_cstr(sb, "}\n");
+  return true;
+}
+
+static bool aot_open(Aot_Kernel *kernel, const char *so_path) {
+  kernel->handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+  if (!kernel->handle) {
+    nob_log(WARNING, "AOT: could not load %s: %s", so_path, dlerror());
+    return false;
+  }
+
+  kernel->row = (Aot_Row_Func)dlsym(kernel->handle, AOT_ROW_SYMBOL);
+  if (!kernel->row) {
+    nob_log(WARNING, "AOT: %s has no %s: %s", so_path, AOT_ROW_SYMBOL,
+            dlerror());
+    dlclose(kernel->handle);
+    kernel->handle = NULL;
+    return false;
+  }
+  return true;
+}
+
+#define AOT_HASH_OFFSET 0xcbf29ce484222325ULL
+#define AOT_HASH_PRIME 0x100000001b3ULL
+
+/// What -march=native resolves to on this machine, e.g.
+/// "sapphirerapids-0123456789abcdef" with a hash of every target option the
+/// compiler enables, or NULL when the compiler does not tell
+static const char *aot_target(void) {
+  static char target[128];
+  static bool resolved = false;
+  if (resolved)
+    return target[0] ? target : NULL;
+  resolved = true;
+
+  const char *path = temp_sprintf("%s/target.%d", AOT_CACHE_DIR,
+                                  (int)getpid());
+  if (!mkdir_if_not_exists(AOT_CACHE_DIR))
+    return NULL;
+  Fd fdout = fd_open_for_write(path);
+  if (fdout == INVALID_FD)
+    return NULL;
+  Cmd cmd = {0};
+  cmd_append(&cmd, "cc", "-march=native", "-Q", "--help=target");
+  bool queried =
+      cmd_run_sync_redirect_and_reset(&cmd, (Cmd_Redirect){.fdout = &fdout});
+  cmd_free(cmd);
+  String_Builder options = {0};
+  bool read = queried && read_entire_file(path, &options);
+  remove(path);
+  if (!read) {
+    da_free(options);
+    return NULL;
+  }
+
+  // The -march= line names the CPU, the hash covers the features on top
+  String_View rest = sb_to_sv(options);
+  String_View march = {0};
+  uint64_t hash = AOT_HASH_OFFSET;
+  while (rest.count > 0) {
+    String_View line = sv_chop_by_delim(&rest, '\n');
+    for (size_t i = 0; i < line.count; ++i) {
+      hash ^= (uint8_t)line.data[i];
+      hash *= AOT_HASH_PRIME;
+    }
+    String_View option = sv_trim(line);
+    if (sv_starts_with(option, sv_from_cstr("-march="))) {
+      sv_chop_by_delim(&option, '=');
+      march = sv_trim(option);
+    }
+  }
+  if (march.count > 0 && march.count < 64) {
+    snprintf(target, sizeof(target), SV_Fmt "-%016llx", SV_Arg(march),
+             (unsigned long long)hash);
+  }
+  da_free(options);
+  return target[0] ? target : NULL;
+}
+
+/// Load the row kernel of the typechecked function, compiling it first when
+/// it is not in the cache yet. A cached object is only reused when the C it
+/// was built from is the C the function emits now.
+bool aot_load_kernel(Aot_Kernel *kernel, Node *f, const Math_Funcs *math) {
+  memset(kernel, 0, sizeof(*kernel));
+  kernel->hash = node_hash(f);
+
+  size_t checkpoint = nob_temp_save();
+  // Without a known target an object may come from another CPU, so it is
+  // always rebuilt
+  const char *target = aot_target();
+  const char *base = temp_sprintf(
+      "%s/v%d-%s-%s-%016llx", AOT_CACHE_DIR, AOT_VERSION,
+      target ? target : "native", math_tier_names[math->tier],
+      (unsigned long long)kernel->hash);
+  const char *so_path = temp_sprintf("%s.so", base);
+  const char *c_path = temp_sprintf("%s.c", base);
+
+  bool ok = false;
+  String_Builder source = {0};
+  String_Builder cached = {0};
+  if (!compile_node_func_into_c(&source, f, math))
+    goto defer;
+
+  // Two trees may share a hash, so the source tells them apart
+  if (target && nob_file_exists(so_path) == 1) {
+    if (read_entire_file(c_path, &cached) && cached.count == source.count &&
+        memcmp(cached.items, source.items, source.count) == 0) {
+      nob_log(INFO, "AOT: cache hit %s", so_path);
+      ok = aot_open(kernel, so_path);
+      goto defer;
+    }
+    nob_log(INFO, "AOT: %s was built from other code, rebuilding", so_path);
+  }
+
+  // Build next to the final paths and rename, the object first, so
+  // concurrent renders never load a half written object or pair a new
+  // source with an old object
+  const char *tmp_c_path = temp_sprintf("%s.%d.c", base, (int)getpid());
+  const char *tmp_so_path = temp_sprintf("%s.so.%d", base, (int)getpid());
+  if (!mkdir_if_not_exists(AOT_CACHE_DIR) ||
+      !write_entire_file(tmp_c_path, source.items, source.count))
+    goto defer;
+
+  Cmd cmd = {0};
+  cmd_append(&cmd, "cc", AOT_CFLAGS, "-o", tmp_so_path, tmp_c_path, "-lm");
+  bool built = cmd_run_sync_and_reset(&cmd);
+  cmd_free(cmd);
+  if (!built || !nob_rename(tmp_so_path, so_path) ||
+      !nob_rename(tmp_c_path, c_path)) {
+    nob_log(WARNING, "AOT: could not build %s", so_path);
+    remove(tmp_c_path);
+    goto defer;
+  }
+  ok = aot_open(kernel, so_path);
+
+defer:
+  da_free(source);
+  da_free(cached);
+  nob_temp_rewind(checkpoint);
+  return ok;
+}
+
+void aot_unload_kernel(Aot_Kernel *kernel) {
+  if (kernel->handle)
+    dlclose(kernel->handle);
+  memset(kernel, 0, sizeof(*kernel));
+}
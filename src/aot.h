@@ -0,0 +1,32 @@
+#pragma once
+#include "node.h"
+#include <stddef.h>
+
+// Native AOT backend: the function is emitted as a C translation unit with a
+// row kernel, built by the local C compiler into a shared object and loaded
+// with dlopen. Objects are cached in AOT_CACHE_DIR under the target that
+// -march=native resolves to, the math tier and the structural hash of the
+// tree, next to the C they were built from, and only reused when that C is
+// the C the function emits now. A known function is only compiled once.
+#define AOT_CACHE_DIR ".aot_cache"
+// Bump when the generated code or AOT_CFLAGS change to invalidate the cache
+#define AOT_VERSION 5
+#define AOT_ROW_SYMBOL "randomart_row"
+
+// -ffp-contract=off keeps -march=native from fusing multiply-adds, so the
+// kernel computes exactly what the interpreters compute
+#define AOT_CFLAGS                                                             \
+  "-O3", "-march=native", "-ffp-contract=off", "-fno-math-errno", "-shared",   \
+      "-fPIC"
+
+typedef void (*Aot_Row_Func)(const float *xs, float y, float t, size_t n,
+                             float *r, float *g, float *b);
+
+typedef struct {
+  Aot_Row_Func row;
+  void *handle;
+  uint64_t hash;
+} Aot_Kernel;
+
+bool aot_load_kernel(Aot_Kernel *kernel, Node *f, const Math_Funcs *math);
+void aot_unload_kernel(Aot_Kernel *kernel);
@@ -0,0 +1,152 @@
+#include "cost.h"
+#include "cse.h"
+#include "hoist.h"
+
+#include <assert.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+Node *cost_chain(Node_Kind kind, size_t length) {
+  Node *value = node_add(node_x(), node_y());
+  if (length == 0)
+    return node_triple(value, node_x(), node_y());
+
+  switch (kind) {
+  case NK_SQRT:
+  case NK_ABS:
+  case NK_SIN:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+    for (size_t i = 0; i < length; ++i)
+      value = node_unop_loc(__FILE__, __LINE__, kind, value);
+    return node_triple(value, node_x(), node_y());
+
+  // The other operand alternates, so cse() has nothing to merge
+  case NK_ADD:
+  case NK_MULT:
+  case NK_MOD:
+    for (size_t i = 0; i < length; ++i) {
+      Node *operand = i % 2 == 0 ? node_x() : node_y();
+      value = node_binop_loc(__FILE__, __LINE__, kind, value, operand);
+    }
+    return node_triple(value, node_x(), node_y());
+
+  case NK_MULT_ADD:
+    for (size_t i = 0; i < length; ++i) {
+      Node *node = node_loc(__FILE__, __LINE__, NK_MULT_ADD);
+      node->as.mult_add.lhs = value;
+      node->as.mult_add.rhs = node_x();
+      node->as.mult_add.addend = node_y();
+      value = node;
+    }
+    return node_triple(value, node_x(), node_y());
+
+  // Both branches are the same node, so every level runs one of them
+  case NK_IF: {
+    Node *triple = node_triple(value, node_x(), node_y());
+    for (size_t i = 0; i < length; ++i) {
+      Node *cond = node_gt(node_add(node_x(), node_y()),
+                           node_number((float)i / length));
+      triple = node_if(cond, triple, triple);
+    }
+    return triple;
+  }
+
+  case NK_X:
+  case NK_Y:
+  case NK_T:
+  case NK_NUMBER:
+  case NK_BOOLEAN:
+  case NK_GT:
+  case NK_TRIPLE:
+  case NK_RULE:
+  case NK_RANDOM:
+  default:
+    return NULL;
+  }
+}
+
+typedef struct {
+  const Cost_Table *table;
+  bool *seen; // by Node.slot, shared nodes run once
+  // Nanoseconds of the nodes evaluated per pixel, column, row and frame
+  double ns[COUNT_HOIST_LEVELS + 1];
+  size_t nodes;
+  size_t hoisted[COUNT_HOIST_LEVELS]; // values of the hoisting tables
+} Cost_Walk;
+
+#define COST_PIXEL COUNT_HOIST_LEVELS
+
+static size_t cost_level(Node *expr) {
+  bool x = expr->deps & NODE_DEP_X;
+  bool y = expr->deps & NODE_DEP_Y;
+  return x && y ? COST_PIXEL : x ? HOIST_COLUMN : y ? HOIST_ROW : HOIST_FRAME;
+}
+
+// A node waiting for cost_walk(), with what its parent passes down
+typedef struct {
+  Node *node;
+  size_t parent_level;
+  double weight;
+} Cost_Visit;
+
+/// Visit the nodes in preorder, so a shared node is costed at its first
+/// parent
+static void cost_walk(Cost_Walk *w, Node *f) {
+  struct {
+    Cost_Visit *items;
+    size_t count;
+    size_t capacity;
+  } stack = {0};
+  da_append(&stack, ((Cost_Visit){f, COST_PIXEL, 1.0}));
+  while (stack.count > 0) {
+    Cost_Visit visit = stack.items[--stack.count];
+    Node *expr = visit.node;
+    if (expr->slot > 0) {
+      if (w->seen[expr->slot])
+        continue;
+      w->seen[expr->slot] = true;
+    }
+
+    size_t level = cost_level(expr);
+    if (level != COST_PIXEL && visit.parent_level == COST_PIXEL)
+      w->hoisted[level] += 1;
+    w->ns[level] += visit.weight * w->table->ns[expr->kind];
+    w->nodes += 1;
+
+    // Pushed last to first, so the first child comes out next
+    Node *children[3];
+    size_t children_count = node_children(expr, children);
+    for (size_t i = children_count; i-- > 0;) {
+      double weight = expr->kind == NK_IF && i > 0 ? visit.weight / 2
+                                                   : visit.weight;
+      da_append(&stack, ((Cost_Visit){children[i], level, weight}));
+    }
+  }
+  free(stack.items);
+}
+
+Cost_Prediction cost_predict(const Cost_Table *table, Node *f, size_t width,
+                             size_t height, size_t frames) {
+  node_deps(f);
+  Cost_Walk w = {.table = table};
+  w.seen = calloc(node_slot_count(f) + 1, sizeof(*w.seen));
+  assert(w.seen != NULL && "Buy more RAM lol");
+  cost_walk(&w, f);
+  free(w.seen);
+
+  double pixels = (double)width * height;
+  double frame_ns = pixels * (table->pixel_ns + w.ns[COST_PIXEL]) +
+                    width * w.ns[HOIST_COLUMN] + height * w.ns[HOIST_ROW] +
+                    w.ns[HOIST_FRAME];
+  size_t values = w.hoisted[HOIST_FRAME] + width * w.hoisted[HOIST_COLUMN] +
+                  height * w.hoisted[HOIST_ROW];
+  return (Cost_Prediction){
+      .pixel_ns = frame_ns / pixels,
+      .seconds = frame_ns * frames * 1e-9,
+      .bytes = width * height * sizeof(Color) + w.nodes * sizeof(Node) +
+               values * sizeof(float),
+  };
+}
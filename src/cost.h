@@ -0,0 +1,36 @@
+#pragma once
+#include "node.h"
+
+// Render cost model: what one evaluation of every Node_Kind adds to the
+// render time of a pixel, measured on the host by render_calibrate()
+// (render.h) with the engine and options of the render to predict. The
+// prediction of a function adds up its unique nodes (cse()) by how often
+// they run: for every pixel, or once per column, row or frame when hoisting
+// takes them out of the pixel loop. Each branch of a conditional counts for
+// half of the pixels.
+#define COST_KINDS (NK_RANDOM + 1)
+
+typedef struct {
+  double pixel_ns;       // a function doing next to nothing, per pixel
+  double ns[COST_KINDS]; // one evaluation of a kind, per pixel
+} Cost_Table;
+
+typedef struct {
+  double pixel_ns; // per pixel of a frame, hoisted work spread over them
+  double seconds;  // every frame
+  size_t bytes;    // image, function and hoisting tables
+} Cost_Prediction;
+
+// Nodes of a kind chained by the function render_calibrate() times
+#define COST_CHAIN_LENGTH 8
+
+// vec3 of `length` nodes of `kind` in a row, all of them read x and y so
+// none is hoisted. `length` 0 is the baseline the chains are compared with.
+// NULL for kinds that are measured with another one: leaves and vec3 are
+// part of the baseline, and gt() is counted with the if() it is the
+// condition of.
+Node *cost_chain(Node_Kind kind, size_t length);
+
+// `f` must already have passed cse()
+Cost_Prediction cost_predict(const Cost_Table *table, Node *f, size_t width,
+                             size_t height, size_t frames);
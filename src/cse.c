@@ -0,0 +1,260 @@
+#include "cse.h"
+
+#include <assert.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+// Open addressing table of nodes, keyed either by address (the nodes of the
+// input tree) or by structure (the unique nodes of the DAG)
+typedef struct {
+  Node *node;
+  Node *canonical; // by address: the unique node it was merged into
+  size_t count;    // by address: size of its tree, by structure: parents
+} Cse_Entry;
+
+typedef struct {
+  Cse_Entry *items;
+  size_t count;
+  size_t capacity;
+} Cse_Table;
+
+typedef struct {
+  Cse_Table seen;
+  Cse_Table unique;
+} Cse;
+
+static uint64_t cse_mix(uint64_t hash, uint64_t value) {
+  hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  return hash * 0xff51afd7ed558ccdULL;
+}
+
+/// Children are already unique, so comparing their addresses is enough
+static uint64_t cse_structure_hash(Node *node) {
+  uint64_t hash = cse_mix(0, node->kind);
+  if (node->kind == NK_NUMBER) {
+    uint32_t bits;
+    memcpy(&bits, &node->as.number, sizeof(bits));
+    hash = cse_mix(hash, bits);
+  } else if (node->kind == NK_BOOLEAN) {
+    hash = cse_mix(hash, node->as.boolean);
+  }
+
+  Node *children[3];
+  size_t children_count = node_children(node, children);
+  for (size_t i = 0; i < children_count; ++i)
+    hash = cse_mix(hash, (uintptr_t)children[i]);
+  return hash;
+}
+
+static bool cse_structure_equal(Node *a, Node *b) {
+  if (a->kind != b->kind)
+    return false;
+  // Bitwise, so 0.0 and -0.0 stay apart
+  if (a->kind == NK_NUMBER &&
+      memcmp(&a->as.number, &b->as.number, sizeof(a->as.number)) != 0)
+    return false;
+  if (a->kind == NK_BOOLEAN && a->as.boolean != b->as.boolean)
+    return false;
+
+  Node *a_children[3], *b_children[3];
+  size_t children_count = node_children(a, a_children);
+  node_children(b, b_children);
+  for (size_t i = 0; i < children_count; ++i) {
+    if (a_children[i] != b_children[i])
+      return false;
+  }
+  return true;
+}
+
+static uint64_t cse_hash(Node *node, bool by_structure) {
+  return by_structure ? cse_structure_hash(node)
+                      : cse_mix(0, (uintptr_t)node);
+}
+
+static void cse_grow(Cse_Table *table, bool by_structure) {
+  Cse_Table grown = {.capacity = table->capacity ? table->capacity * 2 : 1024};
+  grown.items = calloc(grown.capacity, sizeof(*grown.items));
+  assert(grown.items != NULL && "Buy more RAM lol");
+
+  for (size_t i = 0; i < table->capacity; ++i) {
+    Cse_Entry *entry = &table->items[i];
+    if (!entry->node)
+      continue;
+    size_t j = cse_hash(entry->node, by_structure) & (grown.capacity - 1);
+    while (grown.items[j].node)
+      j = (j + 1) & (grown.capacity - 1);
+    grown.items[j] = *entry;
+    grown.count += 1;
+  }
+
+  free(table->items);
+  *table = grown;
+}
+
+/// Find the entry of `node`, or the empty entry it belongs into. The pointer
+/// is only valid until the next lookup.
+static Cse_Entry *cse_find(Cse_Table *table, Node *node, bool by_structure) {
+  if ((table->count + 1) * 2 > table->capacity)
+    cse_grow(table, by_structure);
+
+  size_t i = cse_hash(node, by_structure) & (table->capacity - 1);
+  for (;;) {
+    Cse_Entry *entry = &table->items[i];
+    if (!entry->node)
+      return entry;
+    if (by_structure ? cse_structure_equal(entry->node, node)
+                     : entry->node == node)
+      return entry;
+    i = (i + 1) & (table->capacity - 1);
+  }
+}
+
+typedef struct {
+  Node *canonical;
+  size_t size; // of its tree
+} Cse_Result;
+
+typedef struct {
+  Cse_Result *items;
+  size_t count;
+  size_t capacity;
+} Cse_Results;
+
+/// Merge the tree into the unique nodes bottom up and return the unique
+/// node standing for it
+static Node *cse_tree(Cse *cse, Node *f, size_t *tree_nodes) {
+  Node_Frames frames = {0};
+  // Results of the operands done, in order, waiting for their parent
+  Cse_Results results = {0};
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *node = frame->node;
+    if (frame->next == 0) {
+      Cse_Entry *seen = cse_find(&cse->seen, node, false);
+      if (seen->node) {
+        da_append(&results, ((Cse_Result){seen->canonical, seen->count}));
+        frames.count -= 1;
+        continue;
+      }
+    }
+
+    Node **children[3];
+    size_t children_count = node_child_refs(node, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, *children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+
+    results.count -= children_count;
+    size_t size = 1;
+    for (size_t i = 0; i < children_count; ++i) {
+      *children[i] = results.items[results.count + i].canonical;
+      size += results.items[results.count + i].size;
+    }
+
+    Cse_Entry *unique = cse_find(&cse->unique, node, true);
+    if (!unique->node) {
+      unique->node = node;
+      cse->unique.count += 1;
+    }
+    Node *canonical = unique->node;
+
+    Cse_Entry *seen = cse_find(&cse->seen, node, false);
+    *seen = (Cse_Entry){.node = node, .canonical = canonical, .count = size};
+    cse->seen.count += 1;
+    da_append(&results, ((Cse_Result){canonical, size}));
+  }
+
+  *tree_nodes = results.items[0].size;
+  f = results.items[0].canonical;
+  free(frames.items);
+  free(results.items);
+  return f;
+}
+
+/// Every unique node is walked into once, from the first parent counted
+static void cse_count_parents(Cse *cse, Node *f) {
+  Node_Frames stack = {0};
+  node_frames_push(&stack, f);
+  while (stack.count > 0) {
+    Node *node = stack.items[--stack.count].node;
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    for (size_t i = 0; i < children_count; ++i) {
+      Cse_Entry *entry = cse_find(&cse->unique, children[i], true);
+      entry->count += 1;
+      if (entry->count == 1)
+        node_frames_push(&stack, children[i]);
+    }
+  }
+  free(stack.items);
+}
+
+Node *cse(Node *f, Cse_Stats *stats) {
+  Cse cse = {0};
+  *stats = (Cse_Stats){0};
+  f = cse_tree(&cse, f, &stats->tree_nodes);
+  cse_count_parents(&cse, f);
+
+  // Leaves are cheaper to evaluate than to look up, and triples are only
+  // wrappers around their shared numbers
+  for (size_t i = 0; i < cse.unique.capacity; ++i) {
+    Cse_Entry *entry = &cse.unique.items[i];
+    if (!entry->node)
+      continue;
+    Node *children[3];
+    Node *node = entry->node;
+    node->slot = 0;
+    if (entry->count > 1 && node_children(node, children) > 0 &&
+        node->type != NK_TRIPLE)
+      node->slot = ++stats->slots;
+  }
+  stats->dag_nodes = cse.unique.count;
+
+  free(cse.seen.items);
+  free(cse.unique.items);
+  return f;
+}
+
+typedef struct {
+  bool *items;
+  size_t capacity;
+} Slot_Seen;
+
+size_t node_slot_count(Node *f) {
+  Slot_Seen seen = {0};
+  size_t count = 0;
+  Node_Frames stack = {0};
+  node_frames_push(&stack, f);
+  while (stack.count > 0) {
+    Node *node = stack.items[--stack.count].node;
+    if (node->slot > 0) {
+      if (node->slot >= seen.capacity) {
+        size_t capacity = seen.capacity ? seen.capacity : 64;
+        while (capacity <= node->slot)
+          capacity *= 2;
+        seen.items = realloc(seen.items, capacity * sizeof(*seen.items));
+        assert(seen.items != NULL && "Buy more RAM lol");
+        memset(seen.items + seen.capacity, 0,
+               (capacity - seen.capacity) * sizeof(*seen.items));
+        seen.capacity = capacity;
+      }
+      if (seen.items[node->slot])
+        continue;
+      seen.items[node->slot] = true;
+      if (node->slot > count)
+        count = node->slot;
+    }
+
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    for (size_t i = 0; i < children_count; ++i)
+      node_frames_push(&stack, children[i]);
+  }
+  free(seen.items);
+  free(stack.items);
+  return count;
+}
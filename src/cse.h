@@ -0,0 +1,17 @@
+#pragma once
+#include "node.h"
+
+// Common subexpression elimination: structurally identical subtrees of a
+// typechecked tree are merged into one shared node, turning the tree into a
+// DAG. Numbers and booleans that are used by several parents get a
+// `Node.slot`, so the evaluators can compute them once per pixel and reuse
+// the value everywhere else.
+typedef struct {
+  size_t tree_nodes; // nodes of the tree before merging
+  size_t dag_nodes;  // unique nodes after merging
+  size_t slots;      // shared nodes, numbered 1..slots
+} Cse_Stats;
+
+Node *cse(Node *f, Cse_Stats *stats);
+// Highest slot of the DAG, the size of a table indexed by Node.slot minus one
+size_t node_slot_count(Node *f);
@@ -0,0 +1,329 @@
+#include "fuse.h"
+#include "cse.h"
+
+#include <assert.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+typedef struct {
+  // Result of every shared node (Node.slot), NULL until it is fused
+  Node **shared;
+  Fuse_Stats *stats;
+  Node_Frames frames;
+  // Fused operands, in order, waiting for their parent
+  struct {
+    Node **items;
+    size_t count;
+    size_t capacity;
+  } results;
+} Fuse;
+
+/// Read by its one parent only, so merging it into the parent loses nothing
+static bool fuse_is_private(Node *expr, Node_Kind kind) {
+  return expr->kind == kind && expr->slot == 0;
+}
+
+/// The fused node takes the place of `at`, slot and all
+static Node *fuse_node_at(Node *at, Node_Kind kind) {
+  Node *node = node_loc(at->file, at->line, kind);
+  node->type = at->type;
+  node->slot = at->slot;
+  node->deps = at->deps;
+  return node;
+}
+
+static Node *fuse_unop(Node *at, Node_Kind kind, Node *value) {
+  Node *node = fuse_node_at(at, kind);
+  node->as.unop = value;
+  return node;
+}
+
+/// Returns `expr` itself when no pair of its operations can be fused
+static Node *fuse_rewrite(Node *expr) {
+  switch (expr->kind) {
+  case NK_SQRT:
+  case NK_SIN:
+    if (fuse_is_private(expr->as.unop, NK_ABS)) {
+      Node_Kind kind = expr->kind == NK_SQRT ? NK_SQRT_ABS : NK_SIN_ABS;
+      return fuse_unop(expr, kind, expr->as.unop->as.unop);
+    }
+    break;
+
+  // Addition commutes exactly, so the product may be either operand
+  case NK_ADD: {
+    Node *product = expr->as.binop.lhs;
+    Node *addend = expr->as.binop.rhs;
+    if (!fuse_is_private(product, NK_MULT)) {
+      product = expr->as.binop.rhs;
+      addend = expr->as.binop.lhs;
+    }
+    if (fuse_is_private(product, NK_MULT)) {
+      Node *node = fuse_node_at(expr, NK_MULT_ADD);
+      node->as.mult_add.lhs = product->as.binop.lhs;
+      node->as.mult_add.rhs = product->as.binop.rhs;
+      node->as.mult_add.addend = addend;
+      return node;
+    }
+  } break;
+
+  // cse() merged equal operands into the same node
+  case NK_MULT:
+    if (expr->as.binop.lhs == expr->as.binop.rhs)
+      return fuse_unop(expr, NK_SQUARE, expr->as.binop.lhs);
+    break;
+
+  case NK_X:
+  case NK_Y:
+  case NK_T:
+  case NK_NUMBER:
+  case NK_BOOLEAN:
+  case NK_ABS:
+  case NK_MOD:
+  case NK_GT:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  case NK_TRIPLE:
+  case NK_IF:
+    break;
+
+  case NK_RULE:
+  case NK_RANDOM:
+  default:
+    UNREACHABLE_CODE("fuse_rewrite");
+  }
+  return expr;
+}
+
+/// The operands are fused first, so a node sees what they turned into
+static Node *fuse_tree(Fuse *fuse, Node *f) {
+  node_frames_push(&fuse->frames, f);
+  while (fuse->frames.count > 0) {
+    Node_Frame *frame = &fuse->frames.items[fuse->frames.count - 1];
+    Node *expr = frame->node;
+    if (frame->next == 0 && expr->slot > 0 && fuse->shared[expr->slot]) {
+      fuse->frames.count -= 1;
+      da_append(&fuse->results, fuse->shared[expr->slot]);
+      continue;
+    }
+
+    Node *children[3];
+    size_t children_count = node_children(expr, children);
+    if (frame->next < children_count) {
+      node_frames_push(&fuse->frames, children[frame->next++]);
+      continue;
+    }
+    fuse->frames.count -= 1;
+
+    fuse->results.count -= children_count;
+    Node **fused_children = &fuse->results.items[fuse->results.count];
+    bool changed = false;
+    for (size_t i = 0; i < children_count; ++i)
+      changed = changed || fused_children[i] != children[i];
+
+    // Copy on write, `f` stays intact for the other engines
+    Node *result = expr;
+    if (changed) {
+      result = node_loc(expr->file, expr->line, expr->kind);
+      *result = *expr;
+      Node **refs[3];
+      node_child_refs(result, refs);
+      for (size_t i = 0; i < children_count; ++i)
+        *refs[i] = fused_children[i];
+    }
+
+    Node *fused = fuse_rewrite(result);
+    if (fused != result)
+      fuse->stats->fused += 1;
+    if (expr->slot > 0)
+      fuse->shared[expr->slot] = fused;
+    da_append(&fuse->results, fused);
+  }
+  return fuse->results.items[--fuse->results.count];
+}
+
+Node *fuse(Node *f, Fuse_Stats *stats) {
+  *stats = (Fuse_Stats){0};
+  stats->dispatches_before = fuse_dispatches(f);
+  Fuse fuse = {.stats = stats};
+  fuse.shared = calloc(node_slot_count(f) + 1, sizeof(*fuse.shared));
+  assert(fuse.shared != NULL && "Buy more RAM lol");
+  f = fuse_tree(&fuse, f);
+  free(fuse.shared);
+  free(fuse.frames.items);
+  free(fuse.results.items);
+  stats->dispatches_after = fuse_dispatches(f);
+  return f;
+}
+
+/// Every visit of a node is a dispatch, the operands of a shared node are
+/// dispatched the first time only
+static size_t fuse_count_dispatches(Node *f, bool *computed) {
+  size_t count = 0;
+  Node_Frames frames = {0};
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *expr = frame->node;
+    if (frame->next == 0) {
+      count += 1;
+      if (expr->slot > 0) {
+        if (computed[expr->slot]) {
+          frames.count -= 1;
+          continue;
+        }
+        computed[expr->slot] = true;
+      }
+    }
+
+    Node *children[3];
+    size_t children_count = node_children(expr, children);
+    if (frame->next < children_count)
+      node_frames_push(&frames, children[frame->next++]);
+    else
+      frames.count -= 1;
+  }
+  free(frames.items);
+  return count;
+}
+
+size_t fuse_dispatches(Node *f) {
+  bool *computed = calloc(node_slot_count(f) + 1, sizeof(*computed));
+  assert(computed != NULL && "Buy more RAM lol");
+  size_t count = fuse_count_dispatches(f, computed);
+  free(computed);
+  return count;
+}
+
+typedef struct {
+  char text[FUSE_SHAPE_MAX];
+  size_t length;
+  Node *names[6]; // operands named so far, the i-th one is 'a' + i
+  size_t name_count;
+} Fuse_Shape_Builder;
+
+static void fuse_shape_append(Fuse_Shape_Builder *b, const char *text) {
+  size_t length = strlen(text);
+  assert(b->length + length < FUSE_SHAPE_MAX);
+  memcpy(b->text + b->length, text, length + 1);
+  b->length += length;
+}
+
+static void fuse_shape_operand(Fuse_Shape_Builder *b, Node *operand) {
+  size_t i = 0;
+  while (i < b->name_count && b->names[i] != operand)
+    ++i;
+  if (i == b->name_count)
+    b->names[b->name_count++] = operand;
+  char name[2] = {'a' + i, '\0'};
+  fuse_shape_append(b, name);
+}
+
+/// `expr` over named operands, except for `inner` which is spelled out
+static void fuse_shape_node(Fuse_Shape_Builder *b, Node *expr, Node *inner) {
+  Node *children[3];
+  size_t children_count = node_children(expr, children);
+  fuse_shape_append(b, node_kind_string(expr->kind));
+  fuse_shape_append(b, "(");
+  for (size_t i = 0; i < children_count; ++i) {
+    if (i > 0)
+      fuse_shape_append(b, ", ");
+    if (children[i] == inner)
+      fuse_shape_node(b, inner, NULL);
+    else
+      fuse_shape_operand(b, children[i]);
+  }
+  fuse_shape_append(b, ")");
+}
+
+/// Mirrors fuse_rewrite(), `inner` is NULL for a repeated operand
+static bool fuse_merges(Node *expr, Node *inner) {
+  if (inner == NULL)
+    return expr->kind == NK_MULT;
+  if (expr->kind == NK_ADD)
+    return inner->kind == NK_MULT;
+  if (expr->kind == NK_SQRT || expr->kind == NK_SIN)
+    return inner->kind == NK_ABS;
+  return false;
+}
+
+static void fuse_count_shape(Fuse_Shapes *shapes, Node *expr, Node *inner) {
+  Fuse_Shape_Builder b = {0};
+  fuse_shape_node(&b, expr, inner);
+  for (size_t i = 0; i < shapes->count; ++i) {
+    if (strcmp(shapes->items[i].text, b.text) == 0) {
+      shapes->items[i].count += 1;
+      return;
+    }
+  }
+
+  if (shapes->count == shapes->capacity) {
+    shapes->capacity = shapes->capacity ? shapes->capacity * 2 : 64;
+    shapes->items = realloc(shapes->items,
+                            shapes->capacity * sizeof(*shapes->items));
+    assert(shapes->items != NULL && "Buy more RAM lol");
+  }
+  Fuse_Shape *shape = &shapes->items[shapes->count++];
+  memcpy(shape->text, b.text, sizeof(shape->text));
+  shape->count = 1;
+  shape->fused = fuse_merges(expr, inner);
+}
+
+/// Triples and conditionals only wrap their operands, leaves have none
+static bool fuse_is_operation(Node *expr) {
+  Node *children[3];
+  return expr->type != NK_TRIPLE && node_children(expr, children) > 0;
+}
+
+static void fuse_mine_node(Node *expr, Fuse_Shapes *shapes) {
+  if (!fuse_is_operation(expr))
+    return;
+
+  Node *children[3];
+  size_t children_count = node_children(expr, children);
+  bool repeated = false;
+  for (size_t i = 0; i < children_count; ++i) {
+    for (size_t j = 0; j < i; ++j)
+      repeated = repeated || children[i] == children[j];
+    if (children[i]->slot == 0 && fuse_is_operation(children[i]))
+      fuse_count_shape(shapes, expr, children[i]);
+  }
+  if (repeated)
+    fuse_count_shape(shapes, expr, NULL);
+}
+
+/// Mine the operands before their parent, shared nodes once
+static void fuse_mine_tree(Node *f, Fuse_Shapes *shapes, bool *mined) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *expr = frame->node;
+    if (frame->next == 0 && expr->slot > 0) {
+      if (mined[expr->slot]) {
+        frames.count -= 1;
+        continue;
+      }
+      mined[expr->slot] = true;
+    }
+
+    Node *children[3];
+    size_t children_count = node_children(expr, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+    fuse_mine_node(expr, shapes);
+  }
+  free(frames.items);
+}
+
+void fuse_mine_shapes(Node *f, Fuse_Shapes *shapes) {
+  bool *mined = calloc(node_slot_count(f) + 1, sizeof(*mined));
+  assert(mined != NULL && "Buy more RAM lol");
+  fuse_mine_tree(f, shapes, mined);
+  free(mined);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "node.h"
+
+// Superinstructions for the tree interpreter: eval() pays a dispatch for
+// every node, so the most frequent pairs of operations of generated
+// functions become one fused node (NK_MULT_ADD, NK_SQRT_ABS, NK_SIN_ABS,
+// NK_SQUARE) that rounds exactly like the pair did. Only eval() and the
+// interval evaluator know the fused kinds, the other engines compile the
+// function as it came out of cse().
+typedef struct {
+  size_t fused;             // pairs of nodes merged into one
+  size_t dispatches_before; // eval() calls per pixel, see fuse_dispatches()
+  size_t dispatches_after;
+} Fuse_Stats;
+
+// `f` must already have passed cse(). A node is only merged into its parent
+// when nothing else reads it, so no shared value is computed twice. The
+// result may share nodes with `f`, which is left untouched.
+Node *fuse(Node *f, Fuse_Stats *stats);
+
+// eval() calls for one pixel of the DAG: every shared node is computed once,
+// both branches of a conditional count and nothing is hoisted yet
+size_t fuse_dispatches(Node *f);
+
+// Shape of operations that could merge into one dispatch, e.g.
+// "add(mult(a, b), c)". Operands are named by identity, so "mult(a, a)"
+// reads the same value twice.
+#define FUSE_SHAPE_MAX 64
+
+typedef struct {
+  char text[FUSE_SHAPE_MAX];
+  size_t count;
+  bool fused; // whether fuse() already merges it
+} Fuse_Shape;
+
+typedef struct {
+  Fuse_Shape *items;
+  size_t count;
+  size_t capacity;
+} Fuse_Shapes;
+
+// Count the shapes of the DAG `f`: every operation with each operand that
+// nothing else reads, and every operation reading one operand twice. The
+// counts add up across calls, so a batch of functions can be mined.
+void fuse_mine_shapes(Node *f, Fuse_Shapes *shapes);
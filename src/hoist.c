@@ -0,0 +1,132 @@
+#include "hoist.h"
+#include "cse.h"
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+void node_deps(Node *expr) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, expr);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *node = frame->node;
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+
+    uint8_t deps = node->kind == NK_X   ? NODE_DEP_X
+                   : node->kind == NK_Y ? NODE_DEP_Y
+                   : node->kind == NK_T ? NODE_DEP_T
+                                        : 0;
+    for (size_t i = 0; i < children_count; ++i)
+      deps |= children[i]->deps;
+    node->deps = deps;
+  }
+  free(frames.items);
+}
+
+static bool hoist_level(Node *expr, Hoist_Level *level) {
+  bool x = expr->deps & NODE_DEP_X;
+  bool y = expr->deps & NODE_DEP_Y;
+  *level = x ? HOIST_COLUMN : y ? HOIST_ROW : HOIST_FRAME;
+  return !(x && y);
+}
+
+/// Collect the invariant children of a node that is evaluated per pixel.
+/// Leaves are cheaper to evaluate than to load, and triples are only
+/// wrappers, so their numbers are hoisted instead.
+static void hoist_collect(Hoist *hoist, Node *expr, size_t *slot_count) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, expr);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *children[3];
+    size_t children_count = node_children(frame->node, children);
+    if (frame->next >= children_count) {
+      frames.count -= 1;
+      continue;
+    }
+
+    Node *child = children[frame->next++];
+    if (child->hoisted)
+      continue;
+
+    Node *grandchildren[3];
+    Hoist_Level level;
+    if (child->type != NK_TRIPLE && node_children(child, grandchildren) > 0 &&
+        hoist_level(child, &level)) {
+      // Marked right away so a node shared by several parents is collected
+      // once
+      child->hoisted = true;
+      if (child->slot == 0)
+        child->slot = ++*slot_count;
+      da_append(&hoist->levels[level], child);
+      continue;
+    }
+
+    node_frames_push(&frames, child);
+  }
+  free(frames.items);
+}
+
+static void hoist_mark(Hoist *hoist, bool hoisted) {
+  for (size_t level = 0; level < COUNT_HOIST_LEVELS; ++level) {
+    for (size_t i = 0; i < hoist->levels[level].count; ++i)
+      hoist->levels[level].items[i]->hoisted = hoisted;
+  }
+}
+
+static float hoist_eval(Node *expr, Eval_Memo *memo, float x, float y,
+                        float t) {
+  eval_memo_next(memo);
+  Value value = eval(expr, memo, x, y, t);
+  return expr->type == NK_BOOLEAN ? value.as.boolean : value.as.number;
+}
+
+static void hoist_eval_level(Hoist *hoist, Hoist_Level level, Eval_Memo *memo,
+                             const float *xs, const float *ys, size_t count,
+                             float t) {
+  Hoist_Nodes *nodes = &hoist->levels[level];
+  hoist->values[level] = malloc(count * nodes->count * sizeof(float));
+  assert(hoist->values[level] != NULL && "Buy more RAM lol");
+
+  for (size_t index = 0; index < count; ++index) {
+    float *values = (float *)hoist_values(hoist, level, index);
+    float x = level == HOIST_COLUMN ? xs[index] : 0.0f;
+    float y = level == HOIST_ROW ? ys[index] : 0.0f;
+    for (size_t i = 0; i < nodes->count; ++i)
+      values[i] = hoist_eval(nodes->items[i], memo, x, y, t);
+  }
+}
+
+void hoist_nodes(Hoist *hoist, Node *f, const float *xs, size_t width,
+                 const float *ys, size_t height, float t,
+                 const Math_Funcs *math) {
+  node_deps(f);
+  size_t slot_count = node_slot_count(f);
+  hoist_collect(hoist, f, &slot_count);
+
+  // The tables hold the bodies of the hoisted nodes, so evaluate them while
+  // none of them is hoisted yet
+  hoist_mark(hoist, false);
+  Eval_Memo memo;
+  eval_memo_init(&memo, slot_count, math);
+  hoist_eval_level(hoist, HOIST_FRAME, &memo, xs, ys, 1, t);
+  hoist_eval_level(hoist, HOIST_COLUMN, &memo, xs, ys, width, t);
+  hoist_eval_level(hoist, HOIST_ROW, &memo, xs, ys, height, t);
+  eval_memo_free(&memo);
+  hoist_mark(hoist, true);
+}
+
+void hoist_free(Hoist *hoist) {
+  hoist_mark(hoist, false);
+  for (size_t level = 0; level < COUNT_HOIST_LEVELS; ++level) {
+    da_free(hoist->levels[level]);
+    free(hoist->values[level]);
+  }
+  memset(hoist, 0, sizeof(*hoist));
+}
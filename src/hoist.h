@@ -0,0 +1,46 @@
+#pragma once
+#include "node.h"
+
+// Loop-invariant hoisting: every node is tagged with the variables its
+// subtree reads (Node.deps). Within one frame t never changes, so a subtree
+// that does not read both x and y is invariant along a row, a column or the
+// whole frame. The largest such subtrees below the per-pixel part of the
+// function are evaluated up front into tables and marked `hoisted`, and
+// the evaluators read their slot instead of computing them for every pixel.
+#define NODE_DEP_X (1 << 0)
+#define NODE_DEP_Y (1 << 1)
+#define NODE_DEP_T (1 << 2)
+
+typedef enum {
+  HOIST_FRAME,  // reads neither x nor y, once per frame
+  HOIST_COLUMN, // reads x but not y, once per column
+  HOIST_ROW,    // reads y but not x, once per row
+  COUNT_HOIST_LEVELS,
+} Hoist_Level;
+
+typedef struct {
+  Node **items;
+  size_t count;
+  size_t capacity;
+} Hoist_Nodes;
+
+typedef struct {
+  Hoist_Nodes levels[COUNT_HOIST_LEVELS];
+  // Value of the i-th node of a level, booleans stored as 0 or 1:
+  // frame at [i], column x at [x * count + i], row y at [y * count + i]
+  float *values[COUNT_HOIST_LEVELS];
+} Hoist;
+
+void node_deps(Node *f);
+// `f` must already have passed cse(), hoisted nodes get a slot of their own
+// if they did not have one. The tables are evaluated with the sin of `math`.
+void hoist_nodes(Hoist *hoist, Node *f, const float *xs, size_t width,
+                 const float *ys, size_t height, float t,
+                 const Math_Funcs *math);
+// Also clears the `hoisted` mark of the nodes
+void hoist_free(Hoist *hoist);
+
+static inline const float *hoist_values(const Hoist *hoist, Hoist_Level level,
+                                        size_t index) {
+  return &hoist->values[level][index * hoist->levels[level].count];
+}
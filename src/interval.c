@@ -0,0 +1,343 @@
+#include "interval.h"
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+// Every float operation of the evaluators rounds monotonically, so applying
+// the same operation to the ends of the operands bounds all of its results
+
+static Interval interval_any(void) {
+  return (Interval){.lo = -INFINITY, .hi = INFINITY, .nan = true};
+}
+
+static Interval interval_point(float value) {
+  if (isnan(value))
+    return interval_any();
+  return (Interval){.lo = value, .hi = value};
+}
+
+static bool interval_contains_zero(Interval a) {
+  return a.lo <= 0.0f && 0.0f <= a.hi;
+}
+
+static bool interval_is_infinite(Interval a) {
+  return isinf(a.lo) || isinf(a.hi);
+}
+
+/// Bounds of the results of a binary operation at the four corners of its
+/// operands, NaN corners only set the flag
+static Interval interval_corners(const float corners[4], bool nan) {
+  Interval result = {.lo = INFINITY, .hi = -INFINITY, .nan = nan};
+  for (size_t i = 0; i < 4; ++i) {
+    if (isnan(corners[i])) {
+      result.nan = true;
+    } else {
+      result.lo = fminf(result.lo, corners[i]);
+      result.hi = fmaxf(result.hi, corners[i]);
+    }
+  }
+  if (result.lo > result.hi)
+    return interval_any();
+  return result;
+}
+
+static Interval interval_add(Interval a, Interval b) {
+  float corners[4] = {a.lo + b.lo, a.lo + b.hi, a.hi + b.lo, a.hi + b.hi};
+  return interval_corners(corners, a.nan || b.nan);
+}
+
+static Interval interval_mult(Interval a, Interval b) {
+  float corners[4] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+  // Infinity times zero is NaN, and the zero may be inside the other operand
+  bool nan = a.nan || b.nan ||
+             (interval_is_infinite(a) && interval_contains_zero(b)) ||
+             (interval_is_infinite(b) && interval_contains_zero(a));
+  return interval_corners(corners, nan);
+}
+
+static Interval interval_sqrt(Interval a) {
+  if (a.hi < 0.0f)
+    return interval_any();
+  return (Interval){
+      .lo = UNOP_MAPPER(NK_SQRT, fmaxf(a.lo, 0.0f)),
+      .hi = UNOP_MAPPER(NK_SQRT, a.hi),
+      .nan = a.nan || a.lo < 0.0f,
+  };
+}
+
+static Interval interval_abs(Interval a) {
+  if (a.lo >= 0.0f)
+    return a;
+  if (a.hi <= 0.0f)
+    return (Interval){.lo = -a.hi, .hi = -a.lo, .nan = a.nan};
+  return (Interval){.lo = 0.0f, .hi = fmaxf(-a.lo, a.hi), .nan = a.nan};
+}
+
+/// Both operands are the same value, so the signs agree
+static Interval interval_square(Interval a) {
+  Interval result = interval_abs(a);
+  float lo = result.lo * result.lo, hi = result.hi * result.hi;
+  return (Interval){.lo = lo, .hi = hi, .nan = a.nan};
+}
+
+/// Whether `phase + 2*k*pi` lies within lo..hi for some integer k
+static bool interval_has_extremum(double lo, double hi, double phase) {
+  double k = ceil((lo - phase) / (2 * M_PI));
+  return phase + 2 * k * M_PI <= hi;
+}
+
+/// Bounds of the precise sin, widened by `error` for the approximations
+static Interval interval_sin(Interval a, float error) {
+  Interval result = {.lo = -1.0f, .hi = 1.0f, .nan = a.nan};
+  if (interval_is_infinite(a)) {
+    result.nan = true;
+  } else if ((double)a.hi - a.lo < 2 * M_PI) {
+    double lo = a.lo, hi = a.hi;
+    float ends[2] = {UNOP_MAPPER(NK_SIN, a.lo), UNOP_MAPPER(NK_SIN, a.hi)};
+    result.lo = fminf(ends[0], ends[1]);
+    result.hi = fmaxf(ends[0], ends[1]);
+    // pi is inexact, so look for extrema a little beyond the ends
+    double slack = 1e-6 * fmax(1.0, fmax(fabs(lo), fabs(hi)));
+    if (interval_has_extremum(lo - slack, hi + slack, M_PI / 2))
+      result.hi = 1.0f;
+    if (interval_has_extremum(lo - slack, hi + slack, -M_PI / 2))
+      result.lo = -1.0f;
+    // sin() is only faithfully rounded, which may wiggle by an ulp
+    result.lo = fmaxf(nextafterf(result.lo, -INFINITY), -1.0f);
+    result.hi = fminf(nextafterf(result.hi, INFINITY), 1.0f);
+  }
+  // The error is far above an ulp of the bounds, so rounding the sum
+  // cannot take back what it adds
+  result.lo -= error;
+  result.hi += error;
+  return result;
+}
+
+static Interval interval_mod(Interval a, Interval b) {
+  bool nan = a.nan || b.nan || interval_is_infinite(a) ||
+             interval_contains_zero(b);
+  // |fmodf(a, b)| is below |b|, at most |a| and has the sign of a
+  float a_max = fmaxf(fabsf(a.lo), fabsf(a.hi));
+  float b_max = fmaxf(fabsf(b.lo), fabsf(b.hi));
+  float max = fminf(a_max, b_max);
+  Interval result = {
+      .lo = a.lo < 0.0f ? -max : 0.0f,
+      .hi = a.hi > 0.0f ? max : 0.0f,
+      .nan = nan,
+  };
+
+  // Between two multiples of a constant b it is a - k*b, which fmodf()
+  // computes exactly, so it only falls where the range wraps around. Less
+  // than |b| apart it wraps at most once, and then the end is below the
+  // start.
+  bool one_sign = a.lo >= 0.0f || a.hi <= 0.0f;
+  if (!nan && one_sign && b.lo == b.hi &&
+      (double)a.hi - (double)a.lo < fabs((double)b.lo)) {
+    float lo = BINOP_MAPPER(NK_MOD, a.lo, b.lo);
+    float hi = BINOP_MAPPER(NK_MOD, a.hi, b.lo);
+    if (lo <= hi) {
+      result.lo = lo;
+      result.hi = hi;
+    }
+  }
+  return result;
+}
+
+/// NaN is not greater than anything
+static Interval interval_gt(Interval a, Interval b) {
+  Interval result = {.lo = 0.0f, .hi = 1.0f};
+  if (a.hi <= b.lo)
+    result.hi = 0.0f;
+  else if (!a.nan && !b.nan && a.lo > b.hi)
+    result.lo = 1.0f;
+  return result;
+}
+
+static Interval interval_hull(Interval a, Interval b) {
+  return (Interval){
+      .lo = fminf(a.lo, b.lo),
+      .hi = fmaxf(a.hi, b.hi),
+      .nan = a.nan || b.nan,
+  };
+}
+
+void interval_operation(Node *expr, const Math_Funcs *math,
+                        Interval operands[3][3], Interval *result) {
+  switch (expr->kind) {
+  case NK_SQRT:
+    result[0] = interval_sqrt(operands[0][0]);
+    break;
+  case NK_ABS:
+    result[0] = interval_abs(operands[0][0]);
+    break;
+  case NK_SIN:
+    result[0] = interval_sin(operands[0][0], math->sin_error);
+    break;
+  case NK_ADD:
+    result[0] = interval_add(operands[0][0], operands[1][0]);
+    break;
+  // Trees before cse() repeat a squared value as two separate nodes
+  case NK_MULT:
+    result[0] = node_equal(expr->as.binop.lhs, expr->as.binop.rhs)
+                    ? interval_square(operands[0][0])
+                    : interval_mult(operands[0][0], operands[1][0]);
+    break;
+  case NK_MOD:
+    result[0] = interval_mod(operands[0][0], operands[1][0]);
+    break;
+  case NK_GT:
+    result[0] = interval_gt(operands[0][0], operands[1][0]);
+    break;
+
+  // The fused kinds round exactly like the operations they replace
+  case NK_MULT_ADD: {
+    Interval product = node_equal(expr->as.mult_add.lhs,
+                                  expr->as.mult_add.rhs)
+                           ? interval_square(operands[0][0])
+                           : interval_mult(operands[0][0], operands[1][0]);
+    result[0] = interval_add(product, operands[2][0]);
+  } break;
+  case NK_SQRT_ABS:
+    result[0] = interval_sqrt(interval_abs(operands[0][0]));
+    break;
+  case NK_SIN_ABS:
+    result[0] = interval_sin(interval_abs(operands[0][0]), math->sin_error);
+    break;
+  case NK_SQUARE:
+    result[0] = interval_square(operands[0][0]);
+    break;
+
+  case NK_TRIPLE:
+    for (size_t i = 0; i < 3; ++i)
+      result[i] = operands[i][0];
+    break;
+
+  case NK_IF: {
+    Interval cond = operands[0][0];
+    size_t width = expr->type == NK_TRIPLE ? 3 : 1;
+    for (size_t i = 0; i < width; ++i) {
+      result[i] = cond.lo > 0.0f     ? operands[1][i]
+                  : cond.hi == 0.0f ? operands[2][i]
+                                    : interval_hull(operands[1][i],
+                                                    operands[2][i]);
+    }
+  } break;
+
+  case NK_X:
+  case NK_Y:
+  case NK_T:
+  case NK_NUMBER:
+  case NK_BOOLEAN:
+  case NK_RULE:
+  case NK_RANDOM:
+  default:
+    UNREACHABLE_CODE("interval_operation");
+  }
+}
+
+/// Bounds of a leaf
+static Interval eval_interval_leaf(Interval_Box *box, Node *expr) {
+  switch (expr->kind) {
+  case NK_X:
+    return box->x;
+  case NK_Y:
+    return box->y;
+  case NK_T:
+    return box->t;
+  case NK_NUMBER:
+    return interval_point(expr->as.number);
+  case NK_BOOLEAN:
+    return interval_point(expr->as.boolean);
+
+  case NK_SQRT:
+  case NK_ABS:
+  case NK_SIN:
+  case NK_ADD:
+  case NK_MULT:
+  case NK_MOD:
+  case NK_GT:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  case NK_TRIPLE:
+  case NK_IF:
+  case NK_RULE:
+  case NK_RANDOM:
+  default:
+    UNREACHABLE_CODE("eval_interval_leaf");
+  }
+}
+
+// Frame state of an NK_IF whose condition settled: only the branch it picks
+// is bounded, and its bounds are those of the NK_IF
+#define INTERVAL_IF_PICKED 4
+
+void eval_interval(Interval_Box *box, Node *expr, Interval *result) {
+  Interval_Stacks own = {0};
+  Interval_Stacks *stacks = box->stacks ? box->stacks : &own;
+  Node_Frames *frames = &stacks->frames;
+  frames->count = 0;
+  stacks->values.count = 0;
+  node_frames_push(frames, expr);
+  while (frames->count > 0) {
+    Node_Frame *frame = &frames->items[frames->count - 1];
+    Node *node = frame->node;
+    if (frame->next == 0 && node->slot > 0 && box->filled[node->slot]) {
+      da_append(&stacks->values,
+                ((Interval_Value){.v[0] = box->slots[node->slot]}));
+      frames->count -= 1;
+      continue;
+    }
+
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    if (children_count == 0) {
+      da_append(&stacks->values,
+                ((Interval_Value){.v[0] = eval_interval_leaf(box, node)}));
+    } else if (node->kind == NK_IF && frame->next == 1) {
+      // A settled condition picks its branch for the whole box, without
+      // bounding the other one
+      Interval cond = stacks->values.items[stacks->values.count - 1].v[0];
+      if (cond.lo > 0.0f || cond.hi == 0.0f) {
+        stacks->values.count -= 1;
+        frame->next = INTERVAL_IF_PICKED;
+        node_frames_push(frames, cond.lo > 0.0f ? children[1] : children[2]);
+        continue;
+      }
+      node_frames_push(frames, children[frame->next++]);
+      continue;
+    } else if (frame->next < children_count) {
+      node_frames_push(frames, children[frame->next++]);
+      continue;
+    } else if (frame->next == children_count) {
+      Interval operands[3][3];
+      stacks->values.count -= children_count;
+      for (size_t i = 0; i < children_count; ++i) {
+        memcpy(operands[i], stacks->values.items[stacks->values.count + i].v,
+               sizeof(operands[i]));
+      }
+      Interval_Value value;
+      interval_operation(node, box->math, operands, value.v);
+      da_append(&stacks->values, value);
+    }
+
+    frames->count -= 1;
+    if (node->slot > 0) {
+      box->slots[node->slot] =
+          stacks->values.items[stacks->values.count - 1].v[0];
+      box->filled[node->slot] = true;
+    }
+  }
+
+  size_t width = expr->type == NK_TRIPLE ? 3 : 1;
+  memcpy(result, stacks->values.items[0].v, width * sizeof(*result));
+  if (stacks == &own)
+    interval_stacks_free(&own);
+}
+
+void interval_stacks_free(Interval_Stacks *stacks) {
+  free(stacks->frames.items);
+  free(stacks->values.items);
+  *stacks = (Interval_Stacks){0};
+}
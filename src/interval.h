@@ -0,0 +1,52 @@
+#pragma once
+#include "node.h"
+
+// Interval evaluator: bounds every value of a typechecked tree over a box of
+// x, y and t, so a block of pixels whose bounds quantize to one color can be
+// filled without evaluating any of its pixels. The bounds hold for the float
+// operations the evaluators actually perform, not just in exact arithmetic,
+// and sin is widened by the error of the math tier the engines run with.
+// Booleans are bounded by 0 and 1, and a condition whose bounds are settled
+// picks a single branch of an NK_IF.
+typedef struct {
+  float lo;
+  float hi;
+  bool nan; // may also be NaN, `lo` and `hi` then bound the other values
+} Interval;
+
+// Bounds of one value, three for a triple
+typedef struct {
+  Interval v[3];
+} Interval_Value;
+
+// Explicit stacks of eval_interval(), they only grow with the depth of the
+// deepest tree bounded so far
+typedef struct {
+  Node_Frames frames;
+  struct {
+    Interval_Value *items;
+    size_t count;
+    size_t capacity;
+  } values;
+} Interval_Stacks;
+
+typedef struct {
+  Interval x;
+  Interval y;
+  Interval t;
+  const Math_Funcs *math; // tier of the sin the engines evaluate
+  // Bounds of the shared nodes of a DAG (Node.slot), valid once `filled`,
+  // which the caller clears for every new box
+  Interval *slots;
+  bool *filled;
+  // Kept by the caller between boxes, NULL allocates them for one call
+  Interval_Stacks *stacks;
+} Interval_Box;
+
+// `result` holds one interval per number (three for a triple)
+void eval_interval(Interval_Box *box, Node *expr, Interval *result);
+void interval_stacks_free(Interval_Stacks *stacks);
+// Bounds of the operation of `expr` over the bounds of its children, given in
+// node_children() order. Leaves have no operation.
+void interval_operation(Node *expr, const Math_Funcs *math,
+                        Interval operands[3][3], Interval *result);
@@ -0,0 +1,252 @@
+#include "jit.h"
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X86_64 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define JIT_X86_64 0
+#endif
+
+bool jit_supported(void) { return JIT_X86_64; }
+
+typedef struct {
+  uint8_t *items;
+  size_t count;
+  size_t capacity;
+} Jit_Bytes;
+
+#define jit_emit(code, ...)                                                    \
+  do {                                                                         \
+    uint8_t bytes[] = {__VA_ARGS__};                                           \
+    da_append_many((code), bytes, ARRAY_LEN(bytes));                           \
+  } while (0)
+
+static void jit_emit_u32(Jit_Bytes *code, uint32_t value) {
+  jit_emit(code, value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF,
+           (value >> 24) & 0xFF);
+}
+
+static void jit_emit_u64(Jit_Bytes *code, uint64_t value) {
+  jit_emit_u32(code, value & 0xFFFFFFFF);
+  jit_emit_u32(code, value >> 32);
+}
+
+// SSE instruction between xmm`reg` and the frame slot [rbx + 4*slot]
+static void jit_emit_sse_slot(Jit_Bytes *code, uint8_t prefix, uint8_t opcode,
+                              uint8_t reg, uint8_t slot) {
+  jit_emit(code, prefix, 0x0F, opcode, 0x83 | (reg << 3));
+  jit_emit_u32(code, slot * sizeof(float));
+}
+
+#define JIT_MOVSS_LOAD 0x10
+#define JIT_MOVSS_STORE 0x11
+#define JIT_SQRTSS 0x51
+#define JIT_ADDSS 0x58
+#define JIT_MULSS 0x59
+#define JIT_CMPSS 0xC2
+#define JIT_CMP_LT 1
+
+#define jit_load(code, reg, slot)                                              \
+  jit_emit_sse_slot((code), 0xF3, JIT_MOVSS_LOAD, (reg), (slot))
+#define jit_store(code, reg, slot)                                             \
+  jit_emit_sse_slot((code), 0xF3, JIT_MOVSS_STORE, (reg), (slot))
+
+// mov eax, bits; movd xmm`reg`, eax
+static void jit_emit_float_bits(Jit_Bytes *code, uint8_t reg, uint32_t bits) {
+  jit_emit(code, 0xB8);
+  jit_emit_u32(code, bits);
+  jit_emit(code, 0x66, 0x0F, 0x6E, 0xC0 | (reg << 3));
+}
+
+// mov rax, func; call rax
+static void jit_emit_call(Jit_Bytes *code, void *func) {
+  jit_emit(code, 0x48, 0xB8);
+  jit_emit_u64(code, (uint64_t)(uintptr_t)func);
+  jit_emit(code, 0xFF, 0xD0);
+}
+
+// A rel32 of a jump to the instruction `target`, filled in once the offsets
+// of all instructions are known
+typedef struct {
+  size_t at;
+  size_t target;
+} Jit_Patch;
+
+typedef struct {
+  Jit_Patch *items;
+  size_t count;
+  size_t capacity;
+} Jit_Patches;
+
+static void jit_emit_jump(Jit_Bytes *code, Jit_Patches *patches,
+                          size_t target) {
+  da_append(patches, ((Jit_Patch){.at = code->count, .target = target}));
+  jit_emit_u32(code, 0);
+}
+
+static void jit_emit_inst(Jit_Bytes *code, Jit_Patches *patches,
+                          const Reg_Program *program, const Reg_Inst *inst) {
+  switch (inst->op) {
+  case OP_PUSH: {
+    // mov dword [rbx + 4*dst], imm
+    uint32_t bits;
+    memcpy(&bits, &inst->imm, sizeof(bits));
+    jit_emit(code, 0xC7, 0x83);
+    jit_emit_u32(code, inst->dst * sizeof(float));
+    jit_emit_u32(code, bits);
+  } break;
+
+  case OP_SQRT:
+    jit_emit_sse_slot(code, 0xF3, JIT_SQRTSS, 0, inst->a);
+    jit_store(code, 0, inst->dst);
+    break;
+
+  case OP_ABS:
+    jit_load(code, 0, inst->a);
+    jit_emit_float_bits(code, 1, 0x7FFFFFFF);
+    jit_emit(code, 0x0F, 0x54, 0xC1); // andps xmm0, xmm1
+    jit_store(code, 0, inst->dst);
+    break;
+
+  case OP_SIN:
+    jit_load(code, 0, inst->a);
+    jit_emit_call(code, (void *)program->math->sin);
+    jit_store(code, 0, inst->dst);
+    break;
+
+  case OP_ADD:
+    jit_load(code, 0, inst->a);
+    jit_emit_sse_slot(code, 0xF3, JIT_ADDSS, 0, inst->b);
+    jit_store(code, 0, inst->dst);
+    break;
+
+  case OP_MULT:
+    jit_load(code, 0, inst->a);
+    jit_emit_sse_slot(code, 0xF3, JIT_MULSS, 0, inst->b);
+    jit_store(code, 0, inst->dst);
+    break;
+
+  case OP_MOD:
+    jit_load(code, 0, inst->a);
+    jit_load(code, 1, inst->b);
+    jit_emit_call(code, (void *)math_mod);
+    jit_store(code, 0, inst->dst);
+    break;
+
+  // a > b <=> b < a, the all ones mask is turned into 1.0
+  case OP_GT:
+    jit_load(code, 0, inst->b);
+    jit_emit_sse_slot(code, 0xF3, JIT_CMPSS, 0, inst->a);
+    jit_emit(code, JIT_CMP_LT);
+    jit_emit_float_bits(code, 1, 0x3F800000);
+    jit_emit(code, 0x0F, 0x54, 0xC1); // andps xmm0, xmm1
+    jit_store(code, 0, inst->dst);
+    break;
+
+  case OP_MOV:
+    jit_load(code, 0, inst->a);
+    jit_store(code, 0, inst->dst);
+    break;
+
+  // mov eax, [rbx + 4*a]; add eax, eax (drops the sign of -0.0); jz target
+  case OP_JUMP_UNLESS:
+    jit_emit(code, 0x8B, 0x83);
+    jit_emit_u32(code, inst->a * sizeof(float));
+    jit_emit(code, 0x01, 0xC0, 0x0F, 0x84);
+    jit_emit_jump(code, patches, inst->target);
+    break;
+
+  case OP_JUMP:
+    jit_emit(code, 0xE9);
+    jit_emit_jump(code, patches, inst->target);
+    break;
+
+  case OP_X:
+  case OP_Y:
+  case OP_T:
+  case OP_STORE:
+  case OP_LOAD:
+  default:
+    UNREACHABLE_CODE("jit_emit_inst");
+  }
+}
+
+bool jit_compile_reg_program(Jit_Code *jit, const Reg_Program *program) {
+  memset(jit, 0, sizeof(*jit));
+#if JIT_X86_64
+  Jit_Bytes code = {0};
+  Jit_Patches patches = {0};
+  // Code offset of every instruction and of the end
+  size_t *offsets = malloc((program->count + 1) * sizeof(*offsets));
+  assert(offsets != NULL && "Buy more RAM lol");
+
+  // push rbx; mov rbx, rdi (also aligns the stack for the calls)
+  jit_emit(&code, 0x53, 0x48, 0x89, 0xFB);
+  for (size_t i = 0; i < program->count; ++i) {
+    offsets[i] = code.count;
+    jit_emit_inst(&code, &patches, program, &program->items[i]);
+    if (code.count > JIT_MAX_CODE_SIZE) {
+      nob_log(WARNING, "JIT: function does not fit into %d bytes of code",
+              JIT_MAX_CODE_SIZE);
+      da_free(code);
+      da_free(patches);
+      free(offsets);
+      return false;
+    }
+  }
+  offsets[program->count] = code.count;
+  // pop rbx; ret
+  jit_emit(&code, 0x5B, 0xC3);
+
+  // Relative to the end of the rel32
+  for (size_t i = 0; i < patches.count; ++i) {
+    const Jit_Patch *patch = &patches.items[i];
+    uint32_t rel = (uint32_t)(offsets[patch->target] - (patch->at + 4));
+    memcpy(&code.items[patch->at], &rel, sizeof(rel));
+  }
+  da_free(patches);
+  free(offsets);
+
+  // Write the code while the pages are writable, then flip them to
+  // executable so they are never both
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t size = (code.count + page_size - 1) / page_size * page_size;
+  void *pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED) {
+    nob_log(WARNING, "JIT: could not map %zu bytes: %s", size,
+            strerror(errno));
+    da_free(code);
+    return false;
+  }
+  memcpy(pages, code.items, code.count);
+  da_free(code);
+  if (mprotect(pages, size, PROT_READ | PROT_EXEC) != 0) {
+    nob_log(WARNING, "JIT: could not make code executable: %s",
+            strerror(errno));
+    munmap(pages, size);
+    return false;
+  }
+
+  jit->code = pages;
+  jit->code_size = size;
+  jit->func = (Jit_Func)pages;
+  return true;
+#else
+  UNUSED(program);
+  nob_log(WARNING, "JIT: only x86-64 is supported");
+  return false;
+#endif
+}
+
+void jit_free(Jit_Code *jit) {
+#if JIT_X86_64
+  if (jit->code)
+    munmap(jit->code, jit->code_size);
+#endif
+  memset(jit, 0, sizeof(*jit));
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "node.h"
+#include "vm.h"
+
+// x86-64 JIT: translates a Reg_Program into SSE machine code. Every virtual
+// register lives in a float slot of the frame passed to the function, with
+// x, y and t filled in by the caller and the result read back from
+// `program->result`. Arithmetic is inlined, sin and mod call into the math
+// layer like the interpreter does, so the output matches it bit for bit.
+#define JIT_MAX_CODE_SIZE (4 * 1024 * 1024)
+
+typedef void (*Jit_Func)(float *regs);
+
+typedef struct {
+  Jit_Func func;
+  void *code;
+  size_t code_size;
+} Jit_Code;
+
+bool jit_supported(void);
+bool jit_compile_reg_program(Jit_Code *jit, const Reg_Program *program);
+void jit_free(Jit_Code *jit);
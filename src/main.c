@@ -1,4 +1,21 @@
+#include "aot.h"
+#include "cost.h"
+#include "cse.h"
+#include "fuse.h"
+#include "hoist.h"
+#include "interval.h"
+#include "jit.h"
 #include "node.h"
+#include "opt.h"
+#include "png.h"
+#include "pool.h"
+#include "poly.h"
+#include "raw.h"
+#include "render.h"
+#include "span.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 
 #define NOB_IMPLEMENTATION
@@ -15,8 +32,18 @@
 #define WINDOW_HEIGHT 600
 #define IMAGE_WIDTH 400
 #define IMAGE_HEIGHT 400
+// Largest -width and -height, an image in memory takes at most INT_MAX bytes
+#define IMAGE_MAX_SIZE (1 << 16)
+// Rows of a PNG rendered and compressed at a time unless -strip says else
+#define IMAGE_STRIP_ROWS 64
 #define GEN_RULE_MAX_ATTEMPTS 10
 #define GRAMMAR_DEPTH 20
+#define GEN_MAX_NODES (1 << 22)
+// Functions generated to find one within -max-cost
+#define GEN_MAX_COST_ATTEMPTS 64
+// Unit of work of the thread pool, wide enough for the span kernels
+#define TILE_WIDTH 64
+#define TILE_HEIGHT 4
 
 static Arena node_arena = {0};
 
@@ -47,6 +74,16 @@ const char *comments[] = {
     "#",
 };
 
+static_assert(COUNT_ENGINES == 6, "Amount of engines have changed");
+const char *engine_names[COUNT_ENGINES] = {
+    [ENGINE_TREE] = "tree",
+    [ENGINE_VM] = "vm",
+    [ENGINE_REG] = "reg",
+    [ENGINE_SPAN] = "span",
+    [ENGINE_JIT] = "jit",
+    [ENGINE_AOT] = "aot",
+};
+
 Alexer_Token symbol_impl(const char *file, int line, const char *name_cstr) {
   UNUSED(file);
   UNUSED(line);
@@ -104,6 +141,9 @@ Node *node_loc(const char *file, int line, Node_Kind kind) {
   node->kind = kind;
   node->file = file;
   node->line = line;
+  node->slot = 0;
+  node->deps = 0;
+  node->hoisted = false;
 
   return node;
 }
@@ -125,110 +165,1034 @@ void grammar_append_branches(Grammar *grammar, Grammar_Branches *branches,
   memset(branches, 0, sizeof(*branches));
 }
 
-/// Evaluate Node Expressions (AST)
-Node *eval(Node *expr, float x, float y, float t) {
-  switch (expr->kind) {
-  case NK_X:
-    return node_number_loc(expr->file, expr->line, x);
-  case NK_Y:
-    return node_number_loc(expr->file, expr->line, y);
-  case NK_T:
-    return node_number_loc(expr->file, expr->line, t);
+/// Evaluate a typechecked Node Expression (AST) into a Value. The tree is
+/// walked with the explicit stacks of `memo`, so its depth is only bounded
+/// by memory, and nothing is allocated once they fit the deepest tree.
+Value eval(Node *expr, Eval_Memo *memo, float x, float y, float t) {
+  Node_Frame *frames = memo->frames;
+  Value *stack = memo->stack;
+  size_t frame_count = 0, stack_count = 0;
+
+// Leaves go straight to the value stack, they are half of every tree
+#define eval_push_frame(child)                                                 \
+  do {                                                                         \
+    Node *child_ = (child);                                                    \
+    if (child_->kind == NK_NUMBER && !child_->hoisted) {                       \
+      stack[stack_count++] =                                                   \
+          (Value){.kind = NK_NUMBER, .as.number = child_->as.number};          \
+      break;                                                                   \
+    }                                                                          \
+    if (child_->kind == NK_X || child_->kind == NK_Y) {                        \
+      stack[stack_count++] = (Value){                                          \
+          .kind = NK_NUMBER, .as.number = child_->kind == NK_X ? x : y};       \
+      break;                                                                   \
+    }                                                                          \
+    if (frame_count == memo->frames_capacity) {                                \
+      eval_memo_grow(memo);                                                    \
+      frames = memo->frames;                                                   \
+      stack = memo->stack;                                                     \
+    }                                                                          \
+    frames[frame_count++] = (Node_Frame){.node = child_, .next = 0};           \
+  } while (0)
+
+  eval_push_frame(expr);
+  while (frame_count > 0) {
+    Node_Frame *frame = &frames[frame_count - 1];
+    Node *node = frame->node;
+    Value value;
+
+    if (frame->next == 0) {
+      if (node->hoisted) {
+        float input = memo->inputs[node->slot];
+        stack[stack_count++] =
+            node->type == NK_BOOLEAN
+                ? (Value){.kind = NK_BOOLEAN, .as.boolean = input}
+                : (Value){.kind = NK_NUMBER, .as.number = input};
+        frame_count -= 1;
+        continue;
+      }
+      if (node->slot > 0 && memo->stamps[node->slot] == memo->stamp) {
+        stack[stack_count++] = memo->values[node->slot];
+        frame_count -= 1;
+        continue;
+      }
+    }
 
-  case NK_NUMBER:
-  case NK_BOOLEAN:
-    return expr;
+    switch (node->kind) {
+    case NK_X:
+      value = (Value){.kind = NK_NUMBER, .as.number = x};
+      break;
+    case NK_Y:
+      value = (Value){.kind = NK_NUMBER, .as.number = y};
+      break;
+    case NK_T:
+      value = (Value){.kind = NK_NUMBER, .as.number = t};
+      break;
 
-  case NK_SQRT:
-  case NK_ABS:
-  case NK_SIN:
-    return eval_unop(expr, x, y, t, NK_NUMBER);
+    case NK_NUMBER:
+      value = (Value){.kind = NK_NUMBER, .as.number = node->as.number};
+      break;
+    case NK_BOOLEAN:
+      value = (Value){.kind = NK_BOOLEAN, .as.boolean = node->as.boolean};
+      break;
 
-  case NK_ADD:
-  case NK_MULT:
-  case NK_MOD:
-  case NK_GT:
-    return eval_binop(expr, x, y, t, NK_NUMBER);
+    case NK_SQRT:
+    case NK_ABS:
+    case NK_SIN:
+    case NK_SQRT_ABS:
+    case NK_SIN_ABS:
+    case NK_SQUARE:
+      if (frame->next++ == 0) {
+        eval_push_frame(node->as.unop);
+        continue;
+      }
+      value = eval_unop(node, memo, stack[--stack_count].as.number);
+      break;
+
+    case NK_ADD:
+    case NK_MULT:
+    case NK_MOD:
+    case NK_GT:
+      if (frame->next < 2) {
+        Node *operand =
+            frame->next++ == 0 ? node->as.binop.lhs : node->as.binop.rhs;
+        eval_push_frame(operand);
+        continue;
+      }
+      stack_count -= 2;
+      value = eval_binop(node, stack[stack_count].as.number,
+                         stack[stack_count + 1].as.number);
+      break;
+
+    // The product is rounded before the addition, unlike fmaf()
+    case NK_MULT_ADD: {
+      if (frame->next < 3) {
+        Node *operands[3] = {node->as.mult_add.lhs, node->as.mult_add.rhs,
+                             node->as.mult_add.addend};
+        eval_push_frame(operands[frame->next++]);
+        continue;
+      }
+      stack_count -= 3;
+      float product =
+          stack[stack_count].as.number * stack[stack_count + 1].as.number;
+      value = (Value){.kind = NK_NUMBER,
+                      .as.number = product + stack[stack_count + 2].as.number};
+    } break;
+
+    case NK_TRIPLE: {
+      if (frame->next < 3) {
+        Node *operands[3] = {node->as.triple.first, node->as.triple.second,
+                             node->as.triple.third};
+        eval_push_frame(operands[frame->next++]);
+        continue;
+      }
+      stack_count -= 3;
+      value = (Value){.kind = NK_TRIPLE,
+                      .as.triple = {
+                          stack[stack_count].as.number,
+                          stack[stack_count + 1].as.number,
+                          stack[stack_count + 2].as.number,
+                      }};
+    } break;
+
+    // Only the branch the condition picks is evaluated
+    case NK_IF:
+      if (frame->next == 0) {
+        frame->next = 1;
+        eval_push_frame(node->as.iff.cond);
+        continue;
+      }
+      if (frame->next == 1) {
+        frame->next = 2;
+        bool cond = stack[--stack_count].as.boolean;
+        eval_push_frame(cond ? node->as.iff.then : node->as.iff.elze);
+        continue;
+      }
+      value = stack[--stack_count];
+      break;
+
+    case NK_RANDOM:
+    case NK_RULE:
+    default:
+      UNREACHABLE_CODE("eval");
+    }
 
-  case NK_TRIPLE: {
-    Node *first = eval(expr->as.triple.first, x, y, t);
-    Node *second = eval(expr->as.triple.second, x, y, t);
-    Node *third = eval(expr->as.triple.third, x, y, t);
-    return (first && second && third)
-               ? node_triple_loc(expr->file, expr->line, first, second, third)
-               : NULL;
+    if (node->slot > 0) {
+      memo->values[node->slot] = value;
+      memo->stamps[node->slot] = memo->stamp;
+    }
+    stack[stack_count++] = value;
+    frame_count -= 1;
   }
+#undef eval_push_frame
 
-  case NK_IF: {
-    Node *cond = eval(expr->as.iff.cond, x, y, t);
-    if (!cond || !expect_kind(cond, NK_BOOLEAN))
-      return NULL;
+  return stack[0];
+}
 
-    Node *then = eval(expr->as.iff.then, x, y, t);
-    if (!then || !expect_kind(then, NK_TRIPLE))
-      return NULL;
+/// Evaluate and assign triple/colors to each pixel
+Vector3 eval_func(Node *f, Eval_Memo *memo, float x, float y, float t) {
+  eval_memo_next(memo);
+  return eval(f, memo, x, y, t).as.triple;
+}
 
-    Node *elze = eval(expr->as.iff.elze, x, y, t);
-    if (!elze || !expect_kind(elze, NK_TRIPLE))
-      return NULL;
+// -1..1 => 0..2 => 0..1 => 0..255
+static inline void pixel_from_vector(Color *pixel, Vector3 c) {
+  pixel->r = (c.x + 1) / 2 * 255;
+  pixel->g = (c.y + 1) / 2 * 255;
+  pixel->b = (c.z + 1) / 2 * 255;
+  pixel->a = 255;
+}
+
+// Scratch memory owned by one worker thread, padded to its own cache line
+typedef struct {
+  _Alignas(64) float *stack;     // ENGINE_VM stack, ENGINE_AOT row results
+  Eval_Memo memo;                // ENGINE_TREE shared values
+  float regs[REG_FILE_CAPACITY]; // ENGINE_REG and ENGINE_JIT registers
+  float *inputs; // where the engine reads the hoisted values from
+  Span_Arena span_arena;
+  float *span_slots; // ENGINE_SPAN shared values
+  bool *span_filled;
+  Span_Frames span_frames;
+  Interval *interval_slots; // bounds of the shared values over a tile
+  bool *interval_filled;
+  Interval_Stacks interval_stacks;
+  double *poly_deltas; // forward differences of every expanded polynomial
+  size_t flat_tiles;
+  size_t subnormal_pixels;
+} Render_Worker;
+
+// The `value`-th hoisted value of a level is read from `inputs[index]`
+typedef struct {
+  size_t value;
+  size_t index;
+} Render_Load;
+
+typedef struct {
+  Render_Load *items;
+  size_t count;
+  size_t capacity;
+} Render_Loads;
+
+// Everything a tile needs, shared read-only between the workers
+struct Render_Context {
+  Color *pixels; // rows y0..<y1 of the image
+  size_t width;
+  size_t height;
+  size_t y0;
+  size_t y1;
+  double step_x; // distance between the x of two neighbouring columns
+  Node *f;
+  Render_Engine engine;
+  const Math_Funcs *math;
+  bool interval; // fill the tiles whose bounds prove them flat
+  bool ftz;
+  bool count_subnormals;
+  Program program;
+  Reg_Program reg_program;
+  Jit_Code jit;
+  Aot_Kernel aot;
+  const Span_Kernels *kernels;
+  float *xs; // x of every column, padded to a span stride
+  float *ys; // y of every row
+  Hoist hoist;
+  Render_Loads loads[COUNT_HOIST_LEVELS];
+  Poly_Set poly;
+  Render_Loads poly_loads; // the `value`-th polynomial
+  size_t slot_count;
+  size_t tiles_x;
+  size_t threads;
+  Render_Worker *workers;
+  Pool pool; // started once, renders every strip
+  size_t tiles; // rendered so far, and how many of them were stolen
+  size_t stolen;
+};
+
+static inline void render_load_hoisted(const Render_Context *ctx,
+                                       Render_Worker *w, Hoist_Level level,
+                                       size_t index) {
+  const float *values = hoist_values(&ctx->hoist, level, index);
+  const Render_Loads *loads = &ctx->loads[level];
+  for (size_t i = 0; i < loads->count; ++i)
+    w->inputs[loads->items[i].index] = values[loads->items[i].value];
+}
 
-    return cond->as.boolean ? then : elze;
+static void render_start_polys(const Render_Context *ctx, Render_Worker *w,
+                               size_t x0, size_t y) {
+  const Render_Loads *loads = &ctx->poly_loads;
+  for (size_t i = 0; i < loads->count; ++i) {
+    size_t value = loads->items[i].value;
+    poly_row_start(&ctx->poly.items[value], ctx->ys[y], ctx->xs[x0],
+                   ctx->step_x,
+                   &w->poly_deltas[value * (POLY_MAX_DEGREE + 1)]);
   }
+}
 
-  case NK_RANDOM:
-  case NK_RULE:
-    printf("%s:%d: ERROR: cannot evaluate a node that is only valid for "
-           "grammar definitions\n",
-           expr->file, expr->line);
-    return NULL;
+/// Load the hoisted values of column `x` and step the expanded polynomials
+/// over to it, the pixels of a row must come in order
+static inline void render_load_pixel(const Render_Context *ctx,
+                                     Render_Worker *w, size_t x) {
+  render_load_hoisted(ctx, w, HOIST_COLUMN, x);
+  const Render_Loads *loads = &ctx->poly_loads;
+  for (size_t i = 0; i < loads->count; ++i) {
+    size_t value = loads->items[i].value;
+    w->inputs[loads->items[i].index] =
+        poly_row_next(&w->poly_deltas[value * (POLY_MAX_DEGREE + 1)],
+                      ctx->poly.items[value].degree_x);
+  }
+}
+
+/// Count the pixel just evaluated if it read or produced a subnormal
+static inline void render_count_subnormal(const Render_Context *ctx,
+                                          Render_Worker *w) {
+  if (ctx->count_subnormals)
+    w->subnormal_pixels += math_fp_take_subnormal();
+}
 
+/// Fill the slot buffers of the hoisted and the expanded nodes for the span
+/// of row `y` starting at column `x0`, so eval_span() only copies them out
+static void render_span_hoisted(const Render_Context *ctx, Span *span,
+                                size_t x0, size_t y) {
+  size_t stride = span_stride(span->count);
+  for (size_t level = 0; level < COUNT_HOIST_LEVELS; ++level) {
+    const Hoist_Nodes *nodes = &ctx->hoist.levels[level];
+    for (size_t i = 0; i < nodes->count; ++i) {
+      size_t slot = nodes->items[i]->slot;
+      float *buffer = &span->slots[(slot - 1) * stride];
+      if (level == HOIST_COLUMN) {
+        for (size_t x = 0; x < span->count; ++x)
+          buffer[x] = hoist_values(&ctx->hoist, level, x0 + x)[i];
+        // Padding lanes are computed too, keep them initialized
+        for (size_t x = span->count; x < stride; ++x)
+          buffer[x] = 0.0f;
+      } else {
+        float value =
+            hoist_values(&ctx->hoist, level, level == HOIST_ROW ? y : 0)[i];
+        for (size_t x = 0; x < stride; ++x)
+          buffer[x] = value;
+      }
+      span->filled[slot] = true;
+    }
+  }
+
+  for (size_t i = 0; i < ctx->poly.count; ++i) {
+    const Poly *poly = &ctx->poly.items[i];
+    size_t slot = poly->node->slot;
+    float *buffer = &span->slots[(slot - 1) * stride];
+    double deltas[POLY_MAX_DEGREE + 1];
+    poly_row_start(poly, span->y, span->xs[0], ctx->step_x, deltas);
+    for (size_t x = 0; x < span->count; ++x)
+      buffer[x] = poly_row_next(deltas, poly->degree_x);
+    for (size_t x = span->count; x < stride; ++x)
+      buffer[x] = 0.0f;
+    span->filled[slot] = true;
+  }
+}
+
+/// Fill the tile with a single color when the bounds of the function over
+/// it prove that every pixel quantizes to that color
+static bool render_tile_flat(const Render_Context *ctx, Render_Worker *w,
+                             size_t x0, size_t y0, size_t x1, size_t y1) {
+  Interval_Box box = {
+      .x = {.lo = ctx->xs[x0], .hi = ctx->xs[x1 - 1]},
+      .y = {.lo = ctx->ys[y0], .hi = ctx->ys[y1 - 1]},
+      .t = {.lo = 0.0f, .hi = 0.0f},
+      .math = ctx->math,
+      .slots = w->interval_slots,
+      .filled = w->interval_filled,
+      .stacks = &w->interval_stacks,
+  };
+  memset(w->interval_filled, 0, (ctx->slot_count + 1) * sizeof(bool));
+  Interval rgb[3];
+  eval_interval(&box, ctx->f, rgb);
+
+  // Converting a value outside of 0..255 into a byte is undefined, so only
+  // bounds within that range are trusted
+  for (size_t k = 0; k < 3; ++k) {
+    float lo = (rgb[k].lo + 1) / 2 * 255;
+    float hi = (rgb[k].hi + 1) / 2 * 255;
+    if (rgb[k].nan || !(lo >= 0 && hi < 256))
+      return false;
+  }
+  Color lo, hi;
+  pixel_from_vector(&lo, (Vector3){rgb[0].lo, rgb[1].lo, rgb[2].lo});
+  pixel_from_vector(&hi, (Vector3){rgb[0].hi, rgb[1].hi, rgb[2].hi});
+  if (memcmp(&lo, &hi, sizeof(lo)) != 0)
+    return false;
+
+  for (size_t y = y0; y < y1; ++y) {
+    for (size_t x = x0; x < x1; ++x)
+      ctx->pixels[(y - ctx->y0) * ctx->width + x] = lo;
+  }
+  w->flat_tiles += 1;
+  return true;
+}
+
+static void render_tile(void *arg, size_t worker, size_t tile) {
+  Render_Context *ctx = arg;
+  Render_Worker *w = &ctx->workers[worker];
+  size_t x0 = tile % ctx->tiles_x * TILE_WIDTH;
+  size_t y0 = ctx->y0 + tile / ctx->tiles_x * TILE_HEIGHT;
+  size_t x1 = x0 + TILE_WIDTH < ctx->width ? x0 + TILE_WIDTH : ctx->width;
+  size_t y1 = y0 + TILE_HEIGHT < ctx->y1 ? y0 + TILE_HEIGHT : ctx->y1;
+  size_t width = x1 - x0;
+  const float *xs = ctx->xs;
+
+  if (ctx->interval && render_tile_flat(ctx, w, x0, y0, x1, y1))
+    return;
+
+  for (size_t y = y0; y < y1; ++y) {
+    float ny = ctx->ys[y];
+    Color *row = &ctx->pixels[(y - ctx->y0) * ctx->width];
+    if (w->inputs != NULL) {
+      render_load_hoisted(ctx, w, HOIST_ROW, y);
+      render_start_polys(ctx, w, x0, y);
+    }
+    render_count_subnormal(ctx, w);
+
+    switch (ctx->engine) {
+    case ENGINE_TREE:
+      for (size_t x = x0; x < x1; ++x) {
+        render_load_pixel(ctx, w, x);
+        pixel_from_vector(&row[x], eval_func(ctx->f, &w->memo, xs[x], ny, 0.0f));
+        render_count_subnormal(ctx, w);
+      }
+      break;
+
+    case ENGINE_VM:
+      for (size_t x = x0; x < x1; ++x) {
+        render_load_pixel(ctx, w, x);
+        pixel_from_vector(&row[x], program_run(&ctx->program, w->stack, xs[x],
+                                               ny, 0.0f));
+        render_count_subnormal(ctx, w);
+      }
+      break;
+
+    case ENGINE_REG:
+      w->regs[REG_Y] = ny;
+      w->regs[REG_T] = 0.0f;
+      for (size_t x = x0; x < x1; ++x) {
+        w->regs[REG_X] = xs[x];
+        render_load_pixel(ctx, w, x);
+        pixel_from_vector(&row[x],
+                          reg_program_run(&ctx->reg_program, w->regs));
+        render_count_subnormal(ctx, w);
+      }
+      break;
+
+    case ENGINE_JIT: {
+      const uint8_t *result = ctx->reg_program.result;
+      float *regs = w->regs;
+      regs[REG_Y] = ny;
+      regs[REG_T] = 0.0f;
+      for (size_t x = x0; x < x1; ++x) {
+        regs[REG_X] = xs[x];
+        render_load_pixel(ctx, w, x);
+        ctx->jit.func(regs);
+        pixel_from_vector(&row[x], (Vector3){regs[result[0]], regs[result[1]],
+                                             regs[result[2]]});
+        render_count_subnormal(ctx, w);
+      }
+    } break;
+
+    case ENGINE_AOT: {
+      float *rgb = w->stack;
+      ctx->aot.row(&xs[x0], ny, 0.0f, width, rgb, rgb + TILE_WIDTH,
+                   rgb + 2 * TILE_WIDTH);
+      for (size_t x = 0; x < width; ++x) {
+        pixel_from_vector(&row[x0 + x],
+                          (Vector3){rgb[x], rgb[TILE_WIDTH + x],
+                                    rgb[2 * TILE_WIDTH + x]});
+      }
+    } break;
+
+    case ENGINE_SPAN: {
+      Span span = {
+          .arena = &w->span_arena,
+          .kernels = ctx->kernels,
+          .xs = &xs[x0],
+          .y = ny,
+          .t = 0.0f,
+          .count = width,
+          .slots = w->span_slots,
+          .filled = w->span_filled,
+          .frames = &w->span_frames,
+      };
+      memset(w->span_filled, 0, (ctx->slot_count + 1) * sizeof(bool));
+      render_span_hoisted(ctx, &span, x0, y);
+      size_t stride = span_stride(width);
+      float *rgb[3];
+      for (size_t k = 0; k < 3; ++k)
+        rgb[k] = &w->span_arena.items[k * stride];
+      w->span_arena.count = 3 * stride;
+
+      eval_span(&span, ctx->f, rgb);
+      for (size_t x = 0; x < width; ++x) {
+        pixel_from_vector(&row[x0 + x],
+                          (Vector3){rgb[0][x], rgb[1][x], rgb[2][x]});
+      }
+    } break;
+
+    case COUNT_ENGINES:
+    default:
+      UNREACHABLE_CODE("render_tile");
+    }
+  }
+}
+
+/// Set once per worker thread, the threads end with the render
+static void render_worker_setup(void *arg, size_t worker) {
+  Render_Context *ctx = arg;
+  (void)worker;
+  math_fp_enter(ctx->ftz);
+}
+
+/// Where the engine reads the value of the hoisted node `slot` from, 0 when
+/// the register VM computes it like any other node
+static size_t render_input_index(const Render_Context *ctx, size_t slot) {
+  switch (ctx->engine) {
+  case ENGINE_VM:
+    return ctx->program.max_stack - 1 + slot;
+  case ENGINE_REG:
+  case ENGINE_JIT:
+    return ctx->reg_program.inputs[slot];
+  case ENGINE_TREE:
+  case ENGINE_SPAN:
+  case ENGINE_AOT:
+    return slot;
+  case COUNT_ENGINES:
   default:
-    UNREACHABLE_CODE("eval");
+    UNREACHABLE_CODE("render_input_index");
   }
 }
 
-/// Evaluate and assign triple/colors to each pixel
-bool eval_func(Node *f, float x, float y, float t, Vector3 *c) {
-  Node *result = eval(f, x, y, t);
+static void render_free(Render_Context *ctx) {
+  pool_free(&ctx->pool);
+  for (size_t i = 0; ctx->workers != NULL && i < ctx->threads; ++i) {
+    free(ctx->workers[i].stack);
+    eval_memo_free(&ctx->workers[i].memo);
+    span_arena_free(&ctx->workers[i].span_arena);
+    free(ctx->workers[i].span_slots);
+    free(ctx->workers[i].span_filled);
+    free(ctx->workers[i].span_frames.items);
+    free(ctx->workers[i].interval_slots);
+    free(ctx->workers[i].interval_filled);
+    interval_stacks_free(&ctx->workers[i].interval_stacks);
+    free(ctx->workers[i].poly_deltas);
+  }
+  free(ctx->workers);
+  free(ctx->xs);
+  free(ctx->ys);
+  for (size_t level = 0; level < COUNT_HOIST_LEVELS; ++level)
+    da_free(ctx->loads[level]);
+  hoist_free(&ctx->hoist);
+  da_free(ctx->poly_loads);
+  poly_free(&ctx->poly);
+  program_free(&ctx->program);
+  reg_program_free(&ctx->reg_program);
+  jit_free(&ctx->jit);
+  aot_unload_kernel(&ctx->aot);
+  free(ctx);
+}
+
+static Render_Context *render_fail(Render_Context *ctx) {
+  render_free(ctx);
+  return NULL;
+}
+
+Render_Context *render_begin(Node *f, size_t width, size_t height,
+                             Render_Options options) {
+  Render_Context *ctx = malloc(sizeof(*ctx));
+  assert(ctx != NULL && "Buy more RAM lol");
+  *ctx = (Render_Context){
+      .width = width,
+      .height = height,
+      .step_x = 2.0 / width,
+      .f = f,
+      .engine = options.engine,
+      .interval = !options.no_interval,
+      .ftz = options.ftz,
+      .count_subnormals = options.count_subnormals,
+      .tiles_x = (width + TILE_WIDTH - 1) / TILE_WIDTH,
+      .threads = options.threads,
+  };
+  size_t threads = options.threads;
+  // Floats of scratch memory every worker needs for its `stack`
+  size_t stack_size = 0;
+  size_t span_arena_size = 0;
+  const Math_Funcs *math = math_funcs(options.math);
+  ctx->math = math;
+  nob_log(INFO, "Math: %s", math_tier_names[math->tier]);
+  if (ctx->ftz && !math_ftz_supported()) {
+    nob_log(WARNING, "Flush-to-zero is only supported on x86");
+    ctx->ftz = false;
+  }
+  // A span or an AOT row computes many pixels at once, the flags could not
+  // tell them apart
+  if (ctx->count_subnormals &&
+      (ctx->engine == ENGINE_SPAN || ctx->engine == ENGINE_AOT)) {
+    nob_log(INFO, "Subnormals: counted per pixel on the register VM");
+    ctx->engine = ENGINE_REG;
+  }
+
+  ctx->xs = calloc(span_stride(width), sizeof(*ctx->xs));
+  ctx->ys = malloc(height * sizeof(*ctx->ys));
+  assert(ctx->xs != NULL && ctx->ys != NULL && "Buy more RAM lol");
+  for (size_t x = 0; x < width; ++x) {
+    // 0..<width => 0..1 => 0..2 => -1..1
+    ctx->xs[x] = (float)x / width * 2.0f - 1;
+  }
+  for (size_t y = 0; y < height; ++y) {
+    // 0..<height => 0..1 => 0..2 => -1..1
+    ctx->ys[y] = (float)y / height * 2.0f - 1;
+  }
+
+  // Before hoisting, which leaves the expanded subtrees alone
+  if (options.poly && ctx->engine == ENGINE_AOT) {
+    nob_log(INFO, "Polynomials: the AOT kernel computes every pixel itself");
+  } else if (options.poly) {
+    poly_nodes(&ctx->poly, f, 0.0f);
+    size_t additions = 0;
+    for (size_t i = 0; i < ctx->poly.count; ++i)
+      additions += ctx->poly.items[i].degree_x;
+    nob_log(INFO,
+            "Polynomials: %zu subtrees expanded, %zu additions per pixel, "
+            "%zu products over degree %d left to the engine",
+            ctx->poly.count, additions, ctx->poly.rejected, POLY_MAX_DEGREE);
+  }
+
+  // The C compiler of the AOT engine hoists loop invariants by itself
+  if (ctx->engine != ENGINE_AOT) {
+    hoist_nodes(&ctx->hoist, f, ctx->xs, width, ctx->ys, height, 0.0f, math);
+    nob_log(INFO, "Hoisting: %zu per frame, %zu per column, %zu per row",
+            ctx->hoist.levels[HOIST_FRAME].count,
+            ctx->hoist.levels[HOIST_COLUMN].count,
+            ctx->hoist.levels[HOIST_ROW].count);
+  }
+  ctx->slot_count = node_slot_count(f);
+
+  switch (ctx->engine) {
+  case ENGINE_TREE:
+    break;
+
+  case ENGINE_VM:
+    if (!compile_node_func_into_program(&ctx->program, f, math))
+      return render_fail(ctx);
+    stack_size = ctx->program.max_stack + ctx->program.slot_count;
+    nob_log(INFO, "Stack VM: %zu instructions, %zu stack slots",
+            ctx->program.count, ctx->program.max_stack);
+    break;
+
+  case ENGINE_REG:
+    if (!compile_node_func_into_reg_program(&ctx->reg_program, f, math))
+      return render_fail(ctx);
+    nob_log(INFO, "Register VM: %zu instructions, %zu registers",
+            ctx->reg_program.count, ctx->reg_program.register_count);
+    break;
+
+  case ENGINE_JIT:
+    if (!compile_node_func_into_reg_program(&ctx->reg_program, f, math))
+      return render_fail(ctx);
+    if (!jit_supported() || !jit_compile_reg_program(&ctx->jit,
+                                                     &ctx->reg_program)) {
+      nob_log(WARNING, "JIT is not available, falling back to register VM");
+      ctx->engine = ENGINE_REG;
+      break;
+    }
+    nob_log(INFO, "JIT: %zu instructions, %zu registers, %zu bytes of code",
+            ctx->reg_program.count, ctx->reg_program.register_count,
+            ctx->jit.code_size);
+    break;
+
+  case ENGINE_AOT:
+    if (!aot_load_kernel(&ctx->aot, f, math)) {
+      nob_log(WARNING, "AOT kernel is not available, falling back to "
+                       "register VM");
+      if (!compile_node_func_into_reg_program(&ctx->reg_program, f, math))
+        return render_fail(ctx);
+      ctx->engine = ENGINE_REG;
+      break;
+    }
+    stack_size = 3 * TILE_WIDTH;
+    break;
+
+  case ENGINE_SPAN: {
+    // The row result itself takes three buffers
+    size_t buffers = 3 + span_buffers_needed(f);
+    span_arena_size = buffers * span_stride(TILE_WIDTH);
+    if (span_arena_size > SPAN_ARENA_CAPACITY) {
+      nob_log(ERROR,
+              "Span engine needs %zu buffers of %d pixels, arena holds only "
+              "%d floats",
+              buffers, TILE_WIDTH, SPAN_ARENA_CAPACITY);
+      return render_fail(ctx);
+    }
+
+    if (!simd_isa_supported(options.simd)) {
+      nob_log(ERROR, "CPU does not support %s", simd_isa_names[options.simd]);
+      return render_fail(ctx);
+    }
+    ctx->kernels = span_kernels(options.simd, options.math);
+    nob_log(INFO, "Span: %zu buffers of %d pixels, %s kernels", buffers,
+            TILE_WIDTH, simd_isa_names[ctx->kernels->isa]);
+  } break;
+
+  case COUNT_ENGINES:
+  default:
+    UNREACHABLE_CODE("render_pixels");
+  }
+
+  // The register VM only reads the hoisted values it has registers for
+  bool reg = ctx->engine == ENGINE_REG || ctx->engine == ENGINE_JIT;
+  for (size_t level = 0; level < COUNT_HOIST_LEVELS; ++level) {
+    const Hoist_Nodes *nodes = &ctx->hoist.levels[level];
+    for (size_t i = 0; i < nodes->count; ++i) {
+      size_t index = render_input_index(ctx, nodes->items[i]->slot);
+      if (reg && index == 0)
+        continue;
+      da_append(&ctx->loads[level],
+                ((Render_Load){.value = i, .index = index}));
+    }
+  }
+  for (size_t i = 0; i < ctx->poly.count; ++i) {
+    size_t index = render_input_index(ctx, ctx->poly.items[i].node->slot);
+    if (reg && index == 0)
+      continue;
+    da_append(&ctx->poly_loads, ((Render_Load){.value = i, .index = index}));
+  }
+
+  ctx->workers = aligned_alloc(_Alignof(Render_Worker),
+                              threads * sizeof(*ctx->workers));
+  assert(ctx->workers != NULL && "Buy more RAM lol");
+  for (size_t i = 0; i < threads; ++i) {
+    Render_Worker *w = &ctx->workers[i];
+    *w = (Render_Worker){0};
+    if (stack_size > 0) {
+      w->stack = malloc(stack_size * sizeof(*w->stack));
+      assert(w->stack != NULL && "Buy more RAM lol");
+    }
+    if (ctx->engine == ENGINE_TREE)
+      eval_memo_init(&w->memo, ctx->slot_count, math);
+    // The span engine reads them straight from the tables
+    w->inputs = ctx->engine == ENGINE_TREE  ? w->memo.inputs
+                : ctx->engine == ENGINE_VM  ? w->stack
+                : ctx->engine == ENGINE_REG ? w->regs
+                : ctx->engine == ENGINE_JIT ? w->regs
+                                           : NULL;
+    if (w->inputs != NULL)
+      render_load_hoisted(ctx, w, HOIST_FRAME, 0);
+    w->interval_slots =
+        malloc((ctx->slot_count + 1) * sizeof(*w->interval_slots));
+    w->interval_filled =
+        malloc((ctx->slot_count + 1) * sizeof(*w->interval_filled));
+    assert(w->interval_slots != NULL && w->interval_filled != NULL &&
+           "Buy more RAM lol");
+    if (ctx->poly_loads.count > 0) {
+      w->poly_deltas = malloc(ctx->poly.count * (POLY_MAX_DEGREE + 1) *
+                              sizeof(*w->poly_deltas));
+      assert(w->poly_deltas != NULL && "Buy more RAM lol");
+    }
+    if (span_arena_size > 0) {
+      span_arena_init(&w->span_arena, span_arena_size);
+      w->span_slots = malloc(ctx->slot_count * span_stride(TILE_WIDTH) *
+                             sizeof(*w->span_slots));
+      w->span_filled = malloc((ctx->slot_count + 1) * sizeof(*w->span_filled));
+      assert(w->span_filled != NULL && "Buy more RAM lol");
+    }
+  }
+
+  if (!pool_init(&ctx->pool, threads, render_worker_setup, ctx)) {
+    nob_log(WARNING, "Could not start all %zu threads", threads);
+    if (ctx->pool.threads == 0)
+      return render_fail(ctx);
+  }
+  return ctx;
+}
+
+void render_rows(Render_Context *ctx, Color *pixels, size_t y, size_t rows) {
+  assert(y + rows <= ctx->height);
+  ctx->pixels = pixels;
+  ctx->y0 = y;
+  ctx->y1 = y + rows;
+  size_t tiles = ctx->tiles_x * ((rows + TILE_HEIGHT - 1) / TILE_HEIGHT);
+  pool_run(&ctx->pool, tiles, render_tile, ctx);
+  ctx->tiles += tiles;
+  for (size_t i = 0; i < ctx->pool.threads; ++i)
+    ctx->stolen += ctx->pool.deques[i].stolen;
+}
+
+void render_end(Render_Context *ctx) {
+  size_t flat_tiles = 0, subnormal_pixels = 0;
+  for (size_t i = 0; i < ctx->threads; ++i) {
+    flat_tiles += ctx->workers[i].flat_tiles;
+    subnormal_pixels += ctx->workers[i].subnormal_pixels;
+  }
+  nob_log(INFO, "Rendered %zu tiles of %dx%d on %zu threads, %zu stolen",
+          ctx->tiles, TILE_WIDTH, TILE_HEIGHT, ctx->pool.threads,
+          ctx->stolen);
+  if (ctx->interval)
+    nob_log(INFO, "Interval: %zu tiles filled with a single color",
+            flat_tiles);
+  if (ctx->count_subnormals) {
+    nob_log(INFO, "Subnormals: %zu of %zu pixels read or produced one",
+            subnormal_pixels, ctx->width * ctx->height);
+  }
+  render_free(ctx);
+}
 
-  if (!result || !expect_kind(result, NK_TRIPLE))
+/// Render the evaluated pixel values from the typechecked ast
+bool render_pixels(Image image, Node *f, Render_Options options) {
+  Render_Context *ctx = render_begin(f, image.width, image.height, options);
+  if (ctx == NULL)
     return false;
-  if (!expect_kind(result->as.triple.first, NK_NUMBER) ||
-      !expect_kind(result->as.triple.second, NK_NUMBER) ||
-      !expect_kind(result->as.triple.third, NK_NUMBER))
+  render_rows(ctx, image.data, 0, image.height);
+  render_end(ctx);
+  return true;
+}
+
+/// Largest channel difference between two renders in 8-bit units, plus how
+/// many pixels differ at all
+static void render_compare(Image image, Image expected_image, int *max_error,
+                           size_t *differ) {
+  const Color *pixels = image.data;
+  const Color *expected = expected_image.data;
+  *max_error = 0;
+  *differ = 0;
+  for (size_t i = 0; i < (size_t)image.width * image.height; ++i) {
+    int error = abs(pixels[i].r - expected[i].r);
+    error = fmax(error, abs(pixels[i].g - expected[i].g));
+    error = fmax(error, abs(pixels[i].b - expected[i].b));
+    *max_error = fmax(*max_error, error);
+    *differ += error > 0;
+  }
+}
+
+bool render_math_report(Image image, Node *f, Render_Options options) {
+  Image precise = GenImageColor(image.width, image.height, BLANK);
+  options.math = MATH_PRECISE;
+  if (!render_pixels(precise, f, options)) {
+    UnloadImage(precise);
     return false;
+  }
 
-  c->x = result->as.triple.first->as.number;
-  c->y = result->as.triple.second->as.number;
-  c->z = result->as.triple.third->as.number;
+  int max_error;
+  size_t differ;
+  render_compare(image, precise, &max_error, &differ);
+  nob_log(INFO,
+          "Math report: at most %d/255 off the precise path, %zu of %d "
+          "pixels differ",
+          max_error, differ, image.width * image.height);
+  UnloadImage(precise);
   return true;
 }
 
-/// Render the evaluated pixel values from the ast
-bool render_pixels(Image image, Node *f) {
-  Color *pixels = image.data;
+static double seconds_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  for (size_t y = 0; y < IMAGE_HEIGHT; ++y) {
-    // 0..<IMAGE_HEIGHT => 0..1 => 0..2 => -1..1
-    float ny = (float)y / IMAGE_HEIGHT * 2.0f - 1;
-    for (size_t x = 0; x < IMAGE_WIDTH; ++x) {
-      float nx = (float)x / IMAGE_WIDTH * 2.0f - 1;
+bool render_ftz_report(Image image, double seconds, Node *f,
+                       Render_Options options) {
+  Image other = GenImageColor(image.width, image.height, BLANK);
+  Render_Options flipped = options;
+  flipped.ftz = !options.ftz;
+  double start = seconds_now();
+  if (!render_pixels(other, f, flipped)) {
+    UnloadImage(other);
+    return false;
+  }
+  double other_seconds = seconds_now() - start;
+  int max_error;
+  size_t differ;
+  render_compare(image, other, &max_error, &differ);
+
+  // Counting costs time of its own, so it gets a render of its own
+  Render_Options counting = options;
+  counting.ftz = false;
+  counting.count_subnormals = true;
+  bool ok = render_pixels(other, f, counting);
+  UnloadImage(other);
+  if (!ok)
+    return false;
 
-      Vector3 c;
-      if (!eval_func(f, nx, ny, 0.0f, &c))
-        return false;
+  double off = options.ftz ? other_seconds : seconds;
+  double on = options.ftz ? seconds : other_seconds;
+  nob_log(INFO,
+          "FTZ report: %.3fs without flush-to-zero, %.3fs with it (%.2fx), "
+          "at most %d/255 apart, %zu of %d pixels differ",
+          off, on, off / on, max_error, differ, image.width * image.height);
+  return true;
+}
 
-      size_t index = y * IMAGE_WIDTH + x;
-      pixels[index].r = (c.x + 1) / 2 * 255;
-      pixels[index].g = (c.y + 1) / 2 * 255;
-      pixels[index].b = (c.z + 1) / 2 * 255;
-      pixels[index].a = 255;
-    }
+// Renders of every chain, the fastest one is the least disturbed
+#define COST_RUNS 2
+
+/// Fastest of COST_RUNS renders of `f`, a negative time if one fails
+static double render_time(Image image, Node *f, Render_Options options) {
+  double best = -1.0;
+  for (size_t i = 0; i < COST_RUNS; ++i) {
+    double start = seconds_now();
+    if (!render_pixels(image, f, options))
+      return -1.0;
+    double seconds = seconds_now() - start;
+    if (best < 0.0 || seconds < best)
+      best = seconds;
   }
+  return best;
+}
 
+bool render_calibrate(Cost_Table *table, Render_Options options) {
+  // Building a kernel per chain would take longer than the renders, the
+  // machine code of the JIT is the closest thing
+  if (options.engine == ENGINE_AOT)
+    options.engine = ENGINE_JIT;
+  options.count_subnormals = false;
+  *table = (Cost_Table){0};
+  Image image = GenImageColor(IMAGE_WIDTH, IMAGE_HEIGHT, BLANK);
+  double pixels = IMAGE_WIDTH * IMAGE_HEIGHT;
+  double start = seconds_now();
+  int log_level = nob_minimal_log_level;
+  nob_minimal_log_level = WARNING;
+
+  Cse_Stats stats;
+  Node *f = cost_chain(NK_ADD, 0);
+  double base = typecheck(f) ? render_time(image, cse(f, &stats), options)
+                             : -1.0;
+  bool ok = base >= 0.0;
+  table->pixel_ns = base * 1e9 / pixels;
+  for (Node_Kind kind = 0; ok && kind < COST_KINDS; ++kind) {
+    // Only the tree interpreter knows the fused kinds
+    bool fused = kind == NK_MULT_ADD || kind == NK_SQRT_ABS ||
+                 kind == NK_SIN_ABS || kind == NK_SQUARE;
+    f = cost_chain(kind, COST_CHAIN_LENGTH);
+    if (f == NULL || (fused && options.engine != ENGINE_TREE))
+      continue;
+    double seconds =
+        typecheck(f) ? render_time(image, cse(f, &stats), options) : -1.0;
+    ok = seconds >= 0.0;
+    double ns = (seconds - base) * 1e9 / pixels / COST_CHAIN_LENGTH;
+    table->ns[kind] = ns > 0.0 ? ns : 0.0;
+  }
+
+  nob_minimal_log_level = log_level;
+  UnloadImage(image);
+  if (!ok) {
+    nob_log(ERROR, "Cost: could not render the calibration functions");
+    return false;
+  }
+  nob_log(INFO,
+          "Cost: calibrated in %.3fs, %.2f ns per pixel, add %.2f, mult %.2f, "
+          "sin %.2f, sqrt %.2f, mod %.2f, if %.2f ns",
+          seconds_now() - start, table->pixel_ns, table->ns[NK_ADD],
+          table->ns[NK_MULT], table->ns[NK_SIN], table->ns[NK_SQRT],
+          table->ns[NK_MOD], table->ns[NK_IF]);
   return true;
 }
 
+/// Render `f` `rows` rows at a time straight into the PNG at `path`, while
+/// the encoder threads compress the strips before it. Only a few strips of
+/// the image are ever in memory.
+static bool render_png_strips(const char *path, Node *f, size_t width,
+                              size_t height, size_t rows,
+                              Render_Options options) {
+  // Whole tiles, except for the last strip
+  rows = (rows + TILE_HEIGHT - 1) / TILE_HEIGHT * TILE_HEIGHT;
+  if (rows > height)
+    rows = height;
+
+  Png_Writer png;
+  if (!png_begin(&png, path, width, height, rows, options.threads)) {
+    png_end(&png);
+    return false;
+  }
+  Render_Context *ctx = render_begin(f, width, height, options);
+  if (ctx == NULL) {
+    png_end(&png);
+    return false;
+  }
+
+  bool ok = true;
+  // Time the renderer spends on the encoders instead of on pixels
+  double waiting = 0.0;
+  for (size_t y = 0; ok && y < height; y += rows) {
+    size_t count = rows < height - y ? rows : height - y;
+    double start = seconds_now();
+    Color *strip = png_next_strip(&png);
+    waiting += seconds_now() - start;
+    if (strip == NULL) {
+      ok = false;
+      break;
+    }
+    render_rows(ctx, strip, y, count);
+    png_submit_strip(&png, count);
+  }
+  render_end(ctx);
+  double start = seconds_now();
+  ok = png_end(&png) && ok;
+  waiting += seconds_now() - start;
+  if (ok) {
+    nob_log(INFO, "Strips: %zux%zu in strips of %zu rows, %zu KiB each, "
+                  "%zu encoder threads, %.3fs waiting for them",
+            width, height, rows, width * rows * sizeof(Color) / 1024,
+            options.threads, waiting);
+  }
+  return ok;
+}
+
+/// Compress an image rendered in one go with the encoder threads of
+/// render_png_strips()
+static bool export_png(Image image, const char *path, size_t threads) {
+  size_t width = image.width, height = image.height;
+  const Color *pixels = image.data;
+  Png_Writer png;
+  bool ok = png_begin(&png, path, width, height, IMAGE_STRIP_ROWS, threads);
+  for (size_t y = 0; ok && y < height; y += IMAGE_STRIP_ROWS) {
+    size_t count = height - y < IMAGE_STRIP_ROWS ? height - y
+                                                 : IMAGE_STRIP_ROWS;
+    Color *strip = png_next_strip(&png);
+    if (strip == NULL) {
+      ok = false;
+      break;
+    }
+    memcpy(strip, &pixels[y * width], count * width * sizeof(*strip));
+    png_submit_strip(&png, count);
+  }
+  return png_end(&png) && ok;
+}
+
+/// Render `f` `rows` rows at a time straight into `raw`, with no copy of
+/// the image in between
+static bool render_raw_strips(Raw_Writer *raw, Node *f, size_t rows,
+                              Render_Options options) {
+  size_t width = raw->width, height = raw->height;
+  rows = (rows + TILE_HEIGHT - 1) / TILE_HEIGHT * TILE_HEIGHT;
+  if (rows > height)
+    rows = height;
+
+  Render_Context *ctx = render_begin(f, width, height, options);
+  if (ctx == NULL)
+    return false;
+  Color *strip = malloc(width * rows * sizeof(*strip));
+  assert(strip != NULL && "Buy more RAM lol");
+
+  bool ok = true;
+  double writing = 0.0;
+  for (size_t y = 0; ok && y < height; y += rows) {
+    size_t count = rows < height - y ? rows : height - y;
+    render_rows(ctx, strip, y, count);
+    double start = seconds_now();
+    ok = raw_write_rows(raw, strip, count);
+    writing += seconds_now() - start;
+  }
+  render_end(ctx);
+  free(strip);
+  if (ok) {
+    nob_log(INFO, "Strips: %zux%zu %s in strips of %zu rows, %.3fs writing",
+            width, height, raw_format_names[raw->format], rows, writing);
+  }
+  return ok;
+}
+
 // Color: {x, x, x}
 Node *gray_gradient_ast() {
   Node *node = node_triple(node_x(), node_x(), node_x());
@@ -249,9 +1213,8 @@ Node *cool_gradient_ast() {
 }
 
 float rand_float(void) { return (float)rand() / RAND_MAX; }
-Node *gen_rule(Grammar grammar, Alexer_Token rule, int depth);
-
-Node *gen_node(Grammar grammar, Node *node, int depth) {
+/// Instantiate the grammar node `node` over its generated operands
+static Node *gen_node(Node *node, Node *operands[3]) {
   switch (node->kind) {
   case NK_X:
   case NK_Y:
@@ -262,64 +1225,32 @@ Node *gen_node(Grammar grammar, Node *node, int depth) {
 
   case NK_SQRT:
   case NK_ABS:
-  case NK_SIN: {
-    Node *value = gen_node(grammar, node->as.unop, depth);
-    if (!value)
-      return NULL;
-
-    return node_unop_loc(node->file, node->line, node->kind, value);
-  }
+  case NK_SIN:
+    return node_unop_loc(node->file, node->line, node->kind, operands[0]);
 
   case NK_ADD:
   case NK_MULT:
   case NK_MOD:
-  case NK_GT: {
-    Node *lhs = gen_node(grammar, node->as.binop.lhs, depth);
-    if (!lhs)
-      return NULL;
-    Node *rhs = gen_node(grammar, node->as.binop.rhs, depth);
-    if (!rhs)
-      return NULL;
-
-    return node_binop_loc(node->file, node->line, node->kind, lhs, rhs);
-  }
-
-  case NK_TRIPLE: {
-    Node *first = gen_node(grammar, node->as.triple.first, depth);
-    if (!first)
-      return NULL;
-    Node *second = gen_node(grammar, node->as.triple.second, depth);
-    if (!second)
-      return NULL;
-    Node *third = gen_node(grammar, node->as.triple.third, depth);
-    if (!third)
-      return NULL;
-
-    return node_triple_loc(node->file, node->line, first, second, third);
-  }
-
-  case NK_IF: {
-    Node *cond = gen_node(grammar, node->as.iff.cond, depth);
-    if (!cond)
-      return NULL;
-    Node *then = gen_node(grammar, node->as.iff.then, depth);
-    if (!then)
-      return NULL;
-    Node *elze = gen_node(grammar, node->as.iff.elze, depth);
-    if (!elze)
-      return NULL;
+  case NK_GT:
+    return node_binop_loc(node->file, node->line, node->kind, operands[0],
+                          operands[1]);
 
-    return node_if_loc(node->file, node->line, cond, then, elze);
-  }
+  case NK_TRIPLE:
+    return node_triple_loc(node->file, node->line, operands[0], operands[1],
+                           operands[2]);
 
-  case NK_RULE: {
-    return gen_rule(grammar, node->as.rule, depth - 1);
-  }
+  case NK_IF:
+    return node_if_loc(node->file, node->line, operands[0], operands[1],
+                       operands[2]);
 
-  case NK_RANDOM: {
+  case NK_RANDOM:
     return node_number_loc(node->file, node->line, rand_float() * 2.0f - 1.0f);
-  }
 
+  case NK_RULE:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
   default:
     UNREACHABLE_CODE("gen_node");
   }
@@ -338,30 +1269,123 @@ Grammar_Branches *branches_by_name(Grammar *grammar, Alexer_Token rule) {
   return NULL;
 }
 
-Node *gen_rule(Grammar grammar, Alexer_Token rule, int depth) {
-  if (depth <= 0)
-    return NULL;
+// A rule picking one of its branches (`node` is NULL, `next` counts the
+// attempts), or a node of a branch with `next` of its operands generated
+typedef struct {
+  Node *node;
+  Alexer_Token rule;
+  int depth;
+  size_t next;
+} Gen_Frame;
 
-  Grammar_Branches *branches = branches_by_name(&grammar, rule);
-  if (branches == NULL)
-    return NULL;
-  assert(branches->count > 0);
-
-  Node *node = NULL;
-  for (size_t attempts = 0; node == NULL && attempts < GEN_RULE_MAX_ATTEMPTS;
-       ++attempts) {
-    float p = rand_float();
-    float t = 0.0f;
-    for (size_t i = 0; i < branches->count; ++i) {
-      t += (float)branches->items[i].weight / branches->weight_sum;
-      if (t >= p) {
-        node = gen_node(grammar, branches->items[i].node, depth - 1);
-        break;
+typedef struct {
+  Gen_Frame *items;
+  size_t count;
+  size_t capacity;
+} Gen_Frames;
+
+typedef struct {
+  Node **items;
+  size_t count;
+  size_t capacity;
+} Gen_Results;
+
+/// Expand `rule` into a function, NULL when no attempt ends within `depth`
+/// or the function grows past `max_nodes`. The grammar is walked with
+/// explicit stacks, so deep functions do not run out of call stack, and a
+/// branch that fails is picked again like before.
+Node *gen_rule(Grammar grammar, Alexer_Token rule, int depth,
+               size_t max_nodes) {
+  Gen_Frames frames = {0};
+  Gen_Results results = {0};
+  size_t nodes = 0;
+  da_append(&frames, ((Gen_Frame){.rule = rule, .depth = depth}));
+
+  while (frames.count > 0) {
+    Gen_Frame *frame = &frames.items[frames.count - 1];
+
+    if (frame->node == NULL) {
+      Grammar_Branches *branches = NULL;
+      if (frame->next > 0) {
+        // The previous attempt is back
+        Node *node = results.items[results.count - 1];
+        if (node != NULL || frame->next == GEN_RULE_MAX_ATTEMPTS) {
+          frames.count -= 1;
+          continue;
+        }
+        results.count -= 1;
+        branches = branches_by_name(&grammar, frame->rule);
+      } else if (frame->depth > 0) {
+        branches = branches_by_name(&grammar, frame->rule);
+      }
+      if (branches == NULL) {
+        da_append(&results, NULL);
+        frames.count -= 1;
+        continue;
+      }
+      assert(branches->count > 0);
+
+      Node *branch = NULL;
+      while (branch == NULL && frame->next < GEN_RULE_MAX_ATTEMPTS) {
+        frame->next += 1;
+        float p = rand_float();
+        float t = 0.0f;
+        for (size_t i = 0; i < branches->count && branch == NULL; ++i) {
+          t += (float)branches->items[i].weight / branches->weight_sum;
+          if (t >= p)
+            branch = branches->items[i].node;
+        }
       }
+      if (branch == NULL) {
+        da_append(&results, NULL);
+        frames.count -= 1;
+        continue;
+      }
+      int branch_depth = frame->depth - 1;
+      da_append(&frames, ((Gen_Frame){.node = branch, .depth = branch_depth}));
+      continue;
+    }
+
+    if (frame->node->kind == NK_RULE) {
+      *frame = (Gen_Frame){.rule = frame->node->as.rule,
+                           .depth = frame->depth - 1};
+      continue;
+    }
+
+    // An operand that failed fails the whole node
+    if (frame->next > 0 && results.items[results.count - 1] == NULL) {
+      results.count -= frame->next;
+      da_append(&results, NULL);
+      frames.count -= 1;
+      continue;
+    }
+
+    Node *operands[3];
+    size_t operands_count = node_children(frame->node, operands);
+    if (frame->next < operands_count) {
+      Gen_Frame operand = {.node = operands[frame->next++],
+                           .depth = frame->depth};
+      da_append(&frames, operand);
+      continue;
     }
+
+    if (++nodes > max_nodes) {
+      nob_log(ERROR, "Function grows past %zu nodes, see -max-nodes",
+              max_nodes);
+      da_free(frames);
+      da_free(results);
+      return NULL;
+    }
+    results.count -= operands_count;
+    Node *node = gen_node(frame->node, &results.items[results.count]);
+    da_append(&results, node);
+    frames.count -= 1;
   }
 
-  return node;
+  Node *f = results.items[0];
+  da_free(frames);
+  da_free(results);
+  return f;
 }
 
 // Grammar:
@@ -408,8 +1432,15 @@ Texture GetDefaultTexture() {
   };
 }
 
-bool compile_node_func_into_fragment_expression(String_Builder *sb,
-                                                Node *expr) {
+/// GLSL written before the `i`-th operand of `expr`, after the last one for
+/// i == children count, or around the whole node when it has none
+static void compile_node_into_fragment_text(String_Builder *sb, Node *expr,
+                                            size_t i, size_t children_count) {
+  if (i == children_count && i > 0) {
+    sb_append_cstr(sb, ")");
+    return;
+  }
+
   switch (expr->kind) {
   case NK_X:
   case NK_Y:
@@ -429,64 +1460,132 @@ bool compile_node_func_into_fragment_expression(String_Builder *sb,
 
   case NK_SQRT:
   case NK_ABS:
-  case NK_SIN: {
-    sb_append_cstr(sb, temp_sprintf("%s(", node_kind_string(expr->kind)));
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.unop))
-      return false;
-    sb_append_cstr(sb, ")");
-  } break;
+  case NK_SIN:
+    sb_append_cstr(sb, node_kind_string(expr->kind));
+    sb_append_cstr(sb, "(");
+    break;
 
   case NK_ADD:
   case NK_MULT:
   case NK_GT:
-  case NK_MOD: {
-    sb_append_cstr(sb, expr->kind == NK_MOD ? "mod(" : "(");
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.binop.lhs))
-      return false;
-    sb_append_cstr(sb, node_kind_operation(expr->kind));
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.binop.rhs))
-      return false;
-    sb_append_cstr(sb, ")");
-  } break;
+  case NK_MOD:
+    if (i == 0)
+      sb_append_cstr(sb, expr->kind == NK_MOD ? "mod(" : "(");
+    else
+      sb_append_cstr(sb, node_kind_operation(expr->kind));
+    break;
 
-  case NK_TRIPLE: {
-    sb_append_cstr(sb, "vec3(");
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.triple.first))
-      return false;
-    sb_append_cstr(sb, ",");
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.triple.second))
-      return false;
-    sb_append_cstr(sb, ",");
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.triple.third))
-      return false;
-    sb_append_cstr(sb, ")");
-  } break;
+  case NK_TRIPLE:
+    sb_append_cstr(sb, i == 0 ? "vec3(" : ",");
+    break;
 
-  case NK_IF: {
-    sb_append_cstr(sb, "(");
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.iff.cond))
-      return false;
-    sb_append_cstr(sb, "?");
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.iff.then))
-      return false;
-    sb_append_cstr(sb, ":");
-    if (!compile_node_func_into_fragment_expression(sb, expr->as.iff.elze))
-      return false;
-    sb_append_cstr(sb, ")");
-  } break;
+  case NK_IF:
+    sb_append_cstr(sb, i == 0 ? "(" : i == 1 ? "?" : ":");
+    break;
+
+  case NK_RULE:
+  case NK_RANDOM:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  default:
+    UNREACHABLE_CODE("compile_node_into_fragment_text");
+  }
+}
+
+/// Compile the node itself, even when it is shared. The operands are walked
+/// with an explicit stack, so deep trees do not run out of call stack.
+bool compile_node_into_fragment_value(String_Builder *sb, Node *expr) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, expr);
+  bool ok = true;
+  while (ok && frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *node = frame->node;
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+
+    if (frame->next == 0) {
+      // Shared operands are declared up front by
+      // compile_node_func_into_fragment_slots() and only referenced by name
+      if (node != expr && node->slot > 0) {
+        size_t checkpoint = nob_temp_save();
+        sb_append_cstr(sb, temp_sprintf("s%zu", node->slot));
+        nob_temp_rewind(checkpoint);
+        frames.count -= 1;
+        continue;
+      }
+      if (node->kind == NK_RULE || node->kind == NK_RANDOM) {
+        printf("%s:%d: ERROR: cannot compile a node that is only valid for "
+               "grammar definitions\n",
+               node->file, node->line);
+        ok = false;
+        break;
+      }
+    }
+
+    compile_node_into_fragment_text(sb, node, frame->next, children_count);
+    if (frame->next == children_count) {
+      frames.count -= 1;
+      continue;
+    }
+    node_frames_push(&frames, children[frame->next++]);
+  }
+  free(frames.items);
+  return ok;
+}
+
+/// Shared nodes are declared up front by
+/// compile_node_func_into_fragment_slots() and only referenced by name
+bool compile_node_func_into_fragment_expression(String_Builder *sb,
+                                                Node *expr) {
+  if (expr->slot > 0) {
+    size_t checkpoint = nob_temp_save();
+    sb_append_cstr(sb, temp_sprintf("s%zu", expr->slot));
+    nob_temp_rewind(checkpoint);
+    return true;
+  }
+  return compile_node_into_fragment_value(sb, expr);
+}
 
-  case NK_RULE:
-  case NK_RANDOM:
-    printf("%s:%d: ERROR: cannot compile a node that is only valid for grammar "
-           "definitions\n",
-           expr->file, expr->line);
-    return false;
+/// Declare every shared value of the DAG as a local before its first use,
+/// operands first
+bool compile_node_func_into_fragment_slots(String_Builder *sb, Node *expr,
+                                           bool *declared) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, expr);
+  bool ok = true;
+  while (ok && frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *node = frame->node;
+    if (frame->next == 0 && node->slot > 0 && declared[node->slot]) {
+      frames.count -= 1;
+      continue;
+    }
 
-  default:
-    UNREACHABLE_CODE("compile_node_func_into_fragment_expression");
-  }
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
 
-  return true;
+    frames.count -= 1;
+    if (node->slot > 0) {
+      size_t checkpoint = nob_temp_save();
+      sb_append_cstr(sb, temp_sprintf("  %s s%zu = ",
+                                      node->type == NK_BOOLEAN ? "bool"
+                                                               : "float",
+                                      node->slot));
+      nob_temp_rewind(checkpoint);
+      ok = compile_node_into_fragment_value(sb, node);
+      sb_append_cstr(sb, ";\n");
+      declared[node->slot] = true;
+    }
+  }
+  free(frames.items);
+  return ok;
 }
 
 bool compile_node_func_into_fragment_shader(String_Builder *sb, Node *f) {
@@ -503,6 +1602,14 @@ bool compile_node_func_into_fragment_shader(String_Builder *sb, Node *f) {
   sb_append_cstr(sb, "  float x = fragTexCoord.x * 2.0 - 1.0;\n");
   sb_append_cstr(sb, "  float y = fragTexCoord.y * 2.0 - 1.0;\n");
   sb_append_cstr(sb, "  float t = sin(time);\n");
+
+  bool *declared = calloc(node_slot_count(f) + 1, sizeof(*declared));
+  assert(declared != NULL && "Buy more RAM lol");
+  bool ok = compile_node_func_into_fragment_slots(sb, f, declared);
+  free(declared);
+  if (!ok)
+    return false;
+
   sb_append_cstr(sb, "  finalColor = map_color(");
   if (!compile_node_func_into_fragment_expression(sb, f))
     return false;
@@ -512,25 +1619,203 @@ bool compile_node_func_into_fragment_shader(String_Builder *sb, Node *f) {
   return true;
 }
 
-int parse_optional_depth(char **argv, int argc_) {
-  if (argc_ >= 1 && strcmp(argv[0], "-depth") == 0) {
-    shift(argv, argc_);
-    if (argc_ >= 1) {
-      const char *depth_str = shift(argv, argc_);
-      if (depth_str) {
-        return atoi(depth_str);
-      }
-    } else {
-      nob_log(WARNING,
-              "Expected value after -depth flag, using default depth: %d",
-              GRAMMAR_DEPTH);
-      return GRAMMAR_DEPTH;
+/// Merge pairs of operations into one dispatch of the tree interpreter
+Node *fuse_log(Node *f) {
+  Fuse_Stats stats;
+  f = fuse(f, &stats);
+  nob_log(INFO, "Fusion: %zu pairs fused, %zu -> %zu dispatches per pixel",
+          stats.fused, stats.dispatches_before, stats.dispatches_after);
+  return f;
+}
+
+#define OPT_NAN_REPORT_MAX 8
+
+/// Simplify a typechecked function before any evaluator sees it and warn
+/// about the subtrees that may turn pixels into NaN
+Node *optimize_log(Node *f, Opt_Level level, Opt_Target target,
+                   const Math_Funcs *math) {
+  Opt_Stats stats;
+  f = optimize(f, level, target, math, &stats);
+  nob_log(INFO,
+          "Optimizer (%s): %zu nodes -> %zu nodes, %zu rewrites (%zu by "
+          "value ranges), %zu chains rebalanced",
+          opt_level_names[level], stats.nodes_before, stats.nodes_after,
+          stats.rewrites, stats.range_rewrites, stats.reassociated);
+
+  // Points at the grammar rules that produced them
+  Node *sources[OPT_NAN_REPORT_MAX];
+  size_t count = opt_nan_sources(f, math, sources, OPT_NAN_REPORT_MAX);
+  for (size_t i = 0; i < count && i < OPT_NAN_REPORT_MAX; ++i) {
+    nob_log(WARNING, "%s:%d: %s() may produce NaN", sources[i]->file,
+            sources[i]->line, node_kind_string(sources[i]->kind));
+  }
+  if (count > OPT_NAN_REPORT_MAX) {
+    nob_log(WARNING, "... and %zu more subtrees that may produce NaN",
+            count - OPT_NAN_REPORT_MAX);
+  }
+  return f;
+}
+
+/// Merge the common subexpressions of a typechecked function into a DAG
+Node *cse_log(Node *f) {
+  Cse_Stats stats;
+  f = cse(f, &stats);
+  nob_log(INFO, "CSE: %zu tree nodes, %zu unique nodes, %zu shared values",
+          stats.tree_nodes, stats.dag_nodes, stats.slots);
+  return f;
+}
+
+/// Find `flag` anywhere in the arguments and return the value after it
+const char *parse_optional_flag(char **argv, int argc_, const char *flag) {
+  for (int i = 0; i < argc_; ++i) {
+    if (strcmp(argv[i], flag) == 0) {
+      if (i + 1 < argc_)
+        return argv[i + 1];
+      nob_log(WARNING, "Expected value after %s flag", flag);
+      return NULL;
     }
   }
+  return NULL;
+}
+
+int parse_optional_depth(char **argv, int argc_) {
+  const char *depth_str = parse_optional_flag(argv, argc_, "-depth");
+  if (depth_str) {
+    return atoi(depth_str);
+  }
   nob_log(INFO, "No depth provided, using default depth: %d", GRAMMAR_DEPTH);
   return GRAMMAR_DEPTH;
 }
 
+size_t parse_optional_max_nodes(char **argv, int argc_) {
+  const char *max_nodes_str = parse_optional_flag(argv, argc_, "-max-nodes");
+  if (max_nodes_str) {
+    return strtoul(max_nodes_str, NULL, 10);
+  }
+  return GEN_MAX_NODES;
+}
+
+bool parse_optional_simd(char **argv, int argc_, Simd_Isa *simd) {
+  const char *simd_str = parse_optional_flag(argv, argc_, "-simd");
+  if (!simd_str)
+    return true;
+
+  for (size_t i = 0; i < COUNT_SIMD_ISAS; ++i) {
+    if (strcmp(simd_str, simd_isa_names[i]) == 0) {
+      *simd = i;
+      return true;
+    }
+  }
+
+  nob_log(ERROR, "Unknown SIMD instruction set: %s", simd_str);
+  return false;
+}
+
+bool parse_optional_threads(char **argv, int argc_, size_t *threads) {
+  const char *threads_str = parse_optional_flag(argv, argc_, "-threads");
+  if (!threads_str)
+    return true;
+
+  int n = atoi(threads_str);
+  if (n < 1 || n > POOL_MAX_THREADS) {
+    nob_log(ERROR, "Thread count must be between 1 and %d: %s",
+            POOL_MAX_THREADS, threads_str);
+    return false;
+  }
+  *threads = n;
+  return true;
+}
+
+/// A count of at least 1 and at most `max` after `flag`
+bool parse_optional_count(char **argv, int argc_, const char *flag,
+                          size_t max, size_t *count) {
+  const char *count_str = parse_optional_flag(argv, argc_, flag);
+  if (!count_str)
+    return true;
+
+  char *end;
+  unsigned long n = strtoul(count_str, &end, 10);
+  if (*end != '\0' || n < 1 || n > max) {
+    nob_log(ERROR, "%s must be between 1 and %zu: %s", flag, max, count_str);
+    return false;
+  }
+  *count = n;
+  return true;
+}
+
+bool parse_optional_opt(char **argv, int argc_, Opt_Level *level) {
+  const char *level_str = parse_optional_flag(argv, argc_, "-opt");
+  if (!level_str)
+    return true;
+
+  for (size_t i = 0; i < COUNT_OPT_LEVELS; ++i) {
+    if (strcmp(level_str, opt_level_names[i]) == 0) {
+      *level = i;
+      return true;
+    }
+  }
+
+  nob_log(ERROR, "Unknown optimization level: %s", level_str);
+  return false;
+}
+
+bool parse_optional_math(char **argv, int argc_, Math_Tier *tier) {
+  const char *tier_str = parse_optional_flag(argv, argc_, "-math");
+  if (!tier_str)
+    return true;
+
+  for (size_t i = 0; i < COUNT_MATH_TIERS; ++i) {
+    if (strcmp(tier_str, math_tier_names[i]) == 0) {
+      *tier = i;
+      return true;
+    }
+  }
+
+  nob_log(ERROR, "Unknown math tier: %s", tier_str);
+  return false;
+}
+
+bool parse_optional_format(char **argv, int argc_, Raw_Format *format) {
+  const char *format_str = parse_optional_flag(argv, argc_, "-format");
+  if (!format_str)
+    return true;
+
+  for (size_t i = 0; i < COUNT_RAW_FORMATS; ++i) {
+    if (strcmp(format_str, raw_format_names[i]) == 0) {
+      *format = i;
+      return true;
+    }
+  }
+
+  nob_log(ERROR, "Unknown format: %s", format_str);
+  return false;
+}
+
+/// Whether the valueless `flag` is anywhere in the arguments
+bool parse_optional_switch(char **argv, int argc_, const char *flag) {
+  for (int i = 0; i < argc_; ++i) {
+    if (strcmp(argv[i], flag) == 0)
+      return true;
+  }
+  return false;
+}
+
+bool parse_optional_engine(char **argv, int argc_, Render_Engine *engine) {
+  const char *engine_str = parse_optional_flag(argv, argc_, "-engine");
+  if (!engine_str)
+    return true;
+
+  for (size_t i = 0; i < COUNT_ENGINES; ++i) {
+    if (strcmp(engine_str, engine_names[i]) == 0) {
+      *engine = i;
+      return true;
+    }
+  }
+
+  nob_log(ERROR, "Unknown engine: %s", engine_str);
+  return false;
+}
+
 bool parse_node(Alexer *l, Node **node);
 
 bool parse_unary(Alexer *l, Node **value) {
@@ -577,12 +1862,19 @@ bool parse_node(Alexer *l, Node **node) {
   PARSE_BINOP("add", NK_ADD)
   PARSE_BINOP("mult", NK_MULT)
   PARSE_BINOP("mod", NK_MOD)
+  PARSE_BINOP("gt", NK_GT)
   else if (alexer_token_text_equal_cstr(t, "vec3")) {
     Node *first, *second, *third;
     if (!parse_triple(l, &first, &second, &third))
       return false;
     *node = node_triple_loc(t.loc.file_path, t.loc.row, first, second, third);
   }
+  else if (alexer_token_text_equal_cstr(t, "if")) {
+    Node *cond, *then, *elze;
+    if (!parse_triple(l, &cond, &then, &elze))
+      return false;
+    *node = node_if_loc(t.loc.file_path, t.loc.row, cond, then, elze);
+  }
   else {
     *node = node_rule_from_token(t);
   }
@@ -680,10 +1972,426 @@ bool parse_grammar(Alexer *l, Grammar *grammar) {
   return true;
 }
 
-int main(int argc, char **argv) {
-  srand(time(0));
+#define SHAPES_COUNT 16
+#define SHAPES_TOP 10
+
+/// Most frequent first
+static int compare_shapes_by_count(const void *a, const void *b) {
+  const Fuse_Shape *lhs = a, *rhs = b;
+  return (lhs->count < rhs->count) - (lhs->count > rhs->count);
+}
+
+// The first rule of the file is the entry
+bool load_grammar(const char *path, Grammar *grammar, Alexer_Token *entry) {
+  String_Builder source = {0};
+  if (!read_entire_file(path, &source))
+    return false;
+
+  Alexer l = alexer_create(path, source.items, source.count);
+  l.puncts = puncts;
+  l.puncts_count = COUNT_PUNCTS;
+  l.sl_comments = comments;
+  l.sl_comments_count = ARRAY_LEN(comments);
+
+  if (!parse_grammar(&l, grammar))
+    return false;
+  if (grammar->count == 0) {
+    nob_log(ERROR, "%s: grammar has no rules", path);
+    return false;
+  }
+  *entry = grammar->items[0].name;
+  return true;
+}
+
+// Checks of the `test` command, each logs what went wrong itself
+typedef struct {
+  const char *name;
+  bool (*run)(void);
+} Test;
+
+/// Folding leaves NaN and infinite constants, the AOT kernel must still
+/// build and produce them
+static bool test_aot_non_finite(void) {
+  Node *f = node_triple(node_add(node_x(), node_number(NAN)),
+                        node_number(INFINITY), node_number(-INFINITY));
+  if (!typecheck(f))
+    return false;
+  Cse_Stats stats;
+  f = cse(f, &stats);
+  Aot_Kernel kernel;
+  if (!aot_load_kernel(&kernel, f, math_funcs(MATH_PRECISE))) {
+    aot_unload_kernel(&kernel);
+    return false;
+  }
+  float xs[1] = {0.5f}, r, g, b;
+  kernel.row(xs, 0.0f, 0.0f, 1, &r, &g, &b);
+  aot_unload_kernel(&kernel);
+  if (!isnan(r) || g != INFINITY || b != -INFINITY) {
+    nob_log(ERROR, "AOT kernel computed %f %f %f instead of nan inf -inf", r,
+            g, b);
+    return false;
+  }
+  return true;
+}
+
+/// Whether a node of `kind` is anywhere in the tree
+static bool test_has_kind(Node *expr, Node_Kind kind) {
+  if (expr->kind == kind)
+    return true;
+  Node *children[3];
+  size_t children_count = node_children(expr, children);
+  for (size_t i = 0; i < children_count; ++i) {
+    if (test_has_kind(children[i], kind))
+      return true;
+  }
+  return false;
+}
+
+/// x*x is never negative even with its two x as separate nodes, so
+/// sqrt(x*x + y*y) cannot be NaN and its abs() guard goes away
+static bool test_square_range(void) {
+  Node *sums[2];
+  for (size_t i = 0; i < 2; ++i) {
+    sums[i] = node_add(node_mult(node_x(), node_x()),
+                       node_mult(node_y(), node_y()));
+  }
+  Node *guarded = node_unop_loc(__FILE__, __LINE__, NK_ABS, sums[1]);
+  Node *f = node_triple(node_sqrt(sums[0]), node_sqrt(guarded), node_t());
+  if (!typecheck(f))
+    return false;
+  Node *sources[1];
+  size_t count = opt_nan_sources(f, math_funcs(MATH_PRECISE), sources, 1);
+  if (count > 0) {
+    nob_log(ERROR, "%zu subtrees were reported as NaN sources", count);
+    return false;
+  }
+  Opt_Stats stats;
+  Node *optimized = optimize(f, OPT_SAFE, OPT_TARGET_ENGINES,
+                             math_funcs(MATH_PRECISE), &stats);
+  if (test_has_kind(optimized, NK_ABS) || stats.range_rewrites == 0) {
+    nob_log(ERROR, "The abs() guard was kept");
+    return false;
+  }
+  return true;
+}
+
+/// The bounds of sin(x) over a tile hold for the sin of every math tier the
+/// tile may be rendered with, not only for the precise one
+static bool test_interval_sin_tiers(void) {
+  Node *f = node_unop_loc(__FILE__, __LINE__, NK_SIN, node_x());
+  if (!typecheck(f))
+    return false;
+  for (Math_Tier tier = 0; tier < COUNT_MATH_TIERS; ++tier) {
+    const Math_Funcs *math = math_funcs(tier);
+    // Narrow tiles over a few periods keep the bounds tight
+    for (size_t i = 0; i < 4096; ++i) {
+      float lo = -8.0f + i * (16.0f / 4096);
+      float hi = lo + 1.0f / 1024;
+      Interval_Box box = {.x = {.lo = lo, .hi = hi}, .math = math};
+      Interval bounds;
+      eval_interval(&box, f, &bounds);
+      for (size_t j = 0; j <= 16; ++j) {
+        float x = lo + (hi - lo) * j / 16;
+        float value = math->sin(x);
+        if (value < bounds.lo || value > bounds.hi) {
+          nob_log(ERROR, "%s sin(%a) = %a is out of %a..%a",
+                  math_tier_names[tier], x, value, bounds.lo, bounds.hi);
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+/// A folded sin(C) is the sin of the tier the engines would have evaluated,
+/// so folding never changes a pixel
+static bool test_fold_sin_tiers(void) {
+  for (Math_Tier tier = 0; tier < COUNT_MATH_TIERS; ++tier) {
+    const Math_Funcs *math = math_funcs(tier);
+    Node *f = node_unop_loc(__FILE__, __LINE__, NK_SIN, node_number(2.5f));
+    if (!typecheck(f))
+      return false;
+    Opt_Stats stats;
+    Node *folded = optimize(f, OPT_SAFE, OPT_TARGET_ENGINES, math, &stats);
+    if (folded->kind != NK_NUMBER || folded->as.number != math->sin(2.5f)) {
+      nob_log(ERROR, "%s sin(2.5) was not folded with its own sin",
+              math_tier_names[tier]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Functions of the rendering checks: small enough to render quickly, odd
+// sizes so the last tile of a row and of a strip is a partial one
+#define TEST_DEPTH 24
+#define TEST_THREADS 3
+#define TEST_SEEDS 3
+
+static const size_t test_sizes[][2] = {
+    {1, 1}, {3, 7}, {65, 5}, {130, 67}, {1000, 3},
+};
+
+/// Every kind the engines know, unlike simple_grammar(), so the engines
+/// are compared on all of their operations, NaN included
+static Alexer_Token test_grammar(Grammar *grammar) {
+  Grammar_Branches branches = {0};
+
+  append_branch(&branches,
+                node_triple(node_rule("C"), node_rule("C"), node_rule("C")), 3);
+  append_branch(&branches,
+                node_if(node_gt(node_rule("C"), node_rule("C")),
+                        node_rule("E"), node_rule("E")),
+                1);
+  grammar_append_branches(grammar, &branches, "E");
+
+  append_branch(&branches, node_random(), 1);
+  append_branch(&branches, node_x(), 1);
+  append_branch(&branches, node_y(), 1);
+  append_branch(&branches, node_t(), 1);
+  grammar_append_branches(grammar, &branches, "A");
+
+  append_branch(&branches, node_rule("A"), 2);
+  append_branch(&branches, node_add(node_rule("C"), node_rule("C")), 3);
+  append_branch(&branches, node_mult(node_rule("C"), node_rule("C")), 3);
+  append_branch(&branches, node_mod(node_rule("C"), node_rule("C")), 1);
+  append_branch(&branches, node_sqrt(node_rule("C")), 1);
+  append_branch(&branches,
+                node_unop_loc(__FILE__, __LINE__, NK_ABS, node_rule("C")), 1);
+  append_branch(&branches,
+                node_unop_loc(__FILE__, __LINE__, NK_SIN, node_rule("C")), 1);
+  grammar_append_branches(grammar, &branches, "C");
+  return SYMBOL("E");
+}
+
+/// Function `seed` of test_grammar() through the passes of the file command
+static Node *test_function(unsigned int seed, Math_Tier tier) {
+  Grammar grammar = {0};
+  Alexer_Token entry = test_grammar(&grammar);
+  srand(seed);
+  Node *f = gen_rule(grammar, entry, TEST_DEPTH, GEN_MAX_NODES);
+  if (f == NULL || !typecheck(f) || !expect_type(f, NK_TRIPLE)) {
+    nob_log(ERROR, "Test function %u could not be generated", seed);
+    return NULL;
+  }
+  Opt_Stats opt_stats;
+  Cse_Stats cse_stats;
+  return cse(optimize(f, OPT_SAFE, OPT_TARGET_ENGINES, math_funcs(tier),
+                      &opt_stats),
+             &cse_stats);
+}
+
+static Render_Options test_options(Render_Engine engine, Math_Tier tier) {
+  return (Render_Options){
+      .engine = engine,
+      .simd = SIMD_AUTO,
+      .threads = TEST_THREADS,
+      .math = tier,
+  };
+}
+
+/// Only the tree interpreter knows the fused kinds
+static Node *test_engine_function(Node *f, Render_Engine engine) {
+  Fuse_Stats stats;
+  return engine == ENGINE_TREE ? fuse(f, &stats) : f;
+}
+
+static bool test_same_pixels(Image image, Image expected) {
+  return memcmp(image.data, expected.data,
+                (size_t)image.width * image.height * sizeof(Color)) == 0;
+}
+
+/// Every engine renders every pixel exactly like the tree walker without
+/// fusion, on every math tier and on sizes that end in partial tiles
+static bool test_engines_match(void) {
+  for (unsigned int seed = 1; seed <= TEST_SEEDS; ++seed) {
+    for (Math_Tier tier = 0; tier < COUNT_MATH_TIERS; ++tier) {
+      Node *f = test_function(seed, tier);
+      if (f == NULL)
+        return false;
+      for (size_t i = 0; i < ARRAY_LEN(test_sizes); ++i) {
+        int width = test_sizes[i][0], height = test_sizes[i][1];
+        Image expected = GenImageColor(width, height, BLANK);
+        Image image = GenImageColor(width, height, BLANK);
+        bool ok =
+            render_pixels(expected, f, test_options(ENGINE_TREE, tier));
+        for (Render_Engine engine = 0; ok && engine < COUNT_ENGINES;
+             ++engine) {
+          ok = render_pixels(image, test_engine_function(f, engine),
+                             test_options(engine, tier));
+          if (ok && !test_same_pixels(image, expected)) {
+            nob_log(ERROR, "%s differs from the tree walker on function %u, "
+                           "%s math, %dx%d",
+                    engine_names[engine], seed, math_tier_names[tier],
+                    width, height);
+            ok = false;
+          }
+        }
+        UnloadImage(expected);
+        UnloadImage(image);
+        if (!ok)
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+/// Rendering strip by strip, in strips that do not end on tile rows too,
+/// gives the image rendering it in one go gives
+static bool test_strips_match(void) {
+  static const size_t strip_rows[] = {1, 4, 7, 64};
+  Node *f = test_function(1, MATH_PRECISE);
+  if (f == NULL)
+    return false;
+  size_t width = 130, height = 67;
+  Image whole = GenImageColor(width, height, BLANK);
+  Image strips = GenImageColor(width, height, BLANK);
+  bool ok = true;
+  for (Render_Engine engine = 0; ok && engine < COUNT_ENGINES; ++engine) {
+    Node *g = test_engine_function(f, engine);
+    Render_Options options = test_options(engine, MATH_PRECISE);
+    ok = render_pixels(whole, g, options);
+    for (size_t i = 0; ok && i < ARRAY_LEN(strip_rows); ++i) {
+      Render_Context *ctx = render_begin(g, width, height, options);
+      if (ctx == NULL) {
+        ok = false;
+        break;
+      }
+      Color *pixels = strips.data;
+      for (size_t y = 0; y < height; y += strip_rows[i]) {
+        size_t rows = strip_rows[i] < height - y ? strip_rows[i] : height - y;
+        render_rows(ctx, &pixels[y * width], y, rows);
+      }
+      render_end(ctx);
+      if (!test_same_pixels(strips, whole)) {
+        nob_log(ERROR, "%s in strips of %zu rows differs from the whole image",
+                engine_names[engine], strip_rows[i]);
+        ok = false;
+      }
+    }
+  }
+  UnloadImage(whole);
+  UnloadImage(strips);
+  return ok;
+}
+
+/// The PNG of a whole image and the one streamed in strips both decode to
+/// the rendered pixels
+static bool test_png_round_trip(void) {
+  Node *f = test_function(2, MATH_PRECISE);
+  if (f == NULL)
+    return false;
+  Render_Options options = test_options(ENGINE_REG, MATH_PRECISE);
+  const char *path = temp_sprintf("%s/randomart-test-%d.png", P_tmpdir,
+                                  (int)getpid());
+  bool ok = true;
+  for (size_t i = 0; ok && i < ARRAY_LEN(test_sizes); ++i) {
+    int width = test_sizes[i][0], height = test_sizes[i][1];
+    Image image = GenImageColor(width, height, BLANK);
+    ok = render_pixels(image, f, options);
+    for (size_t streamed = 0; ok && streamed < 2; ++streamed) {
+      ok = streamed ? render_png_strips(path, f, width, height, TILE_HEIGHT,
+                                        options)
+                    : export_png(image, path, TEST_THREADS);
+      Image decoded = ok ? LoadImage(path) : (Image){0};
+      if (decoded.data == NULL || decoded.width != width ||
+          decoded.height != height) {
+        nob_log(ERROR, "%s of %dx%d could not be decoded", path, width,
+                height);
+        ok = false;
+      } else {
+        ImageFormat(&decoded, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+        if (!test_same_pixels(decoded, image)) {
+          nob_log(ERROR, "%s PNG of %dx%d decodes to other pixels",
+                  streamed ? "Streamed" : "Whole", width, height);
+          ok = false;
+        }
+      }
+      UnloadImage(decoded);
+    }
+    UnloadImage(image);
+  }
+  remove(path);
+  return ok;
+}
+
+/// Every raw format holds its header and then exactly the rendered pixels
+static bool test_raw_round_trip(void) {
+  Node *f = test_function(3, MATH_PRECISE);
+  if (f == NULL)
+    return false;
+  Render_Options options = test_options(ENGINE_REG, MATH_PRECISE);
+  const char *path = temp_sprintf("%s/randomart-test-%d.raw", P_tmpdir,
+                                  (int)getpid());
+  bool ok = true;
+  for (size_t i = 0; ok && i < ARRAY_LEN(test_sizes); ++i) {
+    size_t width = test_sizes[i][0], height = test_sizes[i][1];
+    Image image = GenImageColor(width, height, BLANK);
+    ok = render_pixels(image, f, options);
+    const Color *pixels = image.data;
+    for (Raw_Format format = 0; ok && format < COUNT_RAW_FORMATS; ++format) {
+      Raw_Writer raw;
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      String_Builder file = {0};
+      ok = raw_begin(&raw, fd, format, width, height) &&
+           render_raw_strips(&raw, f, TILE_HEIGHT, options) &&
+           raw_end(&raw) && read_entire_file(path, &file);
+
+      // The header tells the size, the rest are the pixels
+      size_t channels = format == RAW_PAM ? 4 : 3;
+      size_t body = width * height * channels;
+      ok = ok && file.count >= body;
+      size_t header = ok ? file.count - body : 0;
+      size_t header_width = width, header_height = height;
+      sb_append_null(&file);
+      if (ok && format == RAW_PPM) {
+        ok = sscanf(file.items, "P6\n%zu %zu\n255\n", &header_width,
+                    &header_height) == 2;
+      } else if (ok && format == RAW_PAM) {
+        ok = sscanf(file.items, "P7\nWIDTH %zu\nHEIGHT %zu\n", &header_width,
+                    &header_height) == 2;
+      }
+      ok = ok && header_width == width && header_height == height;
+      const uint8_t *bytes = (const uint8_t *)file.items + header;
+      for (size_t j = 0; ok && j < width * height; ++j) {
+        const uint8_t *pixel = &bytes[j * channels];
+        ok = pixel[0] == pixels[j].r && pixel[1] == pixels[j].g &&
+             pixel[2] == pixels[j].b && (channels == 3 || pixel[3] == 255);
+      }
+      if (!ok) {
+        nob_log(ERROR, "%s of %zux%zu does not hold the rendered pixels",
+                raw_format_names[format], width, height);
+      }
+      da_free(file);
+    }
+    UnloadImage(image);
+  }
+  remove(path);
+  return ok;
+}
 
+static const Test tests[] = {
+    {"aot-non-finite", test_aot_non_finite},
+    {"square-range", test_square_range},
+    {"interval-sin-tiers", test_interval_sin_tiers},
+    {"fold-sin-tiers", test_fold_sin_tiers},
+    {"engines-match", test_engines_match},
+    {"strips-match", test_strips_match},
+    {"png-round-trip", test_png_round_trip},
+    {"raw-round-trip", test_raw_round_trip},
+};
+
+int main(int argc, char **argv) {
   const char *program_name = shift(argv, argc);
+
+  // Reusing a seed regenerates the same function
+  const char *seed_str = parse_optional_flag(argv, argc, "-seed");
+  unsigned int seed = seed_str ? (unsigned int)strtoul(seed_str, NULL, 10)
+                                : (unsigned int)time(0);
+  nob_log(INFO, "Seed: %u", seed);
+  srand(seed);
   if (argc <= 0) {
     nob_log(ERROR, "Usage: %s <command>\n", program_name);
     nob_log(ERROR, "No command is provided\n");
@@ -693,35 +2401,297 @@ int main(int argc, char **argv) {
   const char *command_name = shift(argv, argc);
   if (strcmp(command_name, "file") == 0) {
     if (argc <= 0) {
-      nob_log(ERROR, "Usage: %s %s <output_path> -depth <depth>", program_name,
-              command_name);
-      nob_log(ERROR, "No output path is provided");
+      nob_log(ERROR,
+              "Usage: %s %s <output_path> -depth <depth> -engine <engine> "
+              "-simd <isa> -math <tier> [-math-report] [-poly] [-ftz] "
+              "[-ftz-report] [-no-interval] [-predict] -max-cost <ms> "
+              "-width <w> -height <h> -strip <rows> -format <format> "
+              "-grammar <path> -max-nodes <n> -seed <seed>",
+              program_name, command_name);
+      nob_log(ERROR, "No output path is provided, - for stdout");
       return 1;
     }
 
     const char *output_path = shift(argv, argc);
 
+    Render_Options options = {
+        .engine = ENGINE_TREE,
+        .simd = SIMD_AUTO,
+        .threads = pool_default_threads(),
+        .math = MATH_PRECISE,
+    };
+    if (!parse_optional_engine(argv, argc, &options.engine))
+      return 1;
+    if (!parse_optional_simd(argv, argc, &options.simd))
+      return 1;
+    if (!parse_optional_threads(argv, argc, &options.threads))
+      return 1;
+    if (!parse_optional_math(argv, argc, &options.math))
+      return 1;
+    Opt_Level opt_level = OPT_SAFE;
+    if (!parse_optional_opt(argv, argc, &opt_level))
+      return 1;
+    options.poly = parse_optional_switch(argv, argc, "-poly");
+    options.ftz = parse_optional_switch(argv, argc, "-ftz");
+    options.no_interval = parse_optional_switch(argv, argc, "-no-interval");
+    size_t width = IMAGE_WIDTH, height = IMAGE_HEIGHT;
+    if (!parse_optional_count(argv, argc, "-width", IMAGE_MAX_SIZE, &width) ||
+        !parse_optional_count(argv, argc, "-height", IMAGE_MAX_SIZE, &height))
+      return 1;
+    // Rows rendered and encoded at a time, PNG only
+    size_t strip = 0;
+    if (!parse_optional_count(argv, argc, "-strip", IMAGE_MAX_SIZE, &strip))
+      return 1;
+    bool math_report = parse_optional_switch(argv, argc, "-math-report");
+    bool ftz_report = parse_optional_switch(argv, argc, "-ftz-report");
+    if (strip > 0 && (math_report || ftz_report)) {
+      nob_log(ERROR, "-math-report and -ftz-report need the whole image, "
+                     "they do not work with -strip");
+      return 1;
+    }
+    // Uncompressed with -format or to stdout, PPM unless -format says else
+    bool to_stdout = strcmp(output_path, "-") == 0;
+    bool raw = to_stdout || parse_optional_flag(argv, argc, "-format");
+    Raw_Format format = RAW_PPM;
+    if (!parse_optional_format(argv, argc, &format))
+      return 1;
+    bool png = !raw && IsFileExtension(output_path, ".png");
+    if (strip > 0 && !png && !raw) {
+      nob_log(ERROR, "-strip only writes PNG and -format files: %s",
+              output_path);
+      return 1;
+    }
+    // The reports compare whole images, every other PNG and raw image is
+    // streamed
+    bool streaming = (png || raw) && !math_report && !ftz_report;
+    if (!streaming && width * height > INT_MAX / sizeof(Color)) {
+      nob_log(ERROR, "%zux%zu does not fit into memory at once, write a PNG "
+                     "without reports",
+              width, height);
+      return 1;
+    }
+    Raw_Writer raw_writer = {.fd = -1};
+    if (raw) {
+      // Before anything is printed, the function goes to stdout too
+      int fd = to_stdout ? raw_stdout()
+                         : open(output_path, O_WRONLY | O_CREAT | O_TRUNC,
+                                0644);
+      if (fd < 0 && !to_stdout) {
+        nob_log(ERROR, "Could not open %s: %s", output_path,
+                strerror(errno));
+      }
+      if (!raw_begin(&raw_writer, fd, format, width, height))
+        return 1;
+    }
+
     // Node *f = gray_gradient_ast();
     // Node* f = cool_gradient_ast();
     Grammar grammar = {0};
-    Alexer_Token entry = simple_grammar(&grammar);
-    Node *f = gen_rule(grammar, entry, parse_optional_depth(argv, argc));
-    if (!f) {
-      nob_log(ERROR, "Process could not terminate\n");
-      exit(69);
+    Alexer_Token entry;
+    const char *grammar_path = parse_optional_flag(argv, argc, "-grammar");
+    if (grammar_path) {
+      if (!load_grammar(grammar_path, &grammar, &entry))
+        return 1;
+    } else {
+      entry = simple_grammar(&grammar);
     }
+    // A budget in milliseconds per image, functions over it are replaced
+    const char *max_cost_str = parse_optional_flag(argv, argc, "-max-cost");
+    double max_cost = max_cost_str ? strtod(max_cost_str, NULL) : 0.0;
+    bool predict = parse_optional_switch(argv, argc, "-predict") ||
+                   max_cost > 0.0;
+    Cost_Table costs;
+    if (predict && !render_calibrate(&costs, options))
+      return 1;
 
-    NODE_PRINT_LN(f);
+    int depth = parse_optional_depth(argv, argc);
+    size_t max_nodes = parse_optional_max_nodes(argv, argc);
+    Node *f = NULL;
+    Cost_Prediction prediction = {0};
+    for (size_t attempt = 1;; ++attempt) {
+      f = gen_rule(grammar, entry, depth, max_nodes);
+      if (!f) {
+        nob_log(ERROR, "Process could not terminate\n");
+        exit(69);
+      }
 
-    Image image = GenImageColor(IMAGE_WIDTH, IMAGE_HEIGHT, BLANK);
-    if (!render_pixels(image, f))
+      NODE_PRINT_LN(f);
+      // Types never change between pixels, so check them once up front
+      if (!typecheck(f) || !expect_type(f, NK_TRIPLE))
+        return 1;
+      f = cse_log(optimize_log(f, opt_level, OPT_TARGET_ENGINES,
+                               math_funcs(options.math)));
+      // Only the tree interpreter knows the fused kinds
+      if (options.engine == ENGINE_TREE)
+        f = fuse_log(f);
+      if (!predict)
+        break;
+
+      prediction = cost_predict(&costs, f, width, height, 1);
+      nob_log(INFO,
+              "Cost: predicted %.2f ns per pixel, %.3f ms for %zux%zu, "
+              "%.2f MiB",
+              prediction.pixel_ns, prediction.seconds * 1e3, width, height,
+              prediction.bytes / (1024.0 * 1024.0));
+      if (max_cost <= 0.0 || prediction.seconds * 1e3 <= max_cost)
+        break;
+      if (attempt == GEN_MAX_COST_ATTEMPTS) {
+        nob_log(ERROR, "None of %d functions fits into -max-cost %.3f ms",
+                GEN_MAX_COST_ATTEMPTS, max_cost);
+        return 1;
+      }
+      nob_log(INFO, "Cost: over -max-cost %.3f ms, generating another one",
+              max_cost);
+    }
+
+    double start = seconds_now();
+    if (streaming) {
+      if (strip == 0)
+        strip = IMAGE_STRIP_ROWS;
+      if (raw ? !render_raw_strips(&raw_writer, f, strip, options) ||
+                    !raw_end(&raw_writer)
+              : !render_png_strips(output_path, f, width, height, strip,
+                                   options))
+        return 1;
+      if (predict) {
+        nob_log(INFO, "Cost: rendered and encoded in %.3f ms, predicted "
+                      "%.3f ms to render",
+                (seconds_now() - start) * 1e3, prediction.seconds * 1e3);
+      }
+      return 0;
+    }
+
+    Image image = GenImageColor(width, height, BLANK);
+    if (!render_pixels(image, f, options))
+      return 1;
+    double seconds = seconds_now() - start;
+    if (predict) {
+      nob_log(INFO, "Cost: rendered in %.3f ms, predicted %.3f ms",
+              seconds * 1e3, prediction.seconds * 1e3);
+    }
+    if (math_report && !render_math_report(image, f, options))
+      return 1;
+    if (ftz_report && !render_ftz_report(image, seconds, f, options))
+      return 1;
+    if (raw) {
+      if (!raw_write_rows(&raw_writer, image.data, height) ||
+          !raw_end(&raw_writer))
+        return 1;
+    } else if (png ? !export_png(image, output_path, options.threads)
+                   : !ExportImage(image, output_path)) {
+      return 1;
+    }
+
+    return 0;
+  }
+
+  if (strcmp(command_name, "shapes") == 0) {
+    const char *count_str = parse_optional_flag(argv, argc, "-count");
+    size_t count = count_str ? strtoul(count_str, NULL, 10) : SHAPES_COUNT;
+    const char *top_str = parse_optional_flag(argv, argc, "-top");
+    size_t top = top_str ? strtoul(top_str, NULL, 10) : SHAPES_TOP;
+    int depth = parse_optional_depth(argv, argc);
+    size_t max_nodes = parse_optional_max_nodes(argv, argc);
+    Render_Options options = {
+        .engine = ENGINE_TREE,
+        .simd = SIMD_AUTO,
+        .threads = pool_default_threads(),
+        .math = MATH_PRECISE,
+    };
+    if (!parse_optional_threads(argv, argc, &options.threads))
+      return 1;
+    Opt_Level opt_level = OPT_SAFE;
+    if (!parse_optional_opt(argv, argc, &opt_level))
       return 1;
-    if (!ExportImage(image, output_path))
+
+    Grammar grammar = {0};
+    Alexer_Token entry;
+    const char *grammar_path = parse_optional_flag(argv, argc, "-grammar");
+    if (grammar_path) {
+      if (!load_grammar(grammar_path, &grammar, &entry))
+        return 1;
+    } else {
+      entry = simple_grammar(&grammar);
+    }
+
+    // One function per seed from `seed` on, every one rendered by the tree
+    // interpreter without and with fusion
+    Fuse_Shapes shapes = {0};
+    size_t functions = 0, fused = 0;
+    size_t dispatches_before = 0, dispatches_after = 0;
+    double seconds_before = 0.0, seconds_after = 0.0;
+    Image image = GenImageColor(IMAGE_WIDTH, IMAGE_HEIGHT, BLANK);
+    nob_minimal_log_level = WARNING;
+    for (size_t i = 0; i < count; ++i) {
+      srand(seed + i);
+      Node *f = gen_rule(grammar, entry, depth, max_nodes);
+      if (!f || !typecheck(f) || !expect_type(f, NK_TRIPLE))
+        continue;
+      Opt_Stats opt_stats;
+      Cse_Stats cse_stats;
+      f = cse(optimize(f, opt_level, OPT_TARGET_ENGINES,
+                       math_funcs(options.math), &opt_stats),
+              &cse_stats);
+      fuse_mine_shapes(f, &shapes);
+      Fuse_Stats fuse_stats;
+      Node *fused_f = fuse(f, &fuse_stats);
+
+      double start = seconds_now();
+      if (!render_pixels(image, f, options))
+        return 1;
+      double middle = seconds_now();
+      if (!render_pixels(image, fused_f, options))
+        return 1;
+      seconds_before += middle - start;
+      seconds_after += seconds_now() - middle;
+
+      functions += 1;
+      fused += fuse_stats.fused;
+      dispatches_before += fuse_stats.dispatches_before;
+      dispatches_after += fuse_stats.dispatches_after;
+    }
+    nob_minimal_log_level = INFO;
+    if (functions == 0) {
+      nob_log(ERROR, "None of the %zu functions could be generated", count);
       return 1;
+    }
 
+    qsort(shapes.items, shapes.count, sizeof(*shapes.items),
+          compare_shapes_by_count);
+    nob_log(INFO, "Shapes of %zu functions from seed %u, most frequent first:",
+            functions, seed);
+    for (size_t i = 0; i < shapes.count && i < top; ++i) {
+      nob_log(INFO, "  %8zu  %-40s %s", shapes.items[i].count,
+              shapes.items[i].text,
+              shapes.items[i].fused ? "fused" : "candidate");
+    }
+    nob_log(INFO, "Fusion: %zu pairs fused, %zu -> %zu dispatches per pixel "
+                  "(%.1f%% fewer)",
+            fused, dispatches_before, dispatches_after,
+            100.0 * (dispatches_before - dispatches_after) /
+                dispatches_before);
+    nob_log(INFO, "Tree engine: %.3fs -> %.3fs (%.2fx)", seconds_before,
+            seconds_after, seconds_before / seconds_after);
     return 0;
   }
 
+  if (strcmp(command_name, "test") == 0) {
+    size_t failed = 0;
+    // Only what went wrong, not what every render logs
+    SetTraceLogLevel(LOG_WARNING);
+    for (size_t i = 0; i < ARRAY_LEN(tests); ++i) {
+      nob_minimal_log_level = WARNING;
+      bool ok = tests[i].run();
+      nob_minimal_log_level = INFO;
+      nob_log(ok ? INFO : ERROR, "%s %s", ok ? "PASS" : "FAIL",
+              tests[i].name);
+      failed += !ok;
+    }
+    nob_log(failed ? ERROR : INFO, "%zu of %zu tests passed",
+            ARRAY_LEN(tests) - failed, ARRAY_LEN(tests));
+    return failed > 0;
+  }
+
   if (strcmp(command_name, "gui") == 0) {
     if (argc <= 0) {
       nob_log(ERROR, "Usage: %s %s <input>", program_name, command_name);
@@ -729,32 +2699,28 @@ int main(int argc, char **argv) {
       return 1;
     }
     const char *input_path = shift(argv, argc);
-
-    String_Builder source = {0};
-    if (!read_entire_file(input_path, &source))
+    Opt_Level opt_level = OPT_SAFE;
+    if (!parse_optional_opt(argv, argc, &opt_level))
       return 1;
 
-    Alexer l = alexer_create(input_path, source.items, source.count);
-    l.puncts = puncts;
-    l.puncts_count = COUNT_PUNCTS;
-    l.sl_comments = comments;
-    l.sl_comments_count = ARRAY_LEN(comments);
-
     Grammar grammar = {0};
-    if (!parse_grammar(&l, &grammar))
+    Alexer_Token entry;
+    if (!load_grammar(input_path, &grammar, &entry))
       return 1;
     // grammar_print(grammar);
-    assert(grammar.count > 0);
 
-    // Alexer_Token entry = simple_grammar(&grammar);
-    Alexer_Token entry = grammar.items[0].name;
-
-    Node *f = gen_rule(grammar, entry, parse_optional_depth(argv, argc));
+    Node *f = gen_rule(grammar, entry, parse_optional_depth(argv, argc),
+                       parse_optional_max_nodes(argv, argc));
     if (!f) {
       nob_log(ERROR, "Process could not terminate\n");
       exit(69);
     }
     // NODE_PRINT_LN(f);
+    if (!typecheck(f) || !expect_type(f, NK_TRIPLE))
+      return 1;
+    // The shader evaluates sin on the GPU, closest to the precise tier
+    f = cse_log(optimize_log(f, opt_level, OPT_TARGET_GLSL,
+                             math_funcs(MATH_PRECISE)));
 
     String_Builder sb = {0};
     if (!compile_node_func_into_fragment_shader(&sb, f))
@@ -0,0 +1,47 @@
+#include "mathlib.h"
+
+#include <assert.h>
+
+#define MATH_STRINGIFY_(...) #__VA_ARGS__
+#define MATH_STRINGIFY(...) MATH_STRINGIFY_(__VA_ARGS__)
+
+const char *math_tier_names[COUNT_MATH_TIERS] = {
+    [MATH_PRECISE] = "precise",
+    [MATH_FAST] = "fast",
+    [MATH_ROUGH] = "rough",
+};
+
+static float math_sin_precise(float x) { return sin(x); }
+
+static const Math_Funcs math_tiers[COUNT_MATH_TIERS] = {
+    [MATH_PRECISE] =
+        {
+            .tier = MATH_PRECISE,
+            .sin = math_sin_precise,
+            .sin_format = "sin(%s)",
+            .source = MATH_STRINGIFY(MATH_SOURCE_MOD),
+        },
+    [MATH_FAST] =
+        {
+            .tier = MATH_FAST,
+            .sin = math_sin_fast,
+            .sin_format = "math_sin_fast(%s)",
+            .source = MATH_STRINGIFY(MATH_SOURCE_MOD MATH_SOURCE_SIN_FAST),
+            // Measured below 1e-7, with a margin
+            .sin_error = 1e-6f,
+        },
+    [MATH_ROUGH] =
+        {
+            .tier = MATH_ROUGH,
+            .sin = math_sin_rough,
+            .sin_format = "math_sin_rough(%s)",
+            .source = MATH_STRINGIFY(MATH_SOURCE_MOD MATH_SOURCE_SIN_ROUGH),
+            // Measured below 1.7e-4, with a margin
+            .sin_error = 5e-4f,
+        },
+};
+
+const Math_Funcs *math_funcs(Math_Tier tier) {
+  assert(tier < COUNT_MATH_TIERS);
+  return &math_tiers[tier];
+}
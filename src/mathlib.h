@@ -0,0 +1,142 @@
+#pragma once
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Math layer: the functions every engine calls for sin and mod. An 8-bit
+// channel only resolves 1/255 of the -1..1 range, so sin comes in accuracy
+// tiers selected per render:
+// - precise: libm in double, what the engines always computed
+// - fast: Cephes polynomial over a quarter period, within ~1e-7
+// - rough: degree 5 polynomial over a half period, within ~1e-4
+// Past the reduction limit the approximations fall back to libm. The mod is
+// exact in every tier, it only avoids the slow libm fmodf.
+//
+// The definitions are kept as source macros, so the AOT backend pastes the
+// very same code into its kernels.
+typedef enum {
+  MATH_PRECISE,
+  MATH_FAST,
+  MATH_ROUGH,
+  COUNT_MATH_TIERS,
+} Math_Tier;
+
+#define MATH_SIN_REDUCTION_LIMIT 8192.0f
+
+// fmodf(a, b) = a - trunc(a/b)*b, the product of two floats with a quotient
+// below 2^24 and the difference are exact in double. Zero keeps the sign of
+// a. Infinities, NaN, zero divisors and large quotients go to libm.
+#define MATH_SOURCE_MOD                                                        \
+  static inline float math_mod(float a, float b) {                             \
+    double q = trunc((double)a / (double)b);                                   \
+    double r = (double)a - q * (double)b;                                      \
+    if (!(fabs(q) < 16777216.0) || r != r)                                     \
+      return fmodf(a, b);                                                      \
+    return copysignf((float)r, a);                                             \
+  }
+
+// sin(x) = ±sin(r) or ±cos(r) with x = j*pi/2 + r and |r| <= pi/4, pi/2 is
+// split in three parts so the first two products are exact
+#define MATH_SOURCE_SIN_FAST                                                   \
+  static inline float math_sin_fast(float x) {                                 \
+    if (!(fabsf(x) <= MATH_SIN_REDUCTION_LIMIT))                               \
+      return (float)sin(x);                                                    \
+    float j = rintf(x * 0.63661977236758134f);                                 \
+    float r = x - j * 1.5703125f;                                              \
+    r = r - j * 4.837512969970703125e-4f;                                      \
+    r = r - j * 7.54978995489188216e-8f;                                       \
+    float r2 = r * r;                                                          \
+    float s = r2 * -1.9515295891e-4f + 8.3321608736e-3f;                       \
+    s = s * r2 + -1.6666654611e-1f;                                            \
+    s = s * r2 * r + r;                                                        \
+    float c = r2 * 2.443315711809948e-5f + -1.388731625493765e-3f;            \
+    c = c * r2 + 4.166664568298827e-2f;                                        \
+    c = c * r2 * r2 + (1.0f - 0.5f * r2);                                      \
+    int q = (int)j;                                                            \
+    float result = q & 1 ? c : s;                                              \
+    return q & 2 ? -result : result;                                           \
+  }
+
+// sin(x) = ±sin(r) with x = j*pi + r and |r| <= pi/2
+#define MATH_SOURCE_SIN_ROUGH                                                  \
+  static inline float math_sin_rough(float x) {                                \
+    if (!(fabsf(x) <= MATH_SIN_REDUCTION_LIMIT))                               \
+      return (float)sin(x);                                                    \
+    float j = rintf(x * 0.31830988618379067f);                                 \
+    float r = x - j * 3.140625f;                                               \
+    r = r - j * 9.676535897931e-4f;                                            \
+    float r2 = r * r;                                                          \
+    float s = r2 * 7.61e-3f + -1.6605e-1f;                                     \
+    s = s * r2 * r + r;                                                        \
+    return (int)j & 1 ? -s : s;                                                \
+  }
+
+MATH_SOURCE_MOD
+MATH_SOURCE_SIN_FAST
+MATH_SOURCE_SIN_ROUGH
+
+typedef struct {
+  Math_Tier tier;
+  float (*sin)(float);
+  // For generated C: the expression of sin with a `%s` operand, and the
+  // definitions it needs
+  const char *sin_format;
+  const char *source;
+  // Most sin is off from the precise tier, which widens the interval bounds
+  // (interval.h) of every sin
+  float sin_error;
+} Math_Funcs;
+
+extern const char *math_tier_names[COUNT_MATH_TIERS];
+
+const Math_Funcs *math_funcs(Math_Tier tier);
+
+// Floating point environment of the SSE unit every engine computes in
+// (MXCSR). Products of values in -1..1 shrink towards zero quickly, and
+// every subnormal operand or result takes a slow microcode assist.
+// Flush-to-zero writes zero instead of a subnormal result and
+// denormals-are-zero reads a subnormal operand as zero. Only x86 has them,
+// elsewhere the functions do nothing.
+#if defined(__x86_64__) || defined(__i386__)
+#include <xmmintrin.h>
+
+#define MATH_MXCSR_DAZ 0x0040
+#define MATH_MXCSR_FTZ 0x8000
+// Sticky flags: a subnormal operand was read, a tiny result was rounded
+#define MATH_MXCSR_DENORMAL 0x0002
+#define MATH_MXCSR_UNDERFLOW 0x0010
+
+typedef unsigned int Math_Fp_Env;
+
+static inline bool math_ftz_supported(void) { return true; }
+
+// Returns the environment to restore with math_fp_leave()
+static inline Math_Fp_Env math_fp_enter(bool ftz) {
+  Math_Fp_Env env = _mm_getcsr();
+  Math_Fp_Env modes = MATH_MXCSR_DAZ | MATH_MXCSR_FTZ;
+  _mm_setcsr((env & ~modes) | (ftz ? modes : 0));
+  return env;
+}
+
+static inline void math_fp_leave(Math_Fp_Env env) { _mm_setcsr(env); }
+
+// Whether a subnormal was read or produced since the last call
+static inline bool math_fp_take_subnormal(void) {
+  Math_Fp_Env env = _mm_getcsr();
+  Math_Fp_Env flags = MATH_MXCSR_DENORMAL | MATH_MXCSR_UNDERFLOW;
+  if (!(env & flags))
+    return false;
+  _mm_setcsr(env & ~flags);
+  return true;
+}
+#else
+typedef unsigned int Math_Fp_Env;
+
+static inline bool math_ftz_supported(void) { return false; }
+static inline Math_Fp_Env math_fp_enter(bool ftz) {
+  (void)ftz;
+  return 0;
+}
+static inline void math_fp_leave(Math_Fp_Env env) { (void)env; }
+static inline bool math_fp_take_subnormal(void) { return false; }
+#endif
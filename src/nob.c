@@ -29,7 +29,7 @@
 #define builder_cc(cmd) cmd_append(cmd, "cc")
 #define builder_output(cmd, output_path) cmd_append(cmd, "-o", output_path)
 #define builder_inputs(cmd, ...) cmd_append(cmd, __VA_ARGS__)
-#define builder_libs(cmd) cmd_append(cmd, "-lm")
+#define builder_libs(cmd) cmd_append(cmd, "-lm", "-ldl", "-lpthread")
 #define builder_flags(cmd)                                                     \
   cmd_append(cmd, "-Wall", "-Wextra", "-Wswitch-enum", "-ggdb")
 #define builder_include_path(cmd, include_path)                                \
@@ -48,6 +48,12 @@ void cmd_append_optional_depth(Nob_Cmd *cmd, char **argv, int argc_) {
   }
 }
 
+void cmd_append_remaining_args(Nob_Cmd *cmd, char **argv, int argc_) {
+  for (int i = 0; i < argc_; ++i) {
+    cmd_append(cmd, argv[i]);
+  }
+}
+
 void cmd_append_optional_grammar_path(Nob_Cmd *cmd, char **argv, int argc_) {
   const char *grammar_path = "./grammars/grammar.bnf";
 
@@ -71,7 +77,10 @@ int main(int argc, char *argv[]) {
 
   builder_cc(&cmd);
   builder_output(&cmd, "main");
-  builder_inputs(&cmd, "main.c", "node.c");
+  builder_inputs(&cmd, "main.c", "node.c", "vm.c", "span.c", "simd.c",
+                 "jit.c", "aot.c", "pool.c", "cse.c", "opt.c", "hoist.c",
+                 "interval.c", "mathlib.c", "fuse.c", "poly.c", "cost.c",
+                 "png.c", "raw.c");
   builder_libs(&cmd);
   builder_flags(&cmd);
   builder_raylib_include_path(&cmd);
@@ -88,13 +97,22 @@ int main(int argc, char *argv[]) {
 
     if (strcmp(subcommand, "run") == 0) {
       cmd_append(&cmd, "./main", "file", "output/random_image.png");
-      cmd_append_optional_depth(&cmd, argv, argc);
+      cmd_append_remaining_args(&cmd, argv, argc);
       if (!cmd_run_sync_and_reset(&cmd))
         return 1;
 
       cmd_append(&cmd, "kitty", "icat", "output/random_image.png");
       if (!cmd_run_sync_and_reset(&cmd))
         return 1;
+    } else if (strcmp(subcommand, "shapes") == 0) {
+      cmd_append(&cmd, "./main", "shapes");
+      cmd_append_remaining_args(&cmd, argv, argc);
+      if (!cmd_run_sync_and_reset(&cmd))
+        return 1;
+    } else if (strcmp(subcommand, "test") == 0) {
+      cmd_append(&cmd, "./main", "test");
+      if (!cmd_run_sync_and_reset(&cmd))
+        return 1;
     } else if (strcmp(subcommand, "gui") == 0) {
       cmd_append(&cmd, "./main", "gui");
       cmd_append_optional_grammar_path(&cmd, argv, argc);
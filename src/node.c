@@ -1,5 +1,10 @@
 #include "node.h"
 
+#include <assert.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
 // Node Kind Allocator
 Node *node_number_loc(const char *file, int line, float number) {
   Node *node = node_loc(file, line, NK_NUMBER);
@@ -89,112 +94,410 @@ bool expect_kind(Node *expr, Node_Kind kind) {
   return true;
 }
 
-// Macro Mapper for binary operations
-#define BINOP_MAPPER(kind, lhs, rhs)                                           \
-  ((kind) == NK_ADD    ? ((lhs) + (rhs))                                       \
-   : (kind) == NK_MULT ? ((lhs) * (rhs))                                       \
-   : (kind) == NK_MOD  ? fmodf((lhs), (rhs))                                   \
-   : (kind) == NK_GT   ? ((lhs) > (rhs))                                       \
-                       : 0)
-/// Evaluate Binary Operations
-Node *eval_binop(Node *expr, float x, float y, float t, Node_Kind kind) {
-  Node *lhs = eval(expr->as.binop.lhs, x, y, t);
-  if (!lhs || !expect_kind(lhs, kind))
-    return NULL;
+bool expect_type(Node *expr, Node_Kind type) {
+  if (expr->type != type) {
+    printf("%s:%d: ERROR: expected '%s' but got '%s'\n", expr->file, expr->line,
+           node_kind_string(type), node_kind_string(expr->type));
+    return false;
+  }
+  return true;
+}
 
-  Node *rhs = eval(expr->as.binop.rhs, x, y, t);
-  if (!rhs || !expect_kind(rhs, kind))
-    return NULL;
+/// Type the `i`-th operand of `node` must have
+static Node_Kind typecheck_operand(Node *node, size_t i) {
+  if (node->kind == NK_IF)
+    return i == 0 ? NK_BOOLEAN : NK_TRIPLE;
+  return NK_NUMBER;
+}
 
+/// Type of `node` once its operands are checked
+static Node_Kind typecheck_result(Node *node) {
+  switch (node->kind) {
+  case NK_X:
+  case NK_Y:
+  case NK_T:
+  case NK_NUMBER:
+  case NK_SQRT:
+  case NK_ABS:
+  case NK_SIN:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  case NK_ADD:
+  case NK_MULT:
+  case NK_MOD:
+  case NK_MULT_ADD:
+    return NK_NUMBER;
+
+  case NK_BOOLEAN:
+  case NK_GT:
+    return NK_BOOLEAN;
+
+  case NK_TRIPLE:
+  case NK_IF:
+    return NK_TRIPLE;
+
+  case NK_RULE:
+  case NK_RANDOM:
+  default:
+    UNREACHABLE_CODE("typecheck_result");
+  }
+}
+
+/// Infer and validate the type of every node in the tree once, so the
+/// evaluators can run without checking kinds per pixel
+bool typecheck(Node *expr) {
+  Node_Frames frames = {0};
+  bool ok = true;
+  node_frames_push(&frames, expr);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *node = frame->node;
+    if (node->kind == NK_RULE || node->kind == NK_RANDOM) {
+      printf("%s:%d: ERROR: cannot evaluate a node that is only valid for "
+             "grammar definitions\n",
+             node->file, node->line);
+      ok = false;
+      break;
+    }
+
+    // The operand done last is checked before the next one is visited
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    if (frame->next > 0 &&
+        !expect_type(children[frame->next - 1],
+                     typecheck_operand(node, frame->next - 1))) {
+      ok = false;
+      break;
+    }
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    node->type = typecheck_result(node);
+    frames.count -= 1;
+  }
+  free(frames.items);
+  return ok;
+}
+
+/// Evaluate Binary Operations
+Value eval_binop(Node *expr, float lhs, float rhs) {
   if (expr->kind == NK_GT) {
-    return node_boolean_loc(
-        expr->file, expr->line,
-        BINOP_MAPPER(expr->kind, lhs->as.number, rhs->as.number));
+    return (Value){.kind = NK_BOOLEAN,
+                   .as.boolean = BINOP_MAPPER(expr->kind, lhs, rhs)};
   }
 
-  return node_number_loc(
-      expr->file, expr->line,
-      BINOP_MAPPER(expr->kind, lhs->as.number, rhs->as.number));
+  return (Value){.kind = NK_NUMBER,
+                 .as.number = BINOP_MAPPER(expr->kind, lhs, rhs)};
 }
 
-#define UNOP_MAPPER(kind, val)                                                 \
-  ((kind) == NK_SQRT  ? (sqrtf(val))                                           \
-   : (kind) == NK_ABS ? (fabsf(val))                                           \
-   : (kind) == NK_SIN ? (sin(val))                                             \
-                      : 0)
-Node *eval_unop(Node *expr, float x, float y, float t, Node_Kind kind) {
-  Node *value = eval(expr->as.unop, x, y, t);
-  if (!value || !expect_kind(value, kind))
-    return NULL;
+Value eval_unop(Node *expr, const Eval_Memo *memo, float value) {
+  if (expr->kind == NK_SIN)
+    return (Value){.kind = NK_NUMBER, .as.number = memo->math->sin(value)};
+  if (expr->kind == NK_SIN_ABS)
+    return (Value){.kind = NK_NUMBER,
+                   .as.number = memo->math->sin(fabsf(value))};
+  return (Value){.kind = NK_NUMBER,
+                 .as.number = UNOP_MAPPER(expr->kind, value)};
+}
 
-  return node_number_loc(expr->file, expr->line,
-                         UNOP_MAPPER(expr->kind, value->as.number));
+/// Slots are numbered from 1, so `slot_count` is the highest slot
+void eval_memo_init(Eval_Memo *memo, size_t slot_count,
+                    const Math_Funcs *math) {
+  memo->count = slot_count + 1;
+  memo->math = math;
+  memo->values = malloc(memo->count * sizeof(*memo->values));
+  memo->stamps = calloc(memo->count, sizeof(*memo->stamps));
+  memo->inputs = calloc(memo->count, sizeof(*memo->inputs));
+  assert(memo->values != NULL && memo->stamps != NULL &&
+         memo->inputs != NULL && "Buy more RAM lol");
+  memo->stamp = 0;
+  memo->frames = NULL;
+  memo->stack = NULL;
+  memo->frames_capacity = 0;
 }
 
-void node_print(Node *node) {
+/// Double the room of the explicit stacks of eval()
+void eval_memo_grow(Eval_Memo *memo) {
+  memo->frames_capacity =
+      memo->frames_capacity ? memo->frames_capacity * 2 : 64;
+  memo->frames = realloc(memo->frames,
+                         memo->frames_capacity * sizeof(*memo->frames));
+  memo->stack = realloc(memo->stack, EVAL_STACK_PER_FRAME *
+                                         memo->frames_capacity *
+                                         sizeof(*memo->stack));
+  assert(memo->frames != NULL && memo->stack != NULL && "Buy more RAM lol");
+}
+
+/// Forget the values of the previous pixel
+void eval_memo_next(Eval_Memo *memo) {
+  memo->stamp += 1;
+  if (memo->stamp == 0) {
+    memset(memo->stamps, 0, memo->count * sizeof(*memo->stamps));
+    memo->stamp = 1;
+  }
+}
+
+void eval_memo_free(Eval_Memo *memo) {
+  free(memo->values);
+  free(memo->stamps);
+  free(memo->inputs);
+  free(memo->frames);
+  free(memo->stack);
+  memset(memo, 0, sizeof(*memo));
+}
+
+/// Collect pointers to the operand fields of a node in evaluation order, so
+/// passes can replace operands in place
+size_t node_child_refs(Node *node, Node **refs[3]) {
   switch (node->kind) {
   case NK_X:
   case NK_Y:
   case NK_T:
-    printf(node_kind_string(node->kind));
-    break;
-
   case NK_NUMBER:
-    printf("%f", node->as.number);
-    break;
-
   case NK_BOOLEAN:
-    printf("%s", node->as.boolean ? "true" : "false");
-    break;
+  case NK_RULE:
+  case NK_RANDOM:
+    return 0;
 
   case NK_SQRT:
   case NK_ABS:
   case NK_SIN:
-    printf("%s(", node_kind_string(node->kind));
-    node_print(node->as.unop);
-    printf(")");
-    break;
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+    refs[0] = &node->as.unop;
+    return 1;
 
   case NK_ADD:
   case NK_MULT:
   case NK_MOD:
   case NK_GT:
-    printf("%s(", node_kind_string(node->kind));
-    node_print(node->as.binop.lhs);
-    printf(", ");
-    node_print(node->as.binop.rhs);
-    printf(")");
-    break;
+    refs[0] = &node->as.binop.lhs;
+    refs[1] = &node->as.binop.rhs;
+    return 2;
+
+  case NK_MULT_ADD:
+    refs[0] = &node->as.mult_add.lhs;
+    refs[1] = &node->as.mult_add.rhs;
+    refs[2] = &node->as.mult_add.addend;
+    return 3;
 
   case NK_TRIPLE:
-    printf("(");
-    node_print(node->as.triple.first);
-    printf(", ");
-    node_print(node->as.triple.second);
-    printf(", ");
-    node_print(node->as.triple.third);
-    printf(")");
-    break;
+    refs[0] = &node->as.triple.first;
+    refs[1] = &node->as.triple.second;
+    refs[2] = &node->as.triple.third;
+    return 3;
 
   case NK_IF:
-    printf("if ");
-    node_print(node->as.iff.cond);
-    printf(" then ");
-    node_print(node->as.iff.then);
-    printf(" else ");
-    node_print(node->as.iff.elze);
-    break;
-
-  case NK_RULE:
-    printf("%s(" Alexer_Token_Fmt ")", node_kind_string(node->kind),
-           Alexer_Token_Arg(node->as.rule));
-    break;
-  case NK_RANDOM:
-    printf("%s", node_kind_string(node->kind));
-    break;
+    refs[0] = &node->as.iff.cond;
+    refs[1] = &node->as.iff.then;
+    refs[2] = &node->as.iff.elze;
+    return 3;
 
   default:
-    UNREACHABLE_CODE("node_print");
-    return;
+    UNREACHABLE_CODE("node_child_refs");
+  }
+}
+
+/// Collect the direct operands of a node in evaluation order
+size_t node_children(Node *node, Node *children[3]) {
+  Node **refs[3];
+  size_t children_count = node_child_refs(node, refs);
+  for (size_t i = 0; i < children_count; ++i)
+    children[i] = *refs[i];
+  return children_count;
+}
+
+// FNV-1a
+#define NODE_HASH_OFFSET 0xcbf29ce484222325ULL
+#define NODE_HASH_PRIME 0x100000001b3ULL
+static uint64_t node_hash_mix(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= NODE_HASH_PRIME;
+  }
+  return hash;
+}
+
+typedef struct {
+  uint64_t *items;
+  size_t count;
+  size_t capacity;
+} Node_Hashes;
+
+/// Structural hash of a tree: structurally equal trees hash equally no
+/// matter where their nodes were allocated
+uint64_t node_hash(Node *node) {
+  Node_Frames frames = {0};
+  // Hashes of the operands done, in order, waiting for their parent
+  Node_Hashes hashes = {0};
+  node_frames_push(&frames, node);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    node = frame->node;
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+
+    uint64_t hash = node_hash_mix(NODE_HASH_OFFSET, &node->kind,
+                                  sizeof(node->kind));
+    if (node->kind == NK_NUMBER) {
+      hash = node_hash_mix(hash, &node->as.number, sizeof(node->as.number));
+    } else if (node->kind == NK_BOOLEAN) {
+      hash =
+          node_hash_mix(hash, &node->as.boolean, sizeof(node->as.boolean));
+    } else if (node->kind == NK_RULE) {
+      hash = node_hash_mix(hash, node->as.rule.begin,
+                           node->as.rule.end - node->as.rule.begin);
+    }
+    hashes.count -= children_count;
+    for (size_t i = 0; i < children_count; ++i) {
+      uint64_t child = hashes.items[hashes.count + i];
+      hash = node_hash_mix(hash, &child, sizeof(child));
+    }
+    da_append(&hashes, hash);
+  }
+  uint64_t hash = hashes.items[0];
+  free(frames.items);
+  free(hashes.items);
+  return hash;
+}
+
+typedef struct {
+  Node *a;
+  Node *b;
+} Node_Pair;
+
+typedef struct {
+  Node_Pair *items;
+  size_t count;
+  size_t capacity;
+} Node_Pairs;
+
+/// Whether two trees compute the same thing, shared nodes or not. Constants
+/// compare bitwise, so 0.0 and -0.0 stay apart.
+bool node_equal(Node *a, Node *b) {
+  if (a == b)
+    return true;
+  // Pairs of subtrees still to compare, in any order
+  Node_Pairs pairs = {0};
+  da_append(&pairs, ((Node_Pair){a, b}));
+  bool equal = true;
+  while (equal && pairs.count > 0) {
+    Node_Pair pair = pairs.items[--pairs.count];
+    if (pair.a == pair.b)
+      continue;
+    equal = pair.a->kind == pair.b->kind &&
+            !(pair.a->kind == NK_NUMBER &&
+              memcmp(&pair.a->as.number, &pair.b->as.number,
+                     sizeof(pair.a->as.number)) != 0) &&
+            !(pair.a->kind == NK_BOOLEAN &&
+              pair.a->as.boolean != pair.b->as.boolean);
+
+    Node *a_children[3], *b_children[3];
+    size_t children_count = node_children(pair.a, a_children);
+    node_children(pair.b, b_children);
+    for (size_t i = 0; equal && i < children_count; ++i)
+      da_append(&pairs, ((Node_Pair){a_children[i], b_children[i]}));
+  }
+  free(pairs.items);
+  return equal;
+}
+
+void node_frames_push(Node_Frames *frames, Node *node) {
+  if (frames->count == frames->capacity) {
+    frames->capacity = frames->capacity ? frames->capacity * 2 : 64;
+    frames->items =
+        realloc(frames->items, frames->capacity * sizeof(*frames->items));
+    assert(frames->items != NULL && "Buy more RAM lol");
+  }
+  frames->items[frames->count++] = (Node_Frame){.node = node, .next = 0};
+}
+
+/// What node_print() writes before the `i`-th child of `node`, and after the
+/// last one for i == children count
+static const char *node_print_separator(Node *node, size_t i,
+                                        size_t children_count) {
+  if (node->kind == NK_IF)
+    return i == 1 ? " then " : i == 2 ? " else " : "";
+  return i == children_count ? ")" : ", ";
+}
+
+void node_print(Node *node) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, node);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    node = frame->node;
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+
+    if (frame->next == 0) {
+      switch (node->kind) {
+      case NK_X:
+      case NK_Y:
+      case NK_T:
+        printf(node_kind_string(node->kind));
+        break;
+
+      case NK_NUMBER:
+        printf("%f", node->as.number);
+        break;
+
+      case NK_BOOLEAN:
+        printf("%s", node->as.boolean ? "true" : "false");
+        break;
+
+      case NK_SQRT:
+      case NK_ABS:
+      case NK_SIN:
+      case NK_SQRT_ABS:
+      case NK_SIN_ABS:
+      case NK_SQUARE:
+      case NK_ADD:
+      case NK_MULT:
+      case NK_MOD:
+      case NK_GT:
+      case NK_MULT_ADD:
+        printf("%s(", node_kind_string(node->kind));
+        break;
+
+      case NK_TRIPLE:
+        printf("(");
+        break;
+
+      case NK_IF:
+        printf("if ");
+        break;
+
+      case NK_RULE:
+        printf("%s(" Alexer_Token_Fmt ")", node_kind_string(node->kind),
+               Alexer_Token_Arg(node->as.rule));
+        break;
+      case NK_RANDOM:
+        printf("%s", node_kind_string(node->kind));
+        break;
+
+      default:
+        UNREACHABLE_CODE("node_print");
+        return;
+      }
+    } else {
+      printf("%s", node_print_separator(node, frame->next, children_count));
+    }
+
+    if (frame->next == children_count) {
+      frames.count -= 1;
+      continue;
+    }
+    node_frames_push(&frames, children[frame->next++]);
   }
+  free(frames.items);
 }
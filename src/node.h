@@ -1,6 +1,7 @@
 #pragma once
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +16,8 @@
 #include "lib/alexer.h"
 #include "lib/arena.h"
 
+#include "mathlib.h"
+
 typedef struct Node Node;
 
 typedef enum {
@@ -36,6 +39,13 @@ typedef enum {
   NK_MOD,
   NK_GT,
 
+  // Fused Operations: one dispatch for two operations, rounded exactly like
+  // the pair. Only fuse() introduces them (fuse.h).
+  NK_MULT_ADD, // lhs*rhs + addend
+  NK_SQRT_ABS, // sqrt(|value|)
+  NK_SIN_ABS,  // sin(|value|)
+  NK_SQUARE,   // value*value
+
   // Operation Wrappers
   NK_TRIPLE,
   NK_IF,
@@ -46,23 +56,27 @@ typedef enum {
 } Node_Kind;
 
 #define node_kind_string(kind)                                                 \
-  ((kind) == NK_X         ? "x"                                                \
-   : (kind) == NK_Y       ? "y"                                                \
-   : (kind) == NK_T       ? "t"                                                \
-   : (kind) == NK_NUMBER  ? "number"                                           \
-   : (kind) == NK_BOOLEAN ? "boolean"                                          \
-   : (kind) == NK_SQRT    ? "sqrt"                                             \
-   : (kind) == NK_ABS     ? "abs"                                              \
-   : (kind) == NK_SIN     ? "sin"                                              \
-   : (kind) == NK_ADD     ? "add"                                              \
-   : (kind) == NK_MULT    ? "mult"                                             \
-   : (kind) == NK_MOD     ? "mod"                                              \
-   : (kind) == NK_GT      ? "gt"                                               \
-   : (kind) == NK_TRIPLE  ? "triple"                                           \
-   : (kind) == NK_IF      ? "if"                                               \
-   : (kind) == NK_RULE    ? "rule"                                             \
-   : (kind) == NK_RANDOM  ? "random"                                           \
-                          : "unknown")
+  ((kind) == NK_X          ? "x"                                               \
+   : (kind) == NK_Y        ? "y"                                               \
+   : (kind) == NK_T        ? "t"                                               \
+   : (kind) == NK_NUMBER   ? "number"                                          \
+   : (kind) == NK_BOOLEAN  ? "boolean"                                         \
+   : (kind) == NK_SQRT     ? "sqrt"                                            \
+   : (kind) == NK_ABS      ? "abs"                                             \
+   : (kind) == NK_SIN      ? "sin"                                             \
+   : (kind) == NK_ADD      ? "add"                                             \
+   : (kind) == NK_MULT     ? "mult"                                            \
+   : (kind) == NK_MOD      ? "mod"                                             \
+   : (kind) == NK_GT       ? "gt"                                              \
+   : (kind) == NK_MULT_ADD ? "mult_add"                                        \
+   : (kind) == NK_SQRT_ABS ? "sqrt_abs"                                        \
+   : (kind) == NK_SIN_ABS  ? "sin_abs"                                         \
+   : (kind) == NK_SQUARE   ? "square"                                          \
+   : (kind) == NK_TRIPLE   ? "triple"                                          \
+   : (kind) == NK_IF       ? "if"                                              \
+   : (kind) == NK_RULE     ? "rule"                                            \
+   : (kind) == NK_RANDOM   ? "random"                                          \
+                           : "unknown")
 
 #define node_kind_operation(kind)                                              \
   ((kind) == NK_ADD    ? "+"                                                   \
@@ -76,6 +90,12 @@ typedef struct {
   Node *rhs;
 } Node_Binop;
 
+typedef struct {
+  Node *lhs;
+  Node *rhs;
+  Node *addend;
+} Node_Mult_Add;
+
 typedef struct {
   Node *first;
   Node *second;
@@ -94,6 +114,7 @@ typedef union {
 
   Node *unop;
   Node_Binop binop;
+  Node_Mult_Add mult_add;
   Node_Triple triple;
   Node_If iff;
 
@@ -102,16 +123,83 @@ typedef union {
 
 struct Node {
   Node_Kind kind;
+  // Kind of the value this node evaluates to (NK_NUMBER, NK_BOOLEAN or
+  // NK_TRIPLE). Only valid after typecheck() accepted the tree.
+  Node_Kind type;
+  // Index of the value of a number or boolean shared by several parents of
+  // the DAG built by cse(), 0 if the node is not shared
+  size_t slot;
+  // Variables the subtree reads (NODE_DEP_*), and whether the renderer
+  // provides its value through the slot instead (hoist.h)
+  uint8_t deps;
+  bool hoisted;
   const char *file;
   int line;
   Node_As as;
 };
 
+// Result of evaluating a Node for a single pixel. Only NK_NUMBER, NK_BOOLEAN
+// and NK_TRIPLE are valid kinds, and a triple always holds three numbers.
+typedef union {
+  float number;
+  bool boolean;
+  Vector3 triple;
+} Value_As;
+
+typedef struct {
+  Node_Kind kind;
+  Value_As as;
+} Value;
+
+// A node of a depth-first walk with an explicit stack, `next` of its
+// children are done. The walks of arbitrarily deep trees use these instead
+// of recursion, which would run out of call stack.
+typedef struct {
+  Node *node;
+  size_t next;
+} Node_Frame;
+
+typedef struct {
+  Node_Frame *items;
+  size_t count;
+  size_t capacity;
+} Node_Frames;
+
+void node_frames_push(Node_Frames *frames, Node *node);
+
+// Values of the shared nodes (Node.slot) of the pixel being evaluated. A
+// value is only valid while its stamp matches `stamp`, so moving on to the
+// next pixel is a single increment. Hoisted nodes are read from `inputs`
+// instead, which the caller keeps up to date. sin comes from `math`.
+// eval() keeps its explicit stacks here too, they only grow with the depth
+// of the deepest tree evaluated so far.
+typedef struct {
+  Value *values;
+  uint32_t *stamps;
+  uint32_t stamp;
+  float *inputs;
+  size_t count;
+  const Math_Funcs *math;
+  Node_Frame *frames; // operands done wait on `stack`
+  Value *stack; // EVAL_STACK_PER_FRAME values per frame
+  size_t frames_capacity;
+} Eval_Memo;
+
+// Every frame has at most two operands done when it pushes the next one
+#define EVAL_STACK_PER_FRAME 3
+
 // MAIN FUNCTIONS
-Node *eval(Node *expr, float x, float y, float t);
-Node *eval_binop(Node *expr, float x, float y, float t, Node_Kind kind);
-Node *eval_unop(Node *expr, float x, float y, float t, Node_Kind kind);
-bool render_pixels(Image image, Node *f);
+// The evaluators do not check kinds, the tree must pass typecheck() first
+bool typecheck(Node *expr);
+Value eval(Node *expr, Eval_Memo *memo, float x, float y, float t);
+// The operation of `expr` on operands that are already evaluated
+Value eval_binop(Node *expr, float lhs, float rhs);
+Value eval_unop(Node *expr, const Eval_Memo *memo, float value);
+void eval_memo_grow(Eval_Memo *memo);
+void eval_memo_init(Eval_Memo *memo, size_t slot_count,
+                    const Math_Funcs *math);
+void eval_memo_next(Eval_Memo *memo);
+void eval_memo_free(Eval_Memo *memo);
 
 // GRADIENTS
 Node *gray_gradient_ast();
@@ -119,7 +207,12 @@ Node *cool_gradient_ast();
 
 // UTILS FUNCTIONS
 void node_print(Node *node);
+size_t node_children(Node *node, Node *children[3]);
+size_t node_child_refs(Node *node, Node **refs[3]);
+uint64_t node_hash(Node *node);
+bool node_equal(Node *a, Node *b);
 bool expect_kind(Node *expr, Node_Kind kind);
+bool expect_type(Node *expr, Node_Kind type);
 
 #define SYMBOL(name_cstr) symbol_impl(__FILE__, __LINE__, name_cstr)
 Alexer_Token symbol_impl(const char *file, int line, const char *name_cstr);
@@ -147,6 +240,25 @@ Node *node_triple_loc(const char *file, int line, Node *first, Node *second,
 Node *node_if_loc(const char *file, int line, Node *cond, Node *then,
                   Node *elze);
 
+// OPERATION MACROS
+// Macro Mapper for binary operations
+#define BINOP_MAPPER(kind, lhs, rhs)                                           \
+  ((kind) == NK_ADD    ? ((lhs) + (rhs))                                       \
+   : (kind) == NK_MULT ? ((lhs) * (rhs))                                       \
+   : (kind) == NK_MOD  ? math_mod((lhs), (rhs))                                \
+   : (kind) == NK_GT   ? ((lhs) > (rhs))                                       \
+                       : 0)
+
+// Macro Mapper for unary operations
+#define UNOP_MAPPER(kind, val)                                                 \
+  ((kind) == NK_SQRT       ? (sqrtf(val))                                      \
+   : (kind) == NK_ABS      ? (fabsf(val))                                      \
+   : (kind) == NK_SIN      ? (sin(val))                                        \
+   : (kind) == NK_SQRT_ABS ? (sqrtf(fabsf(val)))                               \
+   : (kind) == NK_SIN_ABS  ? (sin(fabsf(val)))                                 \
+   : (kind) == NK_SQUARE   ? ((val) * (val))                                   \
+                           : 0)
+
 // UTIL MACROS
 #define NODE_PRINT_LN(node) (node_print(node), printf("\n"))
 #define UNREACHABLE_CODE(message)                                              \
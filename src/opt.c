@@ -0,0 +1,682 @@
+#include "opt.h"
+#include "interval.h"
+
+#include <assert.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+const char *opt_level_names[COUNT_OPT_LEVELS] = {
+    [OPT_NONE] = "none",
+    [OPT_SAFE] = "safe",
+    [OPT_UNSAFE] = "unsafe",
+};
+
+// Bounds of a node over the whole image, found by its address. Nodes never
+// change once built, the optimizer copies them on write.
+typedef struct {
+  Node *node;
+  Interval_Value value;
+} Opt_Range;
+
+typedef struct {
+  Opt_Range *items;
+  size_t count;
+  size_t capacity;
+} Opt_Ranges;
+
+typedef struct {
+  Opt_Level level;
+  Opt_Target target;
+  const Math_Funcs *math; // sin of the engines, to fold and bound with
+  Opt_Stats *stats;
+  Opt_Ranges ranges;
+  Node_Frames frames; // of opt_range()
+  struct {
+    Interval_Value *items;
+    size_t count;
+    size_t capacity;
+  } values;
+} Opt;
+
+/// Nodes of the tree, shared ones once per parent
+static size_t opt_count_nodes(Node *expr) {
+  Node_Frames stack = {0};
+  size_t count = 0;
+  node_frames_push(&stack, expr);
+  while (stack.count > 0) {
+    Node *node = stack.items[--stack.count].node;
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    for (size_t i = 0; i < children_count; ++i)
+      node_frames_push(&stack, children[i]);
+    count += 1;
+  }
+  free(stack.items);
+  return count;
+}
+
+static bool opt_is_constant(Node *expr) {
+  return expr->kind == NK_NUMBER || expr->kind == NK_BOOLEAN;
+}
+
+/// Both zeros compare equal, which is fine: no operation can tell them apart
+/// in a way that reaches a pixel
+static bool opt_is_number(Node *expr, float number) {
+  return expr->kind == NK_NUMBER && expr->as.number == number;
+}
+
+// New nodes are typed right away, so the result needs no second typecheck
+static Node *opt_number(Node *at, float number) {
+  Node *node = node_number_loc(at->file, at->line, number);
+  node->type = NK_NUMBER;
+  return node;
+}
+
+static Node *opt_boolean(Node *at, bool boolean) {
+  Node *node = node_boolean_loc(at->file, at->line, boolean);
+  node->type = NK_BOOLEAN;
+  return node;
+}
+
+static Node *opt_unop(Node *at, Node_Kind kind, Node *value) {
+  Node *node = node_unop_loc(at->file, at->line, kind, value);
+  node->type = NK_NUMBER;
+  return node;
+}
+
+static Node *opt_binop(Node *at, Node_Kind kind, Node *lhs, Node *rhs) {
+  Node *node = node_binop_loc(at->file, at->line, kind, lhs, rhs);
+  node->type = kind == NK_GT ? NK_BOOLEAN : NK_NUMBER;
+  return node;
+}
+
+static size_t opt_range_hash(Node *node, size_t capacity) {
+  return ((uintptr_t)node * 0x9e3779b97f4a7c15ULL >> 16) & (capacity - 1);
+}
+
+/// Find the entry of `node`, or the empty entry it belongs into. The pointer
+/// is only valid until the next lookup.
+static Opt_Range *opt_ranges_find(Opt_Ranges *ranges, Node *node) {
+  if ((ranges->count + 1) * 2 > ranges->capacity) {
+    Opt_Ranges grown = {.capacity =
+                            ranges->capacity ? ranges->capacity * 2 : 1024};
+    grown.items = calloc(grown.capacity, sizeof(*grown.items));
+    assert(grown.items != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < ranges->capacity; ++i) {
+      Opt_Range *range = &ranges->items[i];
+      if (!range->node)
+        continue;
+      size_t j = opt_range_hash(range->node, grown.capacity);
+      while (grown.items[j].node)
+        j = (j + 1) & (grown.capacity - 1);
+      grown.items[j] = *range;
+      grown.count += 1;
+    }
+    free(ranges->items);
+    *ranges = grown;
+  }
+
+  size_t i = opt_range_hash(node, ranges->capacity);
+  while (ranges->items[i].node && ranges->items[i].node != node)
+    i = (i + 1) & (ranges->capacity - 1);
+  return &ranges->items[i];
+}
+
+/// Bounds of `expr` over the whole image, one interval per number. Every
+/// node is bounded once and remembered, however many rewrites above it ask.
+static void opt_range(Opt *opt, Node *expr, Interval *result) {
+  Interval domain = {.lo = -1.0f, .hi = 1.0f};
+  Interval_Box box = {
+      .x = domain,
+      .y = domain,
+      .t = domain,
+      .math = opt->math,
+  };
+  opt->frames.count = 0;
+  opt->values.count = 0;
+  node_frames_push(&opt->frames, expr);
+  while (opt->frames.count > 0) {
+    Node_Frame *frame = &opt->frames.items[opt->frames.count - 1];
+    Node *node = frame->node;
+    Opt_Range *range = opt_ranges_find(&opt->ranges, node);
+    if (range->node) {
+      da_append(&opt->values, range->value);
+      opt->frames.count -= 1;
+      continue;
+    }
+
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    if (frame->next < children_count) {
+      node_frames_push(&opt->frames, children[frame->next++]);
+      continue;
+    }
+    opt->frames.count -= 1;
+
+    Interval_Value value;
+    if (children_count == 0) {
+      eval_interval(&box, node, value.v);
+    } else {
+      Interval operands[3][3];
+      opt->values.count -= children_count;
+      for (size_t i = 0; i < children_count; ++i) {
+        memcpy(operands[i], opt->values.items[opt->values.count + i].v,
+               sizeof(operands[i]));
+      }
+      interval_operation(node, box.math, operands, value.v);
+    }
+    // interval.h bounds fmodf(), GLSL mod() takes the sign of the divisor
+    if (opt->target == OPT_TARGET_GLSL && node->kind == NK_MOD)
+      value.v[0] = (Interval){.lo = -INFINITY, .hi = INFINITY, .nan = true};
+    // Bounding the children may have grown the table
+    range = opt_ranges_find(&opt->ranges, node);
+    *range = (Opt_Range){.node = node, .value = value};
+    opt->ranges.count += 1;
+    da_append(&opt->values, value);
+  }
+
+  size_t width = expr->type == NK_TRIPLE ? 3 : 1;
+  memcpy(result, opt->values.items[0].v, width * sizeof(*result));
+}
+
+static float opt_magnitude_max(Interval a) {
+  return fmaxf(fabsf(a.lo), fabsf(a.hi));
+}
+
+/// A folded constant of `expr`, or `expr` itself when the target cannot
+/// spell the number
+static Node *opt_folded(Opt *opt, Node *expr, float number) {
+  if (opt->target == OPT_TARGET_GLSL && !isfinite(number))
+    return expr;
+  return opt_number(expr, number);
+}
+
+/// Evaluate an operation over constants exactly like the evaluators would
+static Node *opt_fold(Opt *opt, Node *expr) {
+  switch (expr->kind) {
+  case NK_SQRT:
+  case NK_ABS:
+    return opt_folded(opt, expr,
+                      UNOP_MAPPER(expr->kind, expr->as.unop->as.number));
+
+  case NK_SIN:
+    return opt_folded(opt, expr, opt->math->sin(expr->as.unop->as.number));
+
+  case NK_ADD:
+  case NK_MULT:
+  case NK_MOD: {
+    // The evaluators compute fmodf(), which GLSL mod() is not
+    if (expr->kind == NK_MOD && opt->target == OPT_TARGET_GLSL)
+      return expr;
+    float lhs = expr->as.binop.lhs->as.number;
+    float rhs = expr->as.binop.rhs->as.number;
+    return opt_folded(opt, expr, BINOP_MAPPER(expr->kind, lhs, rhs));
+  }
+
+  case NK_GT: {
+    float lhs = expr->as.binop.lhs->as.number;
+    float rhs = expr->as.binop.rhs->as.number;
+    return opt_boolean(expr, BINOP_MAPPER(expr->kind, lhs, rhs));
+  }
+
+  case NK_X:
+  case NK_Y:
+  case NK_T:
+  case NK_NUMBER:
+  case NK_BOOLEAN:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  case NK_TRIPLE:
+  case NK_IF:
+  case NK_RULE:
+  case NK_RANDOM:
+  default:
+    return expr;
+  }
+}
+
+/// Apply a single rewrite to the node whose children are already optimized,
+/// returns `expr` itself when no rule matches
+static Node *opt_rewrite(Opt *opt, Node *expr) {
+  bool unsafe = opt->level >= OPT_UNSAFE;
+
+  switch (expr->kind) {
+  case NK_SQRT:
+  case NK_ABS:
+  case NK_SIN: {
+    Node *value = expr->as.unop;
+    if (opt_is_constant(value))
+      return opt_fold(opt, expr);
+
+    if (expr->kind == NK_ABS) {
+      // Already non-negative (or NaN, which abs keeps NaN)
+      if (value->kind == NK_ABS || value->kind == NK_SQRT)
+        return value;
+      if (value->kind == NK_MULT &&
+          node_equal(value->as.binop.lhs, value->as.binop.rhs))
+        return value;
+    }
+
+    // Never negative (or NaN), so abs() only guards against nothing. A
+    // zero may lose its sign, which no operation lets reach a pixel.
+    if (expr->kind == NK_ABS) {
+      Interval range;
+      opt_range(opt, value, &range);
+      if (range.lo >= 0.0f) {
+        opt->stats->range_rewrites += 1;
+        return value;
+      }
+    }
+
+    // a*a overflows and underflows where |a| does not
+    if (unsafe && expr->kind == NK_SQRT && value->kind == NK_MULT &&
+        node_equal(value->as.binop.lhs, value->as.binop.rhs))
+      return opt_unop(expr, NK_ABS, value->as.binop.lhs);
+  } break;
+
+  case NK_ADD:
+  case NK_MULT:
+  case NK_MOD:
+  case NK_GT: {
+    Node *lhs = expr->as.binop.lhs;
+    Node *rhs = expr->as.binop.rhs;
+    if (opt_is_constant(lhs) && opt_is_constant(rhs))
+      return opt_fold(opt, expr);
+
+    // Commutative operations keep their constant on the right, so the rules
+    // below and common subexpression elimination see one form only
+    bool commutative = expr->kind == NK_ADD || expr->kind == NK_MULT;
+    if (commutative && opt_is_constant(lhs))
+      return opt_binop(expr, expr->kind, rhs, lhs);
+
+    if (expr->kind == NK_ADD && opt_is_number(rhs, 0.0f))
+      return lhs;
+    if (expr->kind == NK_MULT && opt_is_number(rhs, 1.0f))
+      return lhs;
+    // Holds for NaN too, nothing is greater than itself
+    if (expr->kind == NK_GT && node_equal(lhs, rhs))
+      return opt_boolean(expr, false);
+    // fmodf() only looks at the magnitude of the divisor
+    bool fmod = opt->target == OPT_TARGET_ENGINES;
+    if (fmod && expr->kind == NK_MOD && rhs->kind == NK_ABS)
+      return opt_binop(expr, NK_MOD, lhs, rhs->as.unop);
+
+    if (fmod && expr->kind == NK_MOD) {
+      // A dividend always below the divisor is its own remainder, NaN
+      // included. Infinite dividends never are, zero divisors never exceed.
+      Interval a, b;
+      opt_range(opt, lhs, &a);
+      opt_range(opt, rhs, &b);
+      if (!b.nan && opt_magnitude_max(a) < fminf(fabsf(b.lo), fabsf(b.hi)) &&
+          (b.lo > 0.0f || b.hi < 0.0f)) {
+        opt->stats->range_rewrites += 1;
+        return lhs;
+      }
+    }
+    // Bounds apart settle the comparison for every pixel
+    if (expr->kind == NK_GT) {
+      Interval range;
+      opt_range(opt, expr, &range);
+      if (range.lo == range.hi) {
+        opt->stats->range_rewrites += 1;
+        return opt_boolean(expr, range.lo > 0.0f);
+      }
+    }
+
+    if (!unsafe)
+      break;
+
+    // NaN and infinities times zero are NaN
+    if (expr->kind == NK_MULT && opt_is_number(rhs, 0.0f))
+      return rhs;
+    // fmodf(a, a) is NaN for zero, NaN and infinities
+    if (fmod && expr->kind == NK_MOD && node_equal(lhs, rhs))
+      return opt_number(expr, 0.0f);
+    // (a + c1) + c2 => a + (c1 + c2) rounds differently
+    if (commutative && rhs->kind == NK_NUMBER && lhs->kind == expr->kind &&
+        lhs->as.binop.rhs->kind == NK_NUMBER) {
+      float c = BINOP_MAPPER(expr->kind, lhs->as.binop.rhs->as.number,
+                             rhs->as.number);
+      Node *folded = opt_folded(opt, rhs, c);
+      if (folded != rhs)
+        return opt_binop(expr, expr->kind, lhs->as.binop.lhs, folded);
+    }
+  } break;
+
+  case NK_IF: {
+    Node *cond = expr->as.iff.cond;
+    if (cond->kind == NK_BOOLEAN)
+      return cond->as.boolean ? expr->as.iff.then : expr->as.iff.elze;
+    if (node_equal(expr->as.iff.then, expr->as.iff.elze))
+      return expr->as.iff.then;
+  } break;
+
+  case NK_X:
+  case NK_Y:
+  case NK_T:
+  case NK_NUMBER:
+  case NK_BOOLEAN:
+  case NK_TRIPLE:
+    break;
+
+  // The optimizer runs before fuse()
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  case NK_RULE:
+  case NK_RANDOM:
+  default:
+    UNREACHABLE_CODE("opt_rewrite");
+  }
+
+  return expr;
+}
+
+/// Copy on write, the input may share nodes between several parents
+static Node *opt_with_children(Node *expr, Node *children[3]) {
+  Node *old_children[3];
+  size_t children_count = node_children(expr, old_children);
+  bool changed = false;
+  for (size_t i = 0; i < children_count; ++i)
+    changed = changed || children[i] != old_children[i];
+  if (!changed)
+    return expr;
+
+  Node *copy = node_loc(expr->file, expr->line, expr->kind);
+  *copy = *expr;
+  Node **refs[3];
+  node_child_refs(copy, refs);
+  for (size_t i = 0; i < children_count; ++i)
+    *refs[i] = children[i];
+  return copy;
+}
+
+typedef struct {
+  Node **items;
+  size_t count;
+  size_t capacity;
+} Opt_Results;
+
+/// Optimize the children of every node first, then rewrite the node until
+/// no rule matches any more
+static Node *opt_tree(Opt *opt, Node *f) {
+  Node_Frames frames = {0};
+  // Optimized operands, in order, waiting for their parent
+  Opt_Results results = {0};
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *expr = frame->node;
+    Node *children[3];
+    size_t children_count = node_children(expr, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+
+    results.count -= children_count;
+    expr = opt_with_children(expr, &results.items[results.count]);
+    for (;;) {
+      Node *rewritten = opt_rewrite(opt, expr);
+      if (rewritten == expr)
+        break;
+      opt->stats->rewrites += 1;
+      expr = rewritten;
+    }
+    da_append(&results, expr);
+  }
+  f = results.items[0];
+  free(frames.items);
+  free(results.items);
+  return f;
+}
+
+typedef struct {
+  Node **items;
+  size_t count;
+  size_t capacity;
+} Opt_Nodes;
+
+static void opt_nodes_append(Opt_Nodes *nodes, Node *node) {
+  if (nodes->count == nodes->capacity) {
+    nodes->capacity = nodes->capacity ? nodes->capacity * 2 : 16;
+    nodes->items = realloc(nodes->items,
+                           nodes->capacity * sizeof(*nodes->items));
+    assert(nodes->items != NULL && "Buy more RAM lol");
+  }
+  nodes->items[nodes->count++] = node;
+}
+
+typedef struct {
+  Node *node;
+  size_t operations; // of the chain above it
+} Opt_Chain_Link;
+
+/// Operands of the chain of `kind` operations rooted at `expr`, left to
+/// right, and the number of operations on its longest path
+static size_t opt_chain(Node *expr, Node_Kind kind, Opt_Nodes *operands) {
+  struct {
+    Opt_Chain_Link *items;
+    size_t count;
+    size_t capacity;
+  } stack = {0};
+  size_t height = 0;
+  da_append(&stack, ((Opt_Chain_Link){expr, 0}));
+  while (stack.count > 0) {
+    Opt_Chain_Link link = stack.items[--stack.count];
+    if (link.node->kind != kind) {
+      opt_nodes_append(operands, link.node);
+      if (link.operations > height)
+        height = link.operations;
+      continue;
+    }
+    // The left operand goes on top, so it comes out first
+    da_append(&stack,
+              ((Opt_Chain_Link){link.node->as.binop.rhs, link.operations + 1}));
+    da_append(&stack,
+              ((Opt_Chain_Link){link.node->as.binop.lhs, link.operations + 1}));
+  }
+  free(stack.items);
+  return height;
+}
+
+static Node *opt_balanced(Node *at, Node_Kind kind, Node **operands,
+                          size_t count) {
+  if (count == 1)
+    return operands[0];
+  size_t half = count / 2;
+  return opt_binop(at, kind, opt_balanced(at, kind, operands, half),
+                   opt_balanced(at, kind, operands + half, count - half));
+}
+
+static bool opt_is_chain(Node *expr) {
+  return expr->kind == NK_ADD || expr->kind == NK_MULT;
+}
+
+/// Rebuild a chain of additions or multiplications from its reassociated
+/// operands as a balanced tree
+static Node *opt_rebalance(Opt *opt, Node *expr, Opt_Nodes *chain,
+                           size_t height, Node **reassociated) {
+  Opt_Nodes operands = {0};
+  bool changed = false;
+  Node *constant = NULL;
+  for (size_t i = 0; i < chain->count; ++i) {
+    Node *operand = reassociated[i];
+    changed = changed || operand != chain->items[i];
+    if (operand->kind != NK_NUMBER) {
+      opt_nodes_append(&operands, operand);
+    } else if (constant == NULL) {
+      constant = operand;
+    } else {
+      constant = opt_number(constant, BINOP_MAPPER(expr->kind,
+                                                   constant->as.number,
+                                                   operand->as.number));
+      changed = true;
+    }
+  }
+  if (constant)
+    opt_nodes_append(&operands, constant);
+
+  size_t balanced_height = 0;
+  while (((size_t)1 << balanced_height) < operands.count)
+    balanced_height += 1;
+  if (height > balanced_height) {
+    opt->stats->reassociated += 1;
+    changed = true;
+  }
+  if (changed)
+    expr = opt_balanced(expr, expr->kind, operands.items, operands.count);
+  free(operands.items);
+  return expr;
+}
+
+// A node of opt_reassociate(), the operands of a chain are its children
+typedef struct {
+  Node *node;
+  size_t next;
+  Opt_Nodes chain;
+  size_t height;
+} Opt_Frame;
+
+/// Rebuild every chain of additions or multiplications as a balanced tree,
+/// so its operations no longer wait for each other one by one. The
+/// constants of a chain are folded into one on the right. Floats are not
+/// associative, so this rounds differently and is OPT_UNSAFE only.
+static Node *opt_reassociate(Opt *opt, Node *f) {
+  struct {
+    Opt_Frame *items;
+    size_t count;
+    size_t capacity;
+  } frames = {0};
+  Opt_Results results = {0};
+  da_append(&frames, ((Opt_Frame){.node = f}));
+  if (opt_is_chain(f))
+    frames.items[0].height = opt_chain(f, f->kind, &frames.items[0].chain);
+  while (frames.count > 0) {
+    Opt_Frame *frame = &frames.items[frames.count - 1];
+    Node *expr = frame->node;
+    Node *children[3];
+    Node **operands = children;
+    size_t operands_count = node_children(expr, children);
+    if (opt_is_chain(expr)) {
+      operands = frame->chain.items;
+      operands_count = frame->chain.count;
+    }
+    if (frame->next < operands_count) {
+      Node *operand = operands[frame->next++];
+      da_append(&frames, ((Opt_Frame){.node = operand}));
+      Opt_Frame *pushed = &frames.items[frames.count - 1];
+      if (opt_is_chain(operand))
+        pushed->height = opt_chain(operand, operand->kind, &pushed->chain);
+      continue;
+    }
+
+    results.count -= operands_count;
+    Node **reassociated = &results.items[results.count];
+    expr = opt_is_chain(expr)
+               ? opt_rebalance(opt, expr, &frame->chain, frame->height,
+                               reassociated)
+               : opt_with_children(expr, reassociated);
+    free(frame->chain.items);
+    frames.count -= 1;
+    da_append(&results, expr);
+  }
+  f = results.items[0];
+  free(frames.items);
+  free(results.items);
+  return f;
+}
+
+Node *optimize(Node *f, Opt_Level level, Opt_Target target,
+               const Math_Funcs *math, Opt_Stats *stats) {
+  *stats = (Opt_Stats){0};
+  stats->nodes_before = opt_count_nodes(f);
+  if (level != OPT_NONE) {
+    Opt opt = {
+        .level = level,
+        .target = target,
+        .math = math,
+        .stats = stats,
+    };
+    f = opt_tree(&opt, f);
+    if (level >= OPT_UNSAFE)
+      f = opt_reassociate(&opt, f);
+    free(opt.ranges.items);
+    free(opt.frames.items);
+    free(opt.values.items);
+  }
+  stats->nodes_after = opt_count_nodes(f);
+  return f;
+}
+
+typedef struct {
+  Node **items;
+  size_t count; // all of them, even past the capacity
+  size_t capacity;
+} Opt_Nan_Sources;
+
+size_t opt_nan_sources(Node *f, const Math_Funcs *math, Node **sources,
+                       size_t capacity) {
+  Opt_Nan_Sources nan_sources = {.items = sources, .capacity = capacity};
+  Interval domain = {.lo = -1.0f, .hi = 1.0f};
+  Interval_Box box = {
+      .x = domain,
+      .y = domain,
+      .t = domain,
+      .math = math,
+  };
+  Node_Frames frames = {0};
+  // Bounds of the operands done, in order, waiting for their parent
+  struct {
+    Interval_Value *items;
+    size_t count;
+    size_t capacity;
+  } values = {0};
+
+  // Bound the tree bottom up, once per node
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *expr = frame->node;
+    Node *children[3];
+    size_t children_count = node_children(expr, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+
+    Interval_Value value;
+    if (children_count == 0) {
+      eval_interval(&box, expr, value.v);
+      da_append(&values, value);
+      continue;
+    }
+    Interval operands[3][3];
+    bool operands_nan = false;
+    values.count -= children_count;
+    for (size_t i = 0; i < children_count; ++i) {
+      memcpy(operands[i], values.items[values.count + i].v,
+             sizeof(operands[i]));
+      size_t width = children[i]->type == NK_TRIPLE ? 3 : 1;
+      for (size_t j = 0; j < width; ++j)
+        operands_nan = operands_nan || operands[i][j].nan;
+    }
+    interval_operation(expr, box.math, operands, value.v);
+    da_append(&values, value);
+
+    if (!operands_nan && value.v[0].nan) {
+      if (nan_sources.count < nan_sources.capacity)
+        nan_sources.items[nan_sources.count] = expr;
+      nan_sources.count += 1;
+    }
+  }
+  free(frames.items);
+  free(values.items);
+  return nan_sources.count;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "node.h"
+
+// Optimizer: rewrites a typechecked tree into a cheaper one before it reaches
+// any evaluator. OPT_SAFE only applies rewrites that produce the same pixels
+// as the original tree, OPT_UNSAFE also applies the ones that only hold in
+// exact arithmetic (they break for NaN, infinities, overflow or rounding),
+// and rebalances long chains of additions and multiplications.
+// Both levels also bound every value over the whole image (interval.h), with
+// x, y and t anywhere in -1..1, and drop guards such as an abs() of a value
+// that is never negative. Constants are folded, and sin bounded, with the
+// math tier the engines evaluate, so folding never changes a pixel.
+typedef enum {
+  OPT_NONE,
+  OPT_SAFE,
+  OPT_UNSAFE,
+  COUNT_OPT_LEVELS,
+} Opt_Level;
+
+extern const char *opt_level_names[COUNT_OPT_LEVELS];
+
+// Where the optimized tree runs: the engines, or the GLSL of the shader
+// command, which has no literals for NaN and infinities, so folds that
+// produce them are kept as operations there. GLSL mod() is a - b*floor(a/b)
+// and takes the sign of the divisor, so the rules that rely on fmodf() are
+// off for it.
+typedef enum {
+  OPT_TARGET_ENGINES,
+  OPT_TARGET_GLSL,
+} Opt_Target;
+
+typedef struct {
+  size_t nodes_before; // nodes of the tree as generated
+  size_t nodes_after;
+  size_t rewrites;
+  size_t range_rewrites; // of the rewrites, the ones that needed bounds
+  size_t reassociated;   // chains rebuilt as balanced trees (OPT_UNSAFE)
+} Opt_Stats;
+
+// The result may share nodes with `f`, which is left untouched
+Node *optimize(Node *f, Opt_Level level, Opt_Target target,
+               const Math_Funcs *math, Opt_Stats *stats);
+
+// Subtrees that may evaluate to NaN somewhere in the image although none of
+// their operands can, e.g. the sqrt() of a value that may be negative. Fills
+// up to `capacity` of them and returns how many there are.
+size_t opt_nan_sources(Node *f, const Math_Funcs *math, Node **sources,
+                       size_t capacity);
@@ -0,0 +1,576 @@
+#include "png.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+// Bytes of a pixel, RGB
+#define PNG_PIXEL 3
+// Deflate matches: at least 3 bytes, at most 258, at most 32 KiB back
+#define PNG_MIN_MATCH 3
+#define PNG_MAX_MATCH 258
+#define PNG_WINDOW (1 << 15)
+#define PNG_HASH_BITS 15
+// Candidates tried per position, more compress better and slower
+#define PNG_MAX_CHAIN 16
+
+static const uint16_t png_length_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t png_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t png_distance_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t png_distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// Fixed Huffman codes, bit reversed since deflate packs them from the
+// lowest bit up
+static uint16_t png_literal_codes[288];
+static uint8_t png_literal_lengths[288];
+static uint8_t png_distance_codes[30];
+// Symbol of every match length, and of every distance: up to 256 directly,
+// above that by the distance - 1 shifted right by 7
+static uint8_t png_length_symbols[PNG_MAX_MATCH + 1];
+static uint8_t png_distance_symbols[257];
+static uint8_t png_far_distance_symbols[256];
+static uint32_t png_crc_table[256];
+static bool png_tables_ready;
+
+static uint32_t png_reverse(uint32_t code, size_t length) {
+  uint32_t reversed = 0;
+  for (size_t i = 0; i < length; ++i)
+    reversed |= ((code >> i) & 1) << (length - 1 - i);
+  return reversed;
+}
+
+static void png_init_tables(void) {
+  if (png_tables_ready)
+    return;
+  for (size_t s = 0; s < 288; ++s) {
+    uint32_t code;
+    size_t length;
+    if (s < 144) {
+      code = 0x30 + s, length = 8;
+    } else if (s < 256) {
+      code = 0x190 + (s - 144), length = 9;
+    } else if (s < 280) {
+      code = s - 256, length = 7;
+    } else {
+      code = 0xC0 + (s - 280), length = 8;
+    }
+    png_literal_codes[s] = png_reverse(code, length);
+    png_literal_lengths[s] = length;
+  }
+  for (size_t d = 0; d < 30; ++d)
+    png_distance_codes[d] = png_reverse(d, 5);
+
+  // 258 has a symbol of its own although 227 + 31 reaches it too
+  for (size_t k = 0; k < 28; ++k) {
+    size_t end = png_length_base[k] + (1u << png_length_extra[k]);
+    for (size_t length = png_length_base[k]; length < end; ++length) {
+      if (length < PNG_MAX_MATCH)
+        png_length_symbols[length] = k;
+    }
+  }
+  png_length_symbols[PNG_MAX_MATCH] = 28;
+  for (size_t d = 0; d < 30; ++d) {
+    size_t end = png_distance_base[d] + (1u << png_distance_extra[d]);
+    for (size_t distance = png_distance_base[d]; distance < end; ++distance) {
+      if (distance <= 256)
+        png_distance_symbols[distance] = d;
+      else
+        png_far_distance_symbols[(distance - 1) >> 7] = d;
+    }
+  }
+
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t c = n;
+    for (size_t k = 0; k < 8; ++k)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    png_crc_table[n] = c;
+  }
+  png_tables_ready = true;
+}
+
+static uint32_t png_crc(uint32_t crc, const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; ++i)
+    crc = png_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+static uint32_t png_adler(uint32_t adler, const uint8_t *data, size_t size) {
+  uint32_t a = adler & 0xFFFF, b = adler >> 16;
+  while (size > 0) {
+    // The largest run whose sums cannot overflow before the modulo
+    size_t run = size < 5552 ? size : 5552;
+    for (size_t i = 0; i < run; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += run;
+    size -= run;
+  }
+  return b << 16 | a;
+}
+
+static void png_bits_reserve(Png_Bits *bits, size_t bytes) {
+  if (bits->count + bytes <= bits->capacity)
+    return;
+  while (bits->count + bytes > bits->capacity)
+    bits->capacity = bits->capacity ? bits->capacity * 2 : 4096;
+  bits->items = realloc(bits->items, bits->capacity);
+  assert(bits->items != NULL && "Buy more RAM lol");
+}
+
+/// Append the `count` lowest bits of `value`, at most 32 of them, which
+/// needs room for 4 more bytes
+static inline void png_bits_put(Png_Bits *bits, uint32_t value,
+                                size_t count) {
+  bits->bits |= (uint64_t)value << bits->bit_count;
+  bits->bit_count += count;
+  while (bits->bit_count >= 8) {
+    bits->items[bits->count++] = bits->bits & 0xFF;
+    bits->bits >>= 8;
+    bits->bit_count -= 8;
+  }
+}
+
+/// Pad to a whole byte
+static void png_bits_align(Png_Bits *bits) {
+  png_bits_put(bits, 0, (8 - bits->bit_count % 8) % 8);
+}
+
+// Scratch memory of an encoder thread
+typedef struct {
+  uint8_t *current; // the row being filtered, unfiltered
+  uint8_t *previous;
+  uint8_t *candidates; // the current row through each of the 5 filters
+  int32_t *head; // deflate hash chains
+  int32_t *prev;
+} Png_Encoder;
+
+static inline uint32_t png_hash(const uint8_t *data) {
+  uint32_t key = data[0] << 16 | data[1] << 8 | data[2];
+  return (key * 2654435761u) >> (32 - PNG_HASH_BITS);
+}
+
+static inline void png_insert(Png_Encoder *e, const uint8_t *in, size_t n,
+                              size_t i) {
+  if (i + PNG_MIN_MATCH > n)
+    return;
+  uint32_t hash = png_hash(&in[i]);
+  e->prev[i % PNG_WINDOW] = e->head[hash];
+  e->head[hash] = i;
+}
+
+/// Compress `in` into one block with fixed codes and end it with a sync
+/// flush, matches only reach back within `in`
+static void png_deflate(Png_Encoder *e, Png_Bits *bits, const uint8_t *in,
+                        size_t n) {
+  // Fixed codes take at most 9 bits a byte, plus the block framing
+  png_bits_reserve(bits, n + n / 8 + 16);
+  memset(e->head, 0xFF, (1 << PNG_HASH_BITS) * sizeof(*e->head));
+  png_bits_put(bits, 0, 1); // not the final block
+  png_bits_put(bits, 1, 2); // fixed codes
+
+  size_t i = 0;
+  while (i < n) {
+    size_t best_length = 0, best_distance = 0;
+    size_t max_length = n - i < PNG_MAX_MATCH ? n - i : PNG_MAX_MATCH;
+    if (max_length >= PNG_MIN_MATCH) {
+      int32_t candidate = e->head[png_hash(&in[i])];
+      for (size_t chain = 0; candidate >= 0 && chain < PNG_MAX_CHAIN;
+           ++chain) {
+        size_t distance = i - candidate;
+        if (distance > PNG_WINDOW)
+          break;
+        // The byte that would make it longer than the best decides first
+        if (in[candidate + best_length] == in[i + best_length]) {
+          size_t length = 0;
+          const uint8_t *match = &in[candidate];
+          while (length < max_length && match[length] == in[i + length])
+            ++length;
+          if (length > best_length) {
+            best_length = length;
+            best_distance = distance;
+            if (length == max_length)
+              break;
+          }
+        }
+        candidate = e->prev[candidate % PNG_WINDOW];
+      }
+    }
+
+    if (best_length < PNG_MIN_MATCH) {
+      png_bits_put(bits, png_literal_codes[in[i]], png_literal_lengths[in[i]]);
+      png_insert(e, in, n, i);
+      i += 1;
+      continue;
+    }
+
+    size_t k = png_length_symbols[best_length];
+    png_bits_put(bits, png_literal_codes[257 + k],
+                 png_literal_lengths[257 + k]);
+    png_bits_put(bits, best_length - png_length_base[k], png_length_extra[k]);
+    size_t d = best_distance <= 256
+                   ? png_distance_symbols[best_distance]
+                   : png_far_distance_symbols[(best_distance - 1) >> 7];
+    png_bits_put(bits, png_distance_codes[d], 5);
+    png_bits_put(bits, best_distance - png_distance_base[d],
+                 png_distance_extra[d]);
+    for (size_t end = i + best_length; i < end; ++i)
+      png_insert(e, in, n, i);
+  }
+
+  png_bits_put(bits, png_literal_codes[256], png_literal_lengths[256]);
+  // An empty stored block brings the stream back to a byte boundary
+  png_bits_put(bits, 0, 3);
+  png_bits_align(bits);
+  png_bits_put(bits, 0xFFFF0000u, 32);
+}
+
+static inline uint8_t png_paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/// Filter `row` below `up` into `out` with every filter type, `out[type]`
+/// holds the type and the filtered bytes
+static void png_filter_all(size_t stride, const uint8_t *row,
+                           const uint8_t *up, uint8_t *out[5]) {
+  for (int type = 0; type < 5; ++type)
+    out[type][0] = type;
+  uint8_t *none = out[0] + 1, *sub = out[1] + 1, *above = out[2] + 1;
+  uint8_t *average = out[3] + 1, *paeth = out[4] + 1;
+
+  // The first pixel has nothing on its left
+  for (size_t i = 0; i < PNG_PIXEL; ++i) {
+    none[i] = row[i];
+    sub[i] = row[i];
+    above[i] = row[i] - up[i];
+    average[i] = row[i] - (up[i] >> 1);
+    paeth[i] = row[i] - up[i];
+  }
+  for (size_t i = PNG_PIXEL; i < stride; ++i) {
+    uint8_t a = row[i - PNG_PIXEL], b = up[i], c = up[i - PNG_PIXEL];
+    none[i] = row[i];
+    sub[i] = row[i] - a;
+    above[i] = row[i] - b;
+    average[i] = row[i] - ((a + b) >> 1);
+    paeth[i] = row[i] - png_paeth(a, b, c);
+  }
+}
+
+/// The filter whose bytes are the closest to zero as signed values, the
+/// usual guess at the one that compresses best
+static int png_filter_pick(size_t stride, uint8_t *out[5]) {
+  int best = 0;
+  uint64_t best_sum = UINT64_MAX;
+  for (int type = 0; type < 5; ++type) {
+    const int8_t *bytes = (const int8_t *)out[type] + 1;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < stride; ++i)
+      sum += abs(bytes[i]);
+    if (sum < best_sum) {
+      best = type;
+      best_sum = sum;
+    }
+  }
+  return best;
+}
+
+static void png_rgb(uint8_t *out, const Color *row, size_t width) {
+  for (size_t x = 0; x < width; ++x) {
+    out[x * PNG_PIXEL + 0] = row[x].r;
+    out[x * PNG_PIXEL + 1] = row[x].g;
+    out[x * PNG_PIXEL + 2] = row[x].b;
+  }
+}
+
+/// Filter and compress strip `index`, the first one also carries the zlib
+/// header
+static void png_encode(Png_Writer *png, Png_Encoder *e, Png_Strip *strip,
+                       size_t index) {
+  size_t stride = png->width * PNG_PIXEL;
+  size_t size = strip->rows * (1 + stride);
+  if (size > strip->filtered_capacity) {
+    strip->filtered = realloc(strip->filtered, size);
+    assert(strip->filtered != NULL && "Buy more RAM lol");
+    strip->filtered_capacity = size;
+  }
+
+  memcpy(e->previous, strip->up, stride);
+  for (size_t y = 0; y < strip->rows; ++y) {
+    png_rgb(e->current, &strip->pixels[y * png->width], png->width);
+    uint8_t *out[5];
+    for (size_t type = 0; type < 5; ++type)
+      out[type] = &e->candidates[type * (1 + stride)];
+    png_filter_all(stride, e->current, e->previous, out);
+    int best = png_filter_pick(stride, out);
+    memcpy(&strip->filtered[y * (1 + stride)], out[best], 1 + stride);
+    uint8_t *previous = e->previous;
+    e->previous = e->current;
+    e->current = previous;
+  }
+  strip->adler = png_adler(1, strip->filtered, size);
+
+  strip->bits.count = 0;
+  if (index == 0) {
+    // zlib header: deflate with a 32 KiB window, no dictionary
+    png_bits_reserve(&strip->bits, 2);
+    png_bits_put(&strip->bits, 0x0178, 16);
+  }
+  png_deflate(e, &strip->bits, strip->filtered, size);
+}
+
+static void *png_encoder(void *arg) {
+  Png_Writer *png = arg;
+  size_t stride = png->width * PNG_PIXEL;
+  Png_Encoder e = {
+      .current = malloc(stride),
+      .previous = malloc(stride),
+      .candidates = malloc(5 * (1 + stride)),
+      .head = malloc((1 << PNG_HASH_BITS) * sizeof(*e.head)),
+      .prev = malloc(PNG_WINDOW * sizeof(*e.prev)),
+  };
+  assert(e.current != NULL && e.previous != NULL && e.candidates != NULL &&
+         e.head != NULL && e.prev != NULL && "Buy more RAM lol");
+
+  pthread_mutex_lock(&png->lock);
+  for (;;) {
+    if (png->claimed == png->submitted) {
+      if (png->stopping)
+        break;
+      pthread_cond_wait(&png->queued, &png->lock);
+      continue;
+    }
+    size_t index = png->claimed++;
+    Png_Strip *strip = &png->strips[index % png->strip_count];
+    pthread_mutex_unlock(&png->lock);
+    png_encode(png, &e, strip, index);
+    pthread_mutex_lock(&png->lock);
+    strip->encoded = true;
+    pthread_cond_signal(&png->encoded);
+  }
+  pthread_mutex_unlock(&png->lock);
+
+  free(e.current);
+  free(e.previous);
+  free(e.candidates);
+  free(e.head);
+  free(e.prev);
+  return NULL;
+}
+
+/// Adler-32 of two byte ranges in a row from the checksum of each, `size`
+/// being that of the second one
+static uint32_t png_adler_combine(uint32_t first, uint32_t second,
+                                  size_t size) {
+  const uint64_t base = 65521;
+  uint64_t rem = size % base;
+  uint64_t a = (first & 0xFFFF) + (second & 0xFFFF) + base - 1;
+  uint64_t b = rem * (first & 0xFFFF) % base + (first >> 16) +
+               (second >> 16) + base - rem;
+  return (uint32_t)(b % base) << 16 | (uint32_t)(a % base);
+}
+
+static bool png_write_chunk(Png_Writer *png, const char *type,
+                            const uint8_t *data, size_t size) {
+  uint8_t header[8] = {
+      size >> 24, size >> 16, size >> 8, size, type[0], type[1], type[2],
+      type[3],
+  };
+  uint32_t crc = png_crc(0xFFFFFFFFu, &header[4], 4);
+  crc = png_crc(crc, data, size) ^ 0xFFFFFFFFu;
+  uint8_t footer[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+  if (fwrite(header, 1, sizeof(header), png->file) != sizeof(header) ||
+      fwrite(data, 1, size, png->file) != size ||
+      fwrite(footer, 1, sizeof(footer), png->file) != sizeof(footer)) {
+    nob_log(ERROR, "Could not write PNG: %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+/// Write the encoded strips that are next in order. Waits for the encoders
+/// until a strip is free for png_next_strip(), or with `all` until every
+/// submitted strip is written.
+static void png_drain(Png_Writer *png, bool all) {
+  pthread_mutex_lock(&png->lock);
+  while (png->written < png->submitted) {
+    Png_Strip *strip = &png->strips[png->written % png->strip_count];
+    if (!strip->encoded) {
+      if (!all && png->submitted - png->written < png->strip_count)
+        break;
+      pthread_cond_wait(&png->encoded, &png->lock);
+      continue;
+    }
+    // No encoder touches an encoded strip, so the file can be written
+    // without holding up the others
+    pthread_mutex_unlock(&png->lock);
+    if (!png->failed) {
+      size_t size = strip->rows * (1 + png->width * PNG_PIXEL);
+      png->adler = png_adler_combine(png->adler, strip->adler, size);
+      png->failed = !png_write_chunk(png, "IDAT", strip->bits.items,
+                                     strip->bits.count);
+    }
+    pthread_mutex_lock(&png->lock);
+    strip->encoded = false;
+    png->written += 1;
+  }
+  pthread_mutex_unlock(&png->lock);
+}
+
+bool png_begin(Png_Writer *png, const char *path, size_t width,
+               size_t height, size_t strip_rows, size_t threads) {
+  png_init_tables();
+  *png = (Png_Writer){
+      .width = width,
+      .height = height,
+      .strip_rows = strip_rows,
+      .adler = 1,
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .queued = PTHREAD_COND_INITIALIZER,
+      .encoded = PTHREAD_COND_INITIALIZER,
+  };
+  if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX) {
+    nob_log(ERROR, "PNG cannot be %zux%zu pixels", width, height);
+    return false;
+  }
+  assert(strip_rows > 0 && threads > 0);
+  png->file = fopen(path, "wb");
+  if (png->file == NULL) {
+    nob_log(ERROR, "Could not open %s: %s", path, strerror(errno));
+    return false;
+  }
+
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n',
+                                       0x1A, '\n'};
+  uint8_t ihdr[13] = {
+      width >> 24, width >> 16, width >> 8, width, height >> 24, height >> 16,
+      height >> 8, height,
+      8, // bits per channel
+      2, // RGB
+      0, 0, 0,
+  };
+  if (fwrite(signature, 1, sizeof(signature), png->file) != sizeof(signature))
+    return false;
+  if (!png_write_chunk(png, "IHDR", ihdr, sizeof(ihdr)))
+    return false;
+
+  // One strip being filled, one per encoder, and one waiting to be written
+  size_t stride = width * PNG_PIXEL;
+  png->previous = calloc(stride, 1);
+  png->strip_count = threads + 2;
+  png->strips = calloc(png->strip_count, sizeof(*png->strips));
+  assert(png->previous != NULL && png->strips != NULL && "Buy more RAM lol");
+  for (size_t i = 0; i < png->strip_count; ++i) {
+    Png_Strip *strip = &png->strips[i];
+    strip->pixels = malloc(width * strip_rows * sizeof(*strip->pixels));
+    strip->up = malloc(stride);
+    assert(strip->pixels != NULL && strip->up != NULL && "Buy more RAM lol");
+  }
+
+  png->threads = malloc(threads * sizeof(*png->threads));
+  assert(png->threads != NULL && "Buy more RAM lol");
+  for (; png->thread_count < threads; ++png->thread_count) {
+    if (pthread_create(&png->threads[png->thread_count], NULL, png_encoder,
+                       png) != 0) {
+      nob_log(ERROR, "Could not start a PNG encoder thread");
+      return false;
+    }
+  }
+  return true;
+}
+
+Color *png_next_strip(Png_Writer *png) {
+  png_drain(png, false);
+  if (png->failed)
+    return NULL;
+  return png->strips[png->submitted % png->strip_count].pixels;
+}
+
+void png_submit_strip(Png_Writer *png, size_t count) {
+  assert(count > 0 && count <= png->strip_rows);
+  assert(png->rows + count <= png->height);
+  Png_Strip *strip = &png->strips[png->submitted % png->strip_count];
+  strip->rows = count;
+  memcpy(strip->up, png->previous, png->width * PNG_PIXEL);
+  png_rgb(png->previous, &strip->pixels[(count - 1) * png->width],
+          png->width);
+  png->rows += count;
+
+  pthread_mutex_lock(&png->lock);
+  png->submitted += 1;
+  pthread_cond_signal(&png->queued);
+  pthread_mutex_unlock(&png->lock);
+}
+
+bool png_end(Png_Writer *png) {
+  bool ok = png->file != NULL && png->thread_count > 0;
+  if (png->thread_count > 0)
+    png_drain(png, true);
+  pthread_mutex_lock(&png->lock);
+  png->stopping = true;
+  pthread_cond_broadcast(&png->queued);
+  pthread_mutex_unlock(&png->lock);
+  for (size_t i = 0; i < png->thread_count; ++i)
+    pthread_join(png->threads[i], NULL);
+
+  ok = ok && !png->failed;
+  if (ok && png->rows != png->height) {
+    nob_log(ERROR, "PNG got %zu of its %zu rows", png->rows, png->height);
+    ok = false;
+  }
+  if (ok) {
+    // An empty final block, then the checksum of the whole stream
+    Png_Bits bits = {0};
+    png_bits_reserve(&bits, 8);
+    png_bits_put(&bits, 1, 1);
+    png_bits_put(&bits, 1, 2);
+    png_bits_put(&bits, png_literal_codes[256], png_literal_lengths[256]);
+    png_bits_align(&bits);
+    uint32_t adler = png->adler;
+    uint8_t checksum[4] = {adler >> 24, adler >> 16, adler >> 8, adler};
+    for (size_t i = 0; i < 4; ++i)
+      png_bits_put(&bits, checksum[i], 8);
+    ok = png_write_chunk(png, "IDAT", bits.items, bits.count) &&
+         png_write_chunk(png, "IEND", NULL, 0);
+    free(bits.items);
+  }
+  if (png->file != NULL && fclose(png->file) != 0 && ok) {
+    nob_log(ERROR, "Could not write PNG: %s", strerror(errno));
+    ok = false;
+  }
+
+  for (size_t i = 0; png->strips != NULL && i < png->strip_count; ++i) {
+    Png_Strip *strip = &png->strips[i];
+    free(strip->pixels);
+    free(strip->up);
+    free(strip->filtered);
+    free(strip->bits.items);
+  }
+  free(png->strips);
+  free(png->previous);
+  free(png->threads);
+  pthread_mutex_destroy(&png->lock);
+  pthread_cond_destroy(&png->queued);
+  pthread_cond_destroy(&png->encoded);
+  *png = (Png_Writer){0};
+  return ok;
+}
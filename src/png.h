@@ -0,0 +1,79 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lib/raylib/raylib-5.5_linux_amd64/include/raylib.h"
+
+// Streaming PNG writer: rows go out as soon as they are rendered, so an
+// image of any size only ever needs a few strips of it in memory. Pixels are
+// written as 8-bit RGB, the alpha of every rendered pixel is 255. Every
+// strip is filtered row by row and compressed on its own into one IDAT
+// chunk by a deflate with fixed Huffman codes, its matches never reach
+// back into the previous strip. A sync flush ends every strip, so the
+// chunks simply concatenate into one zlib stream.
+//
+// Since no strip depends on the bytes of another, encoder threads compress
+// several of them at once while the caller fills the next one, and the
+// caller writes them out in order. The only thing a strip takes from the
+// one above is its last row, which the filters look at.
+typedef struct {
+  uint8_t *items;
+  size_t count;
+  size_t capacity;
+  uint64_t bits; // not yet written, the oldest in the lowest bits
+  size_t bit_count;
+} Png_Bits;
+
+typedef struct {
+  Color *pixels; // filled by the caller
+  size_t rows;
+  uint8_t *up; // the row above the strip, unfiltered
+  uint8_t *filtered; // filter type and bytes of every row
+  size_t filtered_capacity;
+  uint32_t adler; // of the filtered bytes
+  Png_Bits bits; // the compressed strip
+  bool encoded;
+} Png_Strip;
+
+typedef struct {
+  FILE *file;
+  size_t width;
+  size_t height;
+  size_t rows; // handed to the encoders so far
+  size_t strip_rows;
+  uint32_t adler; // of the filtered bytes of every strip written
+  uint8_t *previous; // last row handed over, unfiltered
+  bool failed;
+
+  // Strip n lives in strips[n % strip_count] until it is written, which
+  // happens in order
+  Png_Strip *strips;
+  size_t strip_count;
+  size_t submitted;
+  size_t claimed; // by an encoder
+  size_t written;
+
+  pthread_t *threads;
+  size_t thread_count;
+  pthread_mutex_t lock;
+  pthread_cond_t queued; // a strip was submitted, or the writer is done
+  pthread_cond_t encoded;
+  bool stopping;
+} Png_Writer;
+
+// Strips of `strip_rows` rows, compressed by `threads` encoder threads
+bool png_begin(Png_Writer *png, const char *path, size_t width,
+               size_t height, size_t strip_rows, size_t threads);
+// Room for the next `strip_rows` rows of `width` pixels each, top to bottom.
+// Waits for an encoder to finish a strip if all of them are in use, and
+// writes every strip that is ready. NULL once writing failed.
+Color *png_next_strip(Png_Writer *png);
+// Hands the strip from png_next_strip() to the encoders, of which the
+// first `count` rows were filled
+void png_submit_strip(Png_Writer *png, size_t count);
+// Waits for the encoders and closes the file, fails if fewer rows than
+// `height` were submitted. Also needed after png_begin() failed.
+bool png_end(Png_Writer *png);
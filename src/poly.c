@@ -0,0 +1,300 @@
+#include "poly.h"
+#include "cse.h"
+#include "hoist.h"
+
+#include <assert.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+typedef enum {
+  POLY_UNKNOWN,
+  POLY_EXPANDED,
+  POLY_NOT_EXPANDED,
+} Poly_State;
+
+typedef struct {
+  Poly_Set *polys;
+  float t;
+  size_t slot_count;
+  // Expansion of every shared node (Node.slot), reached once per parent
+  Poly *shared;
+  size_t *shared_operations;
+  uint8_t *shared_state;
+} Poly_Expander;
+
+static void poly_constant(Poly *poly, double value) {
+  memset(poly->coefficients, 0, sizeof(poly->coefficients));
+  poly->coefficients[0][0] = value;
+}
+
+/// Highest total degree of a term, or the highest power of x only
+static size_t poly_degree(const Poly *poly, bool x_only) {
+  size_t degree = 0;
+  for (size_t i = 0; i <= POLY_MAX_DEGREE; ++i) {
+    for (size_t j = 0; i + j <= POLY_MAX_DEGREE; ++j) {
+      size_t term = x_only ? i : i + j;
+      if (poly->coefficients[i][j] != 0.0 && term > degree)
+        degree = term;
+    }
+  }
+  return degree;
+}
+
+static void poly_add(Poly *out, const Poly *lhs, const Poly *rhs) {
+  for (size_t i = 0; i <= POLY_MAX_DEGREE; ++i) {
+    for (size_t j = 0; j <= POLY_MAX_DEGREE; ++j)
+      out->coefficients[i][j] = lhs->coefficients[i][j] +
+                                rhs->coefficients[i][j];
+  }
+}
+
+/// Fails when the product would exceed POLY_MAX_DEGREE
+static bool poly_mult(Poly_Expander *pe, Poly *out, const Poly *lhs,
+                      const Poly *rhs) {
+  if (poly_degree(lhs, false) + poly_degree(rhs, false) > POLY_MAX_DEGREE) {
+    pe->polys->rejected += 1;
+    return false;
+  }
+
+  // `out` may be one of the operands
+  Poly product;
+  poly_constant(&product, 0.0);
+  for (size_t i = 0; i <= POLY_MAX_DEGREE; ++i) {
+    for (size_t j = 0; i + j <= POLY_MAX_DEGREE; ++j) {
+      if (lhs->coefficients[i][j] == 0.0)
+        continue;
+      for (size_t k = 0; i + j + k <= POLY_MAX_DEGREE; ++k) {
+        for (size_t l = 0; i + j + k + l <= POLY_MAX_DEGREE; ++l)
+          product.coefficients[i + k][j + l] +=
+              lhs->coefficients[i][j] * rhs->coefficients[k][l];
+      }
+    }
+  }
+  memcpy(out->coefficients, product.coefficients, sizeof(out->coefficients));
+  return true;
+}
+
+/// Worth expanding when it reads both x and y and stepping it takes fewer
+/// additions than the operations it replaces
+static void poly_collect(Poly_Expander *pe, Node *expr, const Poly *poly,
+                         size_t operations) {
+  bool x = expr->deps & NODE_DEP_X;
+  bool y = expr->deps & NODE_DEP_Y;
+  size_t degree_x = poly_degree(poly, true);
+  if (expr->hoisted || !x || !y || operations <= degree_x)
+    return;
+
+  // Marked right away so a node shared by several parents is collected once
+  expr->hoisted = true;
+  Poly item = *poly;
+  item.node = expr;
+  item.degree_x = degree_x;
+  da_append(pe->polys, item);
+}
+
+// Expansion of a subtree, `poly` is only valid when `expanded`
+typedef struct {
+  Poly poly;
+  size_t operations;
+  bool expanded;
+} Poly_Result;
+
+/// Expand `expr` from the expansions of its operands
+static void poly_expand_node(Poly_Expander *pe, Node *expr,
+                             Poly_Result *operands, Poly_Result *out) {
+  Node *children[3];
+  size_t children_count = node_children(expr, children);
+  bool all = true;
+  out->operations = children_count > 0;
+  for (size_t i = 0; i < children_count; ++i) {
+    all = all && operands[i].expanded;
+    out->operations += operands[i].operations;
+  }
+
+  Poly *poly = &out->poly;
+  bool result = all;
+  switch (expr->kind) {
+  case NK_X:
+    poly_constant(poly, 0.0);
+    poly->coefficients[1][0] = 1.0;
+    break;
+
+  case NK_Y:
+    poly_constant(poly, 0.0);
+    poly->coefficients[0][1] = 1.0;
+    break;
+
+  case NK_T:
+    poly_constant(poly, pe->t);
+    break;
+
+  case NK_NUMBER:
+    poly_constant(poly, expr->as.number);
+    break;
+
+  case NK_ADD:
+    if (all)
+      poly_add(poly, &operands[0].poly, &operands[1].poly);
+    break;
+
+  case NK_MULT:
+    result = all && poly_mult(pe, poly, &operands[0].poly, &operands[1].poly);
+    break;
+
+  case NK_MULT_ADD:
+    result = all && poly_mult(pe, poly, &operands[0].poly, &operands[1].poly);
+    if (result)
+      poly_add(poly, poly, &operands[2].poly);
+    break;
+
+  case NK_SQUARE:
+    result = all && poly_mult(pe, poly, &operands[0].poly, &operands[0].poly);
+    break;
+
+  case NK_BOOLEAN:
+  case NK_SQRT:
+  case NK_ABS:
+  case NK_SIN:
+  case NK_MOD:
+  case NK_GT:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_TRIPLE:
+  case NK_IF:
+    result = false;
+    break;
+
+  case NK_RULE:
+  case NK_RANDOM:
+  default:
+    UNREACHABLE_CODE("poly_expand_node");
+  }
+
+  // The largest polynomials are the operands of a node that is not one
+  if (!result) {
+    for (size_t i = 0; i < children_count; ++i) {
+      if (operands[i].expanded)
+        poly_collect(pe, children[i], &operands[i].poly,
+                     operands[i].operations);
+    }
+  }
+  out->expanded = result;
+}
+
+/// Expand `f` into `out`, false when it is not a polynomial. The polynomial
+/// operands of the nodes that are not one are collected on the way.
+static bool poly_expand(Poly_Expander *pe, Node *f, Poly *out,
+                        size_t *operations) {
+  Node_Frames frames = {0};
+  // Expansions of the operands done, in order, waiting for their parent
+  struct {
+    Poly_Result *items;
+    size_t count;
+    size_t capacity;
+  } results = {0};
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *expr = frame->node;
+    size_t slot = expr->slot <= pe->slot_count ? expr->slot : 0;
+    if (frame->next == 0 && slot > 0 &&
+        pe->shared_state[slot] != POLY_UNKNOWN) {
+      Poly_Result result = {
+          .poly = pe->shared[slot],
+          .operations = pe->shared_operations[slot],
+          .expanded = pe->shared_state[slot] == POLY_EXPANDED,
+      };
+      da_append(&results, result);
+      frames.count -= 1;
+      continue;
+    }
+
+    Node *children[3];
+    size_t children_count = node_children(expr, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+
+    Poly_Result result;
+    results.count -= children_count;
+    poly_expand_node(pe, expr, &results.items[results.count], &result);
+    if (slot > 0) {
+      pe->shared[slot] = result.poly;
+      pe->shared_operations[slot] = result.operations;
+      pe->shared_state[slot] =
+          result.expanded ? POLY_EXPANDED : POLY_NOT_EXPANDED;
+    }
+    da_append(&results, result);
+  }
+
+  Poly_Result *result = &results.items[0];
+  *out = result->poly;
+  *operations = result->operations;
+  bool expanded = result->expanded;
+  free(frames.items);
+  free(results.items);
+  return expanded;
+}
+
+void poly_nodes(Poly_Set *polys, Node *f, float t) {
+  node_deps(f);
+  Poly_Expander pe = {
+      .polys = polys,
+      .t = t,
+      .slot_count = node_slot_count(f),
+  };
+  pe.shared = malloc((pe.slot_count + 1) * sizeof(*pe.shared));
+  pe.shared_operations =
+      malloc((pe.slot_count + 1) * sizeof(*pe.shared_operations));
+  pe.shared_state = calloc(pe.slot_count + 1, sizeof(*pe.shared_state));
+  assert(pe.shared != NULL && pe.shared_operations != NULL &&
+         pe.shared_state != NULL && "Buy more RAM lol");
+
+  Poly poly;
+  size_t operations;
+  if (poly_expand(&pe, f, &poly, &operations))
+    poly_collect(&pe, f, &poly, operations);
+
+  size_t slot_count = pe.slot_count;
+  for (size_t i = 0; i < polys->count; ++i) {
+    if (polys->items[i].node->slot == 0)
+      polys->items[i].node->slot = ++slot_count;
+  }
+  free(pe.shared);
+  free(pe.shared_operations);
+  free(pe.shared_state);
+}
+
+void poly_free(Poly_Set *polys) {
+  for (size_t i = 0; i < polys->count; ++i)
+    polys->items[i].node->hoisted = false;
+  da_free(*polys);
+  memset(polys, 0, sizeof(*polys));
+}
+
+void poly_row_start(const Poly *poly, float y, float x, double step,
+                    double *deltas) {
+  size_t degree = poly->degree_x;
+  // Coefficients of the powers of x along the row
+  double row[POLY_MAX_DEGREE + 1];
+  for (size_t i = 0; i <= degree; ++i) {
+    row[i] = 0.0;
+    for (size_t j = POLY_MAX_DEGREE - i + 1; j-- > 0;)
+      row[i] = row[i] * y + poly->coefficients[i][j];
+  }
+
+  for (size_t k = 0; k <= degree; ++k) {
+    double at = x + k * step;
+    deltas[k] = 0.0;
+    for (size_t i = degree + 1; i-- > 0;)
+      deltas[k] = deltas[k] * at + row[i];
+  }
+  // deltas[k] becomes the k-th difference at `x`
+  for (size_t i = 1; i <= degree; ++i) {
+    for (size_t k = degree; k >= i; --k)
+      deltas[k] -= deltas[k - 1];
+  }
+}
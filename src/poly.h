@@ -0,0 +1,46 @@
+#pragma once
+#include "node.h"
+
+// Polynomial normal form: once t is fixed for the frame, a subtree built
+// only from add, mult, x, y, t and numbers is a polynomial in x and y.
+// Along a row it only varies with x, so its value is stepped from one pixel
+// to the next by forward differencing, which takes as many additions as its
+// degree in x however large the subtree is. The largest such subtrees that
+// read both x and y are expanded and marked `hoisted`, and the renderer
+// fills their slot for every pixel. A product whose degree would exceed
+// POLY_MAX_DEGREE is left to the engine, its operands may still be expanded.
+#define POLY_MAX_DEGREE 6
+
+typedef struct {
+  Node *node;
+  size_t degree_x; // highest power of x, additions per pixel
+  // Coefficient of x^i y^j at [i][j], zero unless i + j <= POLY_MAX_DEGREE
+  double coefficients[POLY_MAX_DEGREE + 1][POLY_MAX_DEGREE + 1];
+} Poly;
+
+typedef struct {
+  Poly *items;
+  size_t count;
+  size_t capacity;
+  size_t rejected; // products left to the engine for their degree
+} Poly_Set;
+
+// `f` must already have passed cse(), expanded nodes get a slot of their own
+// if they did not have one. Expand before hoisting, so their bodies are not
+// hoisted for nothing.
+void poly_nodes(Poly_Set *polys, Node *f, float t);
+// Also clears the `hoisted` mark of the nodes
+void poly_free(Poly_Set *polys);
+
+// Forward differences of `poly` along the row `y`, starting at `x` and
+// moving by `step` per pixel. `deltas` holds degree_x + 1 values.
+void poly_row_start(const Poly *poly, float y, float x, double step,
+                    double *deltas);
+
+// Value at the current pixel, then move the differences to the next one
+static inline float poly_row_next(double *deltas, size_t degree) {
+  float value = deltas[0];
+  for (size_t k = 0; k < degree; ++k)
+    deltas[k] += deltas[k + 1];
+  return value;
+}
@@ -0,0 +1,181 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define POOL_RANGE(first, last) ((uint64_t)(last) << 32 | (uint32_t)(first))
+#define POOL_FIRST(range) ((uint32_t)(range))
+#define POOL_LAST(range) ((uint32_t)((range) >> 32))
+
+struct Pool_Worker {
+  Pool *pool;
+  size_t worker;
+  pthread_t handle;
+};
+
+size_t pool_default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    return 1;
+  if (n > POOL_MAX_THREADS)
+    return POOL_MAX_THREADS;
+  return (size_t)n;
+}
+
+static bool pool_pop(Pool_Deque *deque, size_t *task) {
+  uint64_t range = atomic_load(&deque->range);
+  for (;;) {
+    uint32_t first = POOL_FIRST(range), last = POOL_LAST(range);
+    if (first >= last)
+      return false;
+    if (atomic_compare_exchange_weak(&deque->range, &range,
+                                     POOL_RANGE(first, last - 1))) {
+      *task = last - 1;
+      return true;
+    }
+  }
+}
+
+/// Move the front half of the fullest other range into the empty deque of
+/// `worker`. Only the owner ever refills its own deque, and nobody touches an
+/// empty range, so the plain store cannot race.
+static bool pool_steal(Pool *pool, size_t worker) {
+  for (;;) {
+    size_t victim = pool->threads;
+    uint32_t victim_size = 0;
+    for (size_t i = 1; i < pool->threads; ++i) {
+      size_t j = (worker + i) % pool->threads;
+      uint64_t range = atomic_load(&pool->deques[j].range);
+      uint32_t size = POOL_LAST(range) > POOL_FIRST(range)
+                          ? POOL_LAST(range) - POOL_FIRST(range)
+                          : 0;
+      if (size > victim_size) {
+        victim = j;
+        victim_size = size;
+      }
+    }
+    if (victim == pool->threads)
+      return false;
+
+    Pool_Deque *deque = &pool->deques[victim];
+    uint64_t range = atomic_load(&deque->range);
+    uint32_t first = POOL_FIRST(range), last = POOL_LAST(range);
+    if (first >= last)
+      continue;
+    uint32_t take = (last - first + 1) / 2;
+    if (!atomic_compare_exchange_strong(&deque->range, &range,
+                                        POOL_RANGE(first + take, last)))
+      continue;
+
+    atomic_store(&pool->deques[worker].range, POOL_RANGE(first, first + take));
+    pool->deques[worker].stolen += take;
+    return true;
+  }
+}
+
+/// Run tasks of the current batch until there is nothing left to steal
+static void pool_work(Pool *pool, size_t worker) {
+  Pool_Deque *deque = &pool->deques[worker];
+  do {
+    size_t task;
+    while (pool_pop(deque, &task)) {
+      pool->task(pool->ctx, worker, task);
+      deque->executed += 1;
+    }
+  } while (pool_steal(pool, worker));
+}
+
+static void *pool_worker(void *arg) {
+  Pool_Worker *w = arg;
+  Pool *pool = w->pool;
+  if (pool->setup)
+    pool->setup(pool->setup_ctx, w->worker);
+
+  uint64_t batch = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->batch == batch && !pool->stop)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    batch = pool->batch;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, w->worker);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy -= 1;
+    if (pool->busy == 0)
+      pthread_cond_signal(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+bool pool_init(Pool *pool, size_t threads, Pool_Setup setup, void *ctx) {
+  assert(threads > 0 && threads <= POOL_MAX_THREADS);
+  *pool = (Pool){.setup = setup, .setup_ctx = ctx};
+  pool->deques = aligned_alloc(_Alignof(Pool_Deque),
+                               threads * sizeof(*pool->deques));
+  pool->workers = malloc(threads * sizeof(*pool->workers));
+  assert(pool->deques != NULL && pool->workers != NULL && "Buy more RAM lol");
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  // Workers only look at `threads` once a batch starts
+  size_t started = 0;
+  for (; started < threads; ++started) {
+    Pool_Worker *w = &pool->workers[started];
+    *w = (Pool_Worker){.pool = pool, .worker = started};
+    if (pthread_create(&w->handle, NULL, pool_worker, w) != 0)
+      break;
+  }
+  pool->threads = started;
+  return started == threads;
+}
+
+void pool_run(Pool *pool, size_t task_count, Pool_Task task, void *ctx) {
+  assert(pool->threads > 0);
+  assert(task_count <= UINT32_MAX);
+
+  pool->task = task;
+  pool->ctx = ctx;
+  for (size_t i = 0; i < pool->threads; ++i) {
+    size_t first = task_count * i / pool->threads;
+    size_t last = task_count * (i + 1) / pool->threads;
+    atomic_init(&pool->deques[i].range, POOL_RANGE(first, last));
+    pool->deques[i].executed = 0;
+    pool->deques[i].stolen = 0;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->batch += 1;
+  pool->busy = pool->threads;
+  pthread_cond_broadcast(&pool->wake);
+  while (pool->busy > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(Pool *pool) {
+  if (pool->workers == NULL)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->threads; ++i)
+    pthread_join(pool->workers[i].handle, NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  free(pool->deques);
+  free(pool->workers);
+  *pool = (Pool){0};
+}
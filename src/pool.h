@@ -0,0 +1,57 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Work-stealing pool for a fixed batch of independent tasks (the tiles of an
+// image). Tasks are numbered 0..<task_count and dealt out as contiguous
+// ranges, one per worker, so neighbouring tiles stay on the same thread.
+// A worker pops from the back of its own range, and once it runs dry it
+// steals the front half of the fullest range it finds. Every range is a
+// single atomic word, so neither pop nor steal takes a lock.
+// The workers are started once and wait between batches, so rendering an
+// image a strip at a time does not pay for a thread per strip.
+#define POOL_MAX_THREADS 256
+
+// Called with the index of the worker running it, so per-thread scratch
+// memory can be looked up without any shared mutable state
+typedef void (*Pool_Task)(void *ctx, size_t worker, size_t task);
+// Called once on every worker thread before its first task, e.g. to set up
+// its floating point environment
+typedef void (*Pool_Setup)(void *ctx, size_t worker);
+
+typedef struct {
+  // Low 32 bits hold the first task, high 32 bits one past the last one
+  _Alignas(64) _Atomic uint64_t range;
+  size_t executed;
+  size_t stolen;
+} Pool_Deque;
+
+typedef struct Pool_Worker Pool_Worker;
+
+typedef struct {
+  Pool_Deque *deques;
+  size_t threads; // workers actually running
+  Pool_Worker *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // a new batch, or the pool stops
+  pthread_cond_t done; // the last worker finished the batch
+  uint64_t batch;      // batches started so far
+  size_t busy;         // workers still on the current batch
+  bool stop;
+  Pool_Setup setup;
+  void *setup_ctx;
+  Pool_Task task;
+  void *ctx;
+} Pool;
+
+size_t pool_default_threads(void);
+// Starts `threads` workers and runs `setup` on each of them, false when not
+// all of them could be started. The pool can be used as long as at least one
+// was (`threads` > 0) and must be freed either way.
+bool pool_init(Pool *pool, size_t threads, Pool_Setup setup, void *ctx);
+// Runs every task once on the workers and waits for all of them
+void pool_run(Pool *pool, size_t task_count, Pool_Task task, void *ctx);
+void pool_free(Pool *pool);
@@ -0,0 +1,128 @@
+#include "raw.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+const char *raw_format_names[COUNT_RAW_FORMATS] = {
+    [RAW_PPM] = "ppm",
+    [RAW_PAM] = "pam",
+    [RAW_RGB] = "rgb",
+};
+
+int raw_stdout(void) {
+  fflush(stdout);
+  int fd = dup(STDOUT_FILENO);
+  if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+    nob_log(ERROR, "Could not take over stdout: %s", strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool raw_begin(Raw_Writer *raw, int fd, Raw_Format format, size_t width,
+               size_t height) {
+  *raw = (Raw_Writer){
+      .fd = fd,
+      .format = format,
+      .width = width,
+      .height = height,
+  };
+  if (fd < 0)
+    return false;
+
+  int size = 0;
+  switch (format) {
+  case RAW_PPM:
+    size = snprintf(raw->header, sizeof(raw->header), "P6\n%zu %zu\n255\n",
+                    width, height);
+    break;
+  case RAW_PAM:
+    size = snprintf(raw->header, sizeof(raw->header),
+                    "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH 4\nMAXVAL 255\n"
+                    "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+                    width, height);
+    break;
+  case RAW_RGB:
+  case COUNT_RAW_FORMATS:
+  default:
+    break;
+  }
+  assert(size >= 0 && (size_t)size < sizeof(raw->header));
+  raw->header_size = size;
+  return true;
+}
+
+/// writev() until everything is out, pipes take only part of it at times
+static bool raw_writev(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      nob_log(ERROR, "Could not write the image: %s", strerror(errno));
+      return false;
+    }
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+bool raw_write_rows(Raw_Writer *raw, const Color *pixels, size_t count) {
+  assert(raw->rows + count <= raw->height);
+  size_t n = raw->width * count;
+  struct iovec iov[2];
+  int iov_count = 0;
+  if (raw->rows == 0 && raw->header_size > 0)
+    iov[iov_count++] = (struct iovec){raw->header, raw->header_size};
+
+  if (raw->format == RAW_PAM) {
+    iov[iov_count++] = (struct iovec){(void *)pixels, n * sizeof(*pixels)};
+  } else {
+    if (3 * n > raw->packed_capacity) {
+      raw->packed = realloc(raw->packed, 3 * n);
+      assert(raw->packed != NULL && "Buy more RAM lol");
+      raw->packed_capacity = 3 * n;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      raw->packed[3 * i + 0] = pixels[i].r;
+      raw->packed[3 * i + 1] = pixels[i].g;
+      raw->packed[3 * i + 2] = pixels[i].b;
+    }
+    iov[iov_count++] = (struct iovec){raw->packed, 3 * n};
+  }
+  raw->rows += count;
+  return raw_writev(raw->fd, iov, iov_count);
+}
+
+bool raw_end(Raw_Writer *raw) {
+  bool ok = raw->fd >= 0;
+  if (ok && raw->rows != raw->height) {
+    nob_log(ERROR, "Image got %zu of its %zu rows", raw->rows, raw->height);
+    ok = false;
+  }
+  if (raw->fd >= 0 && close(raw->fd) != 0 && ok) {
+    nob_log(ERROR, "Could not write the image: %s", strerror(errno));
+    ok = false;
+  }
+  free(raw->packed);
+  *raw = (Raw_Writer){.fd = -1};
+  return ok;
+}
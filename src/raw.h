@@ -0,0 +1,45 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/raylib/raylib-5.5_linux_amd64/include/raylib.h"
+
+// Uncompressed images for pipes into ffmpeg or ImageMagick, written with
+// writev() as the rows come:
+// - ppm: binary PPM (P6), RGB
+// - pam: PAM (P7) with RGB_ALPHA tuples, the rendered pixels exactly as
+//   they are in memory, so the rows go out without being copied
+// - rgb: headerless RGB, ffmpeg's rgb24 and ImageMagick's rgb:
+// PPM and RGB have no alpha, so each batch of rows is packed first.
+typedef enum {
+  RAW_PPM,
+  RAW_PAM,
+  RAW_RGB,
+  COUNT_RAW_FORMATS,
+} Raw_Format;
+
+extern const char *raw_format_names[COUNT_RAW_FORMATS];
+
+typedef struct {
+  int fd;
+  Raw_Format format;
+  size_t width;
+  size_t height;
+  size_t rows; // written so far
+  char header[128]; // goes out with the first rows
+  size_t header_size;
+  uint8_t *packed;
+  size_t packed_capacity;
+} Raw_Writer;
+
+// Points stdout at stderr, so printed functions and logs cannot end up in
+// the image, and returns a descriptor of the original stdout to write it to
+int raw_stdout(void);
+// Takes over `fd`, -1 when it could not be opened
+bool raw_begin(Raw_Writer *raw, int fd, Raw_Format format, size_t width,
+               size_t height);
+// `count` rows of `width` pixels each, top to bottom, in one writev()
+bool raw_write_rows(Raw_Writer *raw, const Color *pixels, size_t count);
+// Also closes the descriptor, fails if fewer rows than `height` were written
+bool raw_end(Raw_Writer *raw);
@@ -0,0 +1,48 @@
+#pragma once
+#include "cost.h"
+#include "node.h"
+#include "simd.h"
+
+typedef enum {
+  ENGINE_TREE, // recursive tree walking interpreter
+  ENGINE_VM,   // postorder bytecode on a stack VM (vm.h)
+  ENGINE_REG,  // Sethi-Ullman ordered code on a register VM (vm.h)
+  ENGINE_SPAN, // every node over a whole row at once (span.h)
+  ENGINE_JIT,  // register program compiled to x86-64 machine code (jit.h)
+  ENGINE_AOT,  // C row kernel built by the local compiler (aot.h)
+  COUNT_ENGINES,
+} Render_Engine;
+
+typedef struct {
+  Render_Engine engine;
+  Simd_Isa simd; // kernels of the span engine
+  size_t threads; // workers rendering the tiles of the image
+  Math_Tier math; // accuracy of sin in every engine
+  bool poly;      // step polynomial subtrees along the rows (poly.h)
+  bool ftz;       // flush subnormals to zero on every worker (mathlib.h)
+  bool no_interval; // evaluate every tile, even one its bounds prove flat
+  bool count_subnormals; // log how many pixels read or produced one
+} Render_Options;
+
+bool render_pixels(Image image, Node *f, Render_Options options);
+
+// A render of `f` at any size set up once, then rendered a strip of rows at
+// a time, so only the strip has to be in memory. NULL if it cannot be set
+// up.
+typedef struct Render_Context Render_Context;
+Render_Context *render_begin(Node *f, size_t width, size_t height,
+                             Render_Options options);
+// Rows y..<y + rows into `pixels`, which holds `rows` rows of the width
+void render_rows(Render_Context *ctx, Color *pixels, size_t y, size_t rows);
+// Logs what the strips took together
+void render_end(Render_Context *ctx);
+// Render `f` again on the precise path and log how far `image` is off
+bool render_math_report(Image image, Node *f, Render_Options options);
+// Render `f` again with flush-to-zero flipped and once more counting the
+// pixels that meet subnormals, then log both times and how far they are off.
+// `seconds` is how long `image` took.
+bool render_ftz_report(Image image, double seconds, Node *f,
+                       Render_Options options);
+// Measure the cost of every kind (cost.h) with the engine and options of
+// `options`
+bool render_calibrate(Cost_Table *table, Render_Options options);
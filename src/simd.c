@@ -0,0 +1,253 @@
+#include "simd.h"
+
+const char *simd_isa_names[COUNT_SIMD_ISAS] = {
+    [SIMD_AUTO] = "auto",   [SIMD_SCALAR] = "scalar", [SIMD_SSE42] = "sse4.2",
+    [SIMD_AVX2] = "avx2",   [SIMD_AVX512] = "avx512",
+};
+
+// SCALAR
+// Exactly the operations of the tree walker, vectorized only where the
+// compiler manages to
+#define SCALAR_UNOP(name, kind)                                                \
+  static void name(float *dst, size_t n) {                                     \
+    for (size_t i = 0; i < n; ++i)                                             \
+      dst[i] = UNOP_MAPPER(kind, dst[i]);                                      \
+  }
+#define SCALAR_BINOP(name, kind)                                               \
+  static void name(float *dst, const float *rhs, size_t n) {                   \
+    for (size_t i = 0; i < n; ++i)                                             \
+      dst[i] = BINOP_MAPPER(kind, dst[i], rhs[i]);                             \
+  }
+SCALAR_UNOP(span_sqrt_scalar, NK_SQRT)
+SCALAR_UNOP(span_abs_scalar, NK_ABS)
+SCALAR_UNOP(span_sin_scalar, NK_SIN)
+#define SCALAR_MATH_UNOP(name, func)                                           \
+  static void name(float *dst, size_t n) {                                     \
+    for (size_t i = 0; i < n; ++i)                                             \
+      dst[i] = func(dst[i]);                                                   \
+  }
+SCALAR_MATH_UNOP(span_sin_fast_scalar, math_sin_fast)
+SCALAR_MATH_UNOP(span_sin_rough_scalar, math_sin_rough)
+SCALAR_BINOP(span_add_scalar, NK_ADD)
+SCALAR_BINOP(span_mult_scalar, NK_MULT)
+SCALAR_BINOP(span_mod_scalar, NK_MOD)
+SCALAR_BINOP(span_gt_scalar, NK_GT)
+
+static void span_select_scalar(float *dst, const float *cond,
+                               const float *elze, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = cond[i] ? dst[i] : elze[i];
+}
+
+#define SCALAR_KERNELS(math_tier, sin_kernel)                                  \
+  {                                                                            \
+      .isa = SIMD_SCALAR,                                                      \
+      .tier = (math_tier),                                                     \
+      .sqrt = span_sqrt_scalar,                                                \
+      .abs = span_abs_scalar,                                                  \
+      .sin = (sin_kernel),                                                     \
+      .add = span_add_scalar,                                                  \
+      .mult = span_mult_scalar,                                                \
+      .mod = span_mod_scalar,                                                  \
+      .gt = span_gt_scalar,                                                    \
+      .select = span_select_scalar,                                            \
+  }
+static const Span_Kernels span_kernels_scalar[COUNT_MATH_TIERS] = {
+    [MATH_PRECISE] = SCALAR_KERNELS(MATH_PRECISE, span_sin_scalar),
+    [MATH_FAST] = SCALAR_KERNELS(MATH_FAST, span_sin_fast_scalar),
+    [MATH_ROUGH] = SCALAR_KERNELS(MATH_ROUGH, span_sin_rough_scalar),
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// SSE4.2: 4 lanes
+#define SIMD_ISA SIMD_SSE42
+#define SIMD_SUFFIX sse42
+#define SIMD_ATTR __attribute__((target("sse4.2")))
+#define SIMD_WIDTH 4
+#define SIMD_HAS_FMA 0
+#define V __m128
+#define V_INT __m128i
+#define V_LOAD(p) _mm_loadu_ps(p)
+#define V_STORE(p, v) _mm_storeu_ps((p), (v))
+#define V_SET1(f) _mm_set1_ps(f)
+#define V_ADD(a, b) _mm_add_ps((a), (b))
+#define V_SUB(a, b) _mm_sub_ps((a), (b))
+#define V_MUL(a, b) _mm_mul_ps((a), (b))
+#define V_DIV(a, b) _mm_div_ps((a), (b))
+#define V_FMADD(a, b, c) _mm_add_ps(_mm_mul_ps((a), (b)), (c))
+#define V_FNMADD(a, b, c) _mm_sub_ps((c), _mm_mul_ps((a), (b)))
+#define V_SQRT(a) _mm_sqrt_ps(a)
+#define V_ABS(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), (a))
+#define V_OR(a, b) _mm_or_ps((a), (b))
+#define V_XOR(a, b) _mm_xor_ps((a), (b))
+#define V_ROUND(a)                                                             \
+  _mm_round_ps((a), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define V_TRUNC(a) _mm_round_ps((a), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#define V_MASK __m128
+#define V_GT(a, b) _mm_cmpgt_ps((a), (b))
+#define V_LT(a, b) _mm_cmplt_ps((a), (b))
+#define V_GE(a, b) _mm_cmpge_ps((a), (b))
+#define V_NOT_LT(a, b) _mm_cmpnlt_ps((a), (b))
+#define V_NEQ(a, b) _mm_cmpneq_ps((a), (b))
+#define V_ANY(m) (_mm_movemask_ps(m) != 0)
+#define V_SELECT(m, a, b) _mm_blendv_ps((b), (a), (m))
+#define V_CVT_INT(a) _mm_cvtps_epi32(a)
+#define V_CAST_FLOAT(i) _mm_castsi128_ps(i)
+#define V_INT_SET1(k) _mm_set1_epi32(k)
+#define V_INT_AND(a, b) _mm_and_si128((a), (b))
+#define V_INT_SLLI(a, k) _mm_slli_epi32((a), (k))
+#define V_INT_TEST(a, k)                                                       \
+  _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128((a), _mm_set1_epi32(k)),      \
+                                   _mm_set1_epi32(k)))
+#include "simd_kernels.h"
+
+// AVX2 + FMA: 8 lanes
+#define SIMD_ISA SIMD_AVX2
+#define SIMD_SUFFIX avx2
+#define SIMD_ATTR __attribute__((target("avx2,fma")))
+#define SIMD_WIDTH 8
+#define SIMD_HAS_FMA 1
+#define V __m256
+#define V_INT __m256i
+#define V_LOAD(p) _mm256_loadu_ps(p)
+#define V_STORE(p, v) _mm256_storeu_ps((p), (v))
+#define V_SET1(f) _mm256_set1_ps(f)
+#define V_ADD(a, b) _mm256_add_ps((a), (b))
+#define V_SUB(a, b) _mm256_sub_ps((a), (b))
+#define V_MUL(a, b) _mm256_mul_ps((a), (b))
+#define V_DIV(a, b) _mm256_div_ps((a), (b))
+#define V_FMADD(a, b, c) _mm256_fmadd_ps((a), (b), (c))
+#define V_FNMADD(a, b, c) _mm256_fnmadd_ps((a), (b), (c))
+#define V_SQRT(a) _mm256_sqrt_ps(a)
+#define V_ABS(a) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), (a))
+#define V_OR(a, b) _mm256_or_ps((a), (b))
+#define V_XOR(a, b) _mm256_xor_ps((a), (b))
+#define V_ROUND(a)                                                             \
+  _mm256_round_ps((a), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define V_TRUNC(a) _mm256_round_ps((a), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#define V_MASK __m256
+#define V_GT(a, b) _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
+#define V_LT(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define V_GE(a, b) _mm256_cmp_ps((a), (b), _CMP_GE_OQ)
+#define V_NOT_LT(a, b) _mm256_cmp_ps((a), (b), _CMP_NLT_UQ)
+#define V_NEQ(a, b) _mm256_cmp_ps((a), (b), _CMP_NEQ_UQ)
+#define V_ANY(m) (_mm256_movemask_ps(m) != 0)
+#define V_SELECT(m, a, b) _mm256_blendv_ps((b), (a), (m))
+#define V_CVT_INT(a) _mm256_cvtps_epi32(a)
+#define V_CAST_FLOAT(i) _mm256_castsi256_ps(i)
+#define V_INT_SET1(k) _mm256_set1_epi32(k)
+#define V_INT_AND(a, b) _mm256_and_si256((a), (b))
+#define V_INT_SLLI(a, k) _mm256_slli_epi32((a), (k))
+#define V_INT_TEST(a, k)                                                       \
+  _mm256_castsi256_ps(_mm256_cmpeq_epi32(                                      \
+      _mm256_and_si256((a), _mm256_set1_epi32(k)), _mm256_set1_epi32(k)))
+#include "simd_kernels.h"
+
+// AVX-512F: 16 lanes, comparisons produce mask registers
+#define SIMD_ISA SIMD_AVX512
+#define SIMD_SUFFIX avx512
+#define SIMD_ATTR __attribute__((target("avx512f")))
+#define SIMD_WIDTH 16
+#define SIMD_HAS_FMA 1
+#define V __m512
+#define V_INT __m512i
+#define V_LOAD(p) _mm512_loadu_ps(p)
+#define V_STORE(p, v) _mm512_storeu_ps((p), (v))
+#define V_SET1(f) _mm512_set1_ps(f)
+#define V_ADD(a, b) _mm512_add_ps((a), (b))
+#define V_SUB(a, b) _mm512_sub_ps((a), (b))
+#define V_MUL(a, b) _mm512_mul_ps((a), (b))
+#define V_DIV(a, b) _mm512_div_ps((a), (b))
+#define V_FMADD(a, b, c) _mm512_fmadd_ps((a), (b), (c))
+#define V_FNMADD(a, b, c) _mm512_fnmadd_ps((a), (b), (c))
+#define V_SQRT(a) _mm512_sqrt_ps(a)
+#define V_ABS(a) _mm512_abs_ps(a)
+#define V_OR(a, b)                                                             \
+  _mm512_castsi512_ps(                                                         \
+      _mm512_or_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)))
+#define V_XOR(a, b)                                                            \
+  _mm512_castsi512_ps(                                                         \
+      _mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)))
+#define V_ROUND(a)                                                             \
+  _mm512_roundscale_ps((a), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define V_TRUNC(a)                                                             \
+  _mm512_roundscale_ps((a), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#define V_MASK __mmask16
+#define V_GT(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GT_OQ)
+#define V_LT(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_LT_OQ)
+#define V_GE(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GE_OQ)
+#define V_NOT_LT(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_NLT_UQ)
+#define V_NEQ(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_NEQ_UQ)
+#define V_ANY(m) ((m) != 0)
+#define V_SELECT(m, a, b) _mm512_mask_blend_ps((m), (b), (a))
+#define V_CVT_INT(a) _mm512_cvtps_epi32(a)
+#define V_CAST_FLOAT(i) _mm512_castsi512_ps(i)
+#define V_INT_SET1(k) _mm512_set1_epi32(k)
+#define V_INT_AND(a, b) _mm512_and_si512((a), (b))
+#define V_INT_SLLI(a, k) _mm512_slli_epi32((a), (k))
+#define V_INT_TEST(a, k) _mm512_test_epi32_mask((a), _mm512_set1_epi32(k))
+#include "simd_kernels.h"
+#endif // x86
+
+/// Ask cpuid whether the host can run the kernels of `isa`
+bool simd_isa_supported(Simd_Isa isa) {
+  switch (isa) {
+  case SIMD_AUTO:
+  case SIMD_SCALAR:
+    return true;
+#if defined(__x86_64__) || defined(__i386__)
+  case SIMD_SSE42:
+    return __builtin_cpu_supports("sse4.2");
+  case SIMD_AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  case SIMD_AVX512:
+    return __builtin_cpu_supports("avx512f");
+#else
+  case SIMD_SSE42:
+  case SIMD_AVX2:
+  case SIMD_AVX512:
+    return false;
+#endif
+  case COUNT_SIMD_ISAS:
+  default:
+    UNREACHABLE_CODE("simd_isa_supported");
+  }
+}
+
+Simd_Isa simd_detect_isa(void) {
+  for (Simd_Isa isa = COUNT_SIMD_ISAS - 1; isa > SIMD_SCALAR; --isa) {
+    if (simd_isa_supported(isa))
+      return isa;
+  }
+  return SIMD_SCALAR;
+}
+
+const Span_Kernels *span_kernels(Simd_Isa isa, Math_Tier tier) {
+  assert(tier < COUNT_MATH_TIERS);
+  if (isa == SIMD_AUTO)
+    isa = simd_detect_isa();
+
+  switch (isa) {
+  case SIMD_SCALAR:
+    return &span_kernels_scalar[tier];
+#if defined(__x86_64__) || defined(__i386__)
+  case SIMD_SSE42:
+    return &span_kernels_sse42[tier];
+  case SIMD_AVX2:
+    return &span_kernels_avx2[tier];
+  case SIMD_AVX512:
+    return &span_kernels_avx512[tier];
+#else
+  case SIMD_SSE42:
+  case SIMD_AVX2:
+  case SIMD_AVX512:
+    return NULL;
+#endif
+  case SIMD_AUTO:
+  case COUNT_SIMD_ISAS:
+  default:
+    UNREACHABLE_CODE("span_kernels");
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "node.h"
+
+// Span kernels: one function per operation, applied in place over a span
+// buffer. Every buffer must be padded to a multiple of SIMD_MAX_WIDTH floats
+// because the vector kernels always process whole vectors.
+#define SIMD_MAX_WIDTH 16
+
+typedef enum {
+  SIMD_AUTO, // best ISA the CPU supports
+  SIMD_SCALAR,
+  SIMD_SSE42,
+  SIMD_AVX2,
+  SIMD_AVX512,
+  COUNT_SIMD_ISAS,
+} Simd_Isa;
+
+typedef void (*Span_Unop_Kernel)(float *dst, size_t n);
+typedef void (*Span_Binop_Kernel)(float *dst, const float *rhs, size_t n);
+// dst = cond ? dst : elze
+typedef void (*Span_Select_Kernel)(float *dst, const float *cond,
+                                   const float *elze, size_t n);
+
+// The tiers of an ISA only differ in their sin kernel: libm per lane for
+// MATH_PRECISE, the polynomials of the math layer in vector form otherwise
+typedef struct {
+  Simd_Isa isa;
+  Math_Tier tier;
+  Span_Unop_Kernel sqrt;
+  Span_Unop_Kernel abs;
+  Span_Unop_Kernel sin;
+  Span_Binop_Kernel add;
+  Span_Binop_Kernel mult;
+  Span_Binop_Kernel mod;
+  Span_Binop_Kernel gt;
+  Span_Select_Kernel select;
+} Span_Kernels;
+
+extern const char *simd_isa_names[COUNT_SIMD_ISAS];
+
+bool simd_isa_supported(Simd_Isa isa);
+Simd_Isa simd_detect_isa(void);
+const Span_Kernels *span_kernels(Simd_Isa isa, Math_Tier tier);
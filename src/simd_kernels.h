@@ -0,0 +1,214 @@
+// Vector span kernels, included once per ISA by simd.c with the SIMD_* and V_*
+// macros describing that ISA. Not a standalone header.
+
+#define SIMD_CONCAT_(a, b) a##_##b
+#define SIMD_CONCAT(a, b) SIMD_CONCAT_(a, b)
+#define SIMD_FN(name) SIMD_CONCAT(name, SIMD_SUFFIX)
+
+// Past MATH_SIN_REDUCTION_LIMIT the range reduction of sin loses precision
+// and the lane falls back to libm. Same for mod with quotients that do not
+// fit into the float mantissa.
+#define SIMD_MOD_QUOTIENT_LIMIT 8388608.0f
+
+SIMD_ATTR static void SIMD_FN(span_sqrt)(float *dst, size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH)
+    V_STORE(dst + i, V_SQRT(V_LOAD(dst + i)));
+}
+
+SIMD_ATTR static void SIMD_FN(span_abs)(float *dst, size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH)
+    V_STORE(dst + i, V_ABS(V_LOAD(dst + i)));
+}
+
+// math_sin_fast(): sin(x) = ±sin(r) or ±cos(r) with x = j*pi/2 + r and
+// |r| <= pi/4 (Cephes)
+SIMD_ATTR static void SIMD_FN(span_sin_fast)(float *dst, size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH) {
+    V x = V_LOAD(dst + i);
+    V j = V_ROUND(V_MUL(x, V_SET1(0.63661977236758134f)));
+    V r = V_FNMADD(j, V_SET1(1.5703125f), x);
+    r = V_FNMADD(j, V_SET1(4.837512969970703125e-4f), r);
+    r = V_FNMADD(j, V_SET1(7.54978995489188216e-8f), r);
+    V r2 = V_MUL(r, r);
+
+    V s = V_FMADD(r2, V_SET1(-1.9515295891e-4f), V_SET1(8.3321608736e-3f));
+    s = V_FMADD(s, r2, V_SET1(-1.6666654611e-1f));
+    s = V_FMADD(V_MUL(s, r2), r, r);
+
+    V c = V_FMADD(r2, V_SET1(2.443315711809948e-5f),
+                  V_SET1(-1.388731625493765e-3f));
+    c = V_FMADD(c, r2, V_SET1(4.166664568298827e-2f));
+    c = V_FMADD(V_MUL(c, r2), r2, V_FNMADD(V_SET1(0.5f), r2, V_SET1(1.0f)));
+
+    V_INT q = V_CVT_INT(j);
+    V result = V_SELECT(V_INT_TEST(q, 1), c, s);
+    result = V_XOR(result, V_CAST_FLOAT(V_INT_SLLI(
+                               V_INT_AND(q, V_INT_SET1(2)), 30)));
+    V_STORE(dst + i, result);
+
+    if (V_ANY(V_GT(V_ABS(x), V_SET1(MATH_SIN_REDUCTION_LIMIT)))) {
+      float xs[SIMD_WIDTH];
+      V_STORE(xs, x);
+      for (size_t k = 0; k < SIMD_WIDTH && i + k < n; ++k) {
+        if (fabsf(xs[k]) > MATH_SIN_REDUCTION_LIMIT)
+          dst[i + k] = UNOP_MAPPER(NK_SIN, xs[k]);
+      }
+    }
+  }
+}
+
+// math_sin_rough(): sin(x) = ±sin(r) with x = j*pi + r and |r| <= pi/2
+SIMD_ATTR static void SIMD_FN(span_sin_rough)(float *dst, size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH) {
+    V x = V_LOAD(dst + i);
+    V j = V_ROUND(V_MUL(x, V_SET1(0.31830988618379067f)));
+    V r = V_FNMADD(j, V_SET1(3.140625f), x);
+    r = V_FNMADD(j, V_SET1(9.676535897931e-4f), r);
+    V r2 = V_MUL(r, r);
+
+    V s = V_FMADD(r2, V_SET1(7.61e-3f), V_SET1(-1.6605e-1f));
+    s = V_FMADD(V_MUL(s, r2), r, r);
+
+    V_INT q = V_CVT_INT(j);
+    V result = V_XOR(s, V_CAST_FLOAT(V_INT_SLLI(V_INT_AND(q, V_INT_SET1(1)),
+                                                31)));
+    V_STORE(dst + i, result);
+
+    if (V_ANY(V_GT(V_ABS(x), V_SET1(MATH_SIN_REDUCTION_LIMIT)))) {
+      float xs[SIMD_WIDTH];
+      V_STORE(xs, x);
+      for (size_t k = 0; k < SIMD_WIDTH && i + k < n; ++k) {
+        if (fabsf(xs[k]) > MATH_SIN_REDUCTION_LIMIT)
+          dst[i + k] = UNOP_MAPPER(NK_SIN, xs[k]);
+      }
+    }
+  }
+}
+
+SIMD_ATTR static void SIMD_FN(span_add)(float *dst, const float *rhs,
+                                        size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH)
+    V_STORE(dst + i, V_ADD(V_LOAD(dst + i), V_LOAD(rhs + i)));
+}
+
+SIMD_ATTR static void SIMD_FN(span_mult)(float *dst, const float *rhs,
+                                         size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH)
+    V_STORE(dst + i, V_MUL(V_LOAD(dst + i), V_LOAD(rhs + i)));
+}
+
+#if SIMD_HAS_FMA
+// fmodf(a, b) = sign(a) * (|a| - trunc(|a|/|b|) * |b|), the product is exact
+// thanks to the fused multiply-add and an off-by-one quotient is corrected
+SIMD_ATTR static void SIMD_FN(span_mod)(float *dst, const float *rhs,
+                                        size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH) {
+    V a = V_LOAD(dst + i);
+    V b = V_ABS(V_LOAD(rhs + i));
+    V abs_a = V_ABS(a);
+    V q = V_TRUNC(V_DIV(abs_a, b));
+    V r = V_FNMADD(q, b, abs_a);
+    r = V_SELECT(V_LT(r, V_SET1(0.0f)), V_ADD(r, b), r);
+    r = V_SELECT(V_GE(r, b), V_SUB(r, b), r);
+    V_STORE(dst + i, V_OR(r, V_XOR(a, abs_a)));
+
+    if (V_ANY(V_NOT_LT(q, V_SET1(SIMD_MOD_QUOTIENT_LIMIT)))) {
+      float as[SIMD_WIDTH], qs[SIMD_WIDTH];
+      V_STORE(as, a);
+      V_STORE(qs, q);
+      for (size_t k = 0; k < SIMD_WIDTH && i + k < n; ++k) {
+        if (!(qs[k] < SIMD_MOD_QUOTIENT_LIMIT))
+          dst[i + k] = BINOP_MAPPER(NK_MOD, as[k], rhs[i + k]);
+      }
+    }
+  }
+}
+#else
+// Without a fused multiply-add the remainder can not be computed exactly
+SIMD_ATTR static void SIMD_FN(span_mod)(float *dst, const float *rhs,
+                                        size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = BINOP_MAPPER(NK_MOD, dst[i], rhs[i]);
+}
+#endif
+
+SIMD_ATTR static void SIMD_FN(span_gt)(float *dst, const float *rhs,
+                                       size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH) {
+    V gt = V_SELECT(V_GT(V_LOAD(dst + i), V_LOAD(rhs + i)), V_SET1(1.0f),
+                    V_SET1(0.0f));
+    V_STORE(dst + i, gt);
+  }
+}
+
+SIMD_ATTR static void SIMD_FN(span_select)(float *dst, const float *cond,
+                                           const float *elze, size_t n) {
+  for (size_t i = 0; i < n; i += SIMD_WIDTH) {
+    V picked = V_SELECT(V_NEQ(V_LOAD(cond + i), V_SET1(0.0f)),
+                        V_LOAD(dst + i), V_LOAD(elze + i));
+    V_STORE(dst + i, picked);
+  }
+}
+
+#define SIMD_KERNELS(math_tier, sin_kernel)                                    \
+  {                                                                            \
+      .isa = SIMD_ISA,                                                         \
+      .tier = (math_tier),                                                     \
+      .sqrt = SIMD_FN(span_sqrt),                                              \
+      .abs = SIMD_FN(span_abs),                                                \
+      .sin = (sin_kernel),                                                     \
+      .add = SIMD_FN(span_add),                                                \
+      .mult = SIMD_FN(span_mult),                                              \
+      .mod = SIMD_FN(span_mod),                                                \
+      .gt = SIMD_FN(span_gt),                                                  \
+      .select = SIMD_FN(span_select),                                          \
+  }
+static const Span_Kernels SIMD_FN(span_kernels)[COUNT_MATH_TIERS] = {
+    [MATH_PRECISE] = SIMD_KERNELS(MATH_PRECISE, span_sin_scalar),
+    [MATH_FAST] = SIMD_KERNELS(MATH_FAST, SIMD_FN(span_sin_fast)),
+    [MATH_ROUGH] = SIMD_KERNELS(MATH_ROUGH, SIMD_FN(span_sin_rough)),
+};
+
+#undef SIMD_CONCAT_
+#undef SIMD_CONCAT
+#undef SIMD_FN
+#undef SIMD_MOD_QUOTIENT_LIMIT
+#undef SIMD_KERNELS
+
+// The ISA description is consumed, so the next ISA can define its own
+#undef SIMD_ISA
+#undef SIMD_SUFFIX
+#undef SIMD_ATTR
+#undef SIMD_WIDTH
+#undef SIMD_HAS_FMA
+#undef V
+#undef V_INT
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_FMADD
+#undef V_FNMADD
+#undef V_SQRT
+#undef V_ABS
+#undef V_OR
+#undef V_XOR
+#undef V_ROUND
+#undef V_TRUNC
+#undef V_MASK
+#undef V_GT
+#undef V_LT
+#undef V_GE
+#undef V_NOT_LT
+#undef V_NEQ
+#undef V_ANY
+#undef V_SELECT
+#undef V_CVT_INT
+#undef V_CAST_FLOAT
+#undef V_INT_SET1
+#undef V_INT_AND
+#undef V_INT_SLLI
+#undef V_INT_TEST
@@ -0,0 +1,295 @@
+#include "span.h"
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+void span_arena_init(Span_Arena *arena, size_t capacity) {
+  arena->items = calloc(capacity, sizeof(*arena->items));
+  assert(arena->items != NULL && "Buy more RAM lol");
+  arena->count = 0;
+  arena->capacity = capacity;
+}
+
+void span_arena_free(Span_Arena *arena) {
+  free(arena->items);
+  memset(arena, 0, sizeof(*arena));
+}
+
+static float *span_alloc(Span *span) {
+  Span_Arena *arena = span->arena;
+  size_t stride = span_stride(span->count);
+  assert(arena->count + stride <= arena->capacity &&
+         "Span arena is exhausted, check span_buffers_needed() first");
+  float *buffer = &arena->items[arena->count];
+  arena->count += stride;
+  return buffer;
+}
+
+/// Amount of scratch buffers eval_span() allocates at most for `expr`, on top
+/// of the result buffers provided by the caller
+size_t span_buffers_needed(Node *expr) {
+  Node_Frames frames = {0};
+  // Needs of the operands done, in order, waiting for their parent
+  struct {
+    size_t *items;
+    size_t count;
+    size_t capacity;
+  } needs = {0};
+  node_frames_push(&frames, expr);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *node = frame->node;
+    Node *children[3];
+    size_t children_count = node_children(node, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+
+    // Buffers held while each operand is evaluated
+    size_t held[3] = {0};
+    switch (node->kind) {
+    case NK_X:
+    case NK_Y:
+    case NK_T:
+    case NK_NUMBER:
+    case NK_BOOLEAN:
+    case NK_SQRT:
+    case NK_ABS:
+    case NK_SIN:
+    case NK_TRIPLE:
+      break;
+
+    case NK_ADD:
+    case NK_MULT:
+    case NK_MOD:
+    case NK_GT:
+      held[1] = 1;
+      break;
+
+    case NK_IF:
+      held[0] = 1;
+      held[1] = 1;
+      held[2] = 4;
+      break;
+
+    case NK_RULE:
+    case NK_RANDOM:
+    case NK_MULT_ADD:
+    case NK_SQRT_ABS:
+    case NK_SIN_ABS:
+    case NK_SQUARE:
+    default:
+      UNREACHABLE_CODE("span_buffers_needed");
+    }
+
+    size_t need = 0;
+    needs.count -= children_count;
+    for (size_t i = 0; i < children_count; ++i) {
+      size_t child = held[i] + needs.items[needs.count + i];
+      need = need > child ? need : child;
+    }
+    da_append(&needs, need);
+  }
+  size_t need = needs.items[0];
+  free(frames.items);
+  free(needs.items);
+  return need;
+}
+
+#define SPAN_FILL(out, n, value)                                               \
+  for (size_t i = 0; i < (n); ++i)                                             \
+    (out)[i] = (value);
+
+// Applies the op in place once the operand is in the result buffer
+#define SPAN_UNOP(span, frame, kernel)                                         \
+  do {                                                                         \
+    if ((frame)->next == 0) {                                                  \
+      span_push((span), (frame)->node->as.unop, (frame)->result);              \
+      (frame)->next = 1;                                                       \
+      return false;                                                            \
+    }                                                                          \
+    (span)->kernels->kernel((frame)->result[0], (span)->count);                \
+  } while (0)
+
+// Evaluates lhs into the result buffer and rhs into a scratch buffer
+#define SPAN_BINOP(span, frame, kernel)                                        \
+  do {                                                                         \
+    if ((frame)->next == 0) {                                                  \
+      (frame)->next = 1;                                                       \
+      span_push((span), (frame)->node->as.binop.lhs, (frame)->result);         \
+      return false;                                                            \
+    }                                                                          \
+    if ((frame)->next == 1) {                                                  \
+      (frame)->next = 2;                                                       \
+      (frame)->mark = (span)->arena->count;                                    \
+      (frame)->scratch[0] = span_alloc(span);                                  \
+      span_push((span), (frame)->node->as.binop.rhs, (frame)->scratch);        \
+      return false;                                                            \
+    }                                                                          \
+    (span)->kernels->kernel((frame)->result[0], (frame)->scratch[0],           \
+                            (span)->count);                                    \
+    (span)->arena->count = (frame)->mark;                                      \
+  } while (0)
+
+/// Start evaluating `expr` into `result`, a shared node that is already
+/// filled is copied right away
+static void span_push(Span *span, Node *expr, float *const *result) {
+  size_t width = expr->type == NK_TRIPLE ? 3 : 1;
+  Span_Frame frame = {.node = expr};
+  memcpy(frame.result, result, width * sizeof(*result));
+  if (expr->slot > 0) {
+    size_t n = span_stride(span->count);
+    float *slot = &span->slots[(expr->slot - 1) * n];
+    if (span->filled[expr->slot]) {
+      memcpy(result[0], slot, n * sizeof(*slot));
+      return;
+    }
+    frame.result[0] = slot;
+    frame.copy_to = result[0];
+  }
+  da_append(span->frames, frame);
+}
+
+// NK_IF evaluated only the branch every lane takes
+#define SPAN_IF_PICKED 4
+
+/// Advance the frame on top by one operand, true once its value is done.
+/// The frame may be moved by pushing its next operand, so the steps only
+/// touch it before they push.
+static bool eval_span_step(Span *span, Span_Frame *frame) {
+  // Padding lanes are computed too, keep them initialized
+  size_t n = span_stride(span->count);
+  Node *expr = frame->node;
+  float *out = frame->result[0];
+
+  switch (expr->kind) {
+  case NK_X:
+    memcpy(out, span->xs, n * sizeof(*out));
+    break;
+  case NK_Y:
+    SPAN_FILL(out, n, span->y);
+    break;
+  case NK_T:
+    SPAN_FILL(out, n, span->t);
+    break;
+  case NK_NUMBER:
+    SPAN_FILL(out, n, expr->as.number);
+    break;
+  case NK_BOOLEAN:
+    SPAN_FILL(out, n, expr->as.boolean);
+    break;
+
+  case NK_SQRT:
+    SPAN_UNOP(span, frame, sqrt);
+    break;
+  case NK_ABS:
+    SPAN_UNOP(span, frame, abs);
+    break;
+  case NK_SIN:
+    SPAN_UNOP(span, frame, sin);
+    break;
+
+  case NK_ADD:
+    SPAN_BINOP(span, frame, add);
+    break;
+  case NK_MULT:
+    SPAN_BINOP(span, frame, mult);
+    break;
+  case NK_MOD:
+    SPAN_BINOP(span, frame, mod);
+    break;
+  case NK_GT:
+    SPAN_BINOP(span, frame, gt);
+    break;
+
+  case NK_TRIPLE: {
+    Node *children[3];
+    node_children(expr, children);
+    if (frame->next < 3) {
+      size_t k = frame->next++;
+      span_push(span, children[k], &frame->result[k]);
+      return false;
+    }
+  } break;
+
+  // Lanes are blended only when the span takes both branches, a branch no
+  // lane takes is skipped
+  case NK_IF: {
+    float **cond = &frame->scratch[0];
+    float **elze = &frame->scratch[1];
+    switch (frame->next) {
+    case 0:
+      frame->next = 1;
+      frame->mark = span->arena->count;
+      *cond = span_alloc(span);
+      span_push(span, expr->as.iff.cond, cond);
+      return false;
+
+    case 1: {
+      size_t taken = 0;
+      for (size_t i = 0; i < span->count; ++i)
+        taken += (*cond)[i] != 0.0f;
+      if (taken == span->count || taken == 0) {
+        span->arena->count = frame->mark;
+        frame->next = SPAN_IF_PICKED;
+        span_push(span, taken > 0 ? expr->as.iff.then : expr->as.iff.elze,
+                  frame->result);
+        return false;
+      }
+      frame->next = 2;
+      span_push(span, expr->as.iff.then, frame->result);
+      return false;
+    }
+
+    case 2:
+      frame->next = 3;
+      for (size_t k = 0; k < 3; ++k)
+        elze[k] = span_alloc(span);
+      span_push(span, expr->as.iff.elze, elze);
+      return false;
+
+    case 3:
+      for (size_t k = 0; k < 3; ++k) {
+        span->kernels->select(frame->result[k], *cond, elze[k], span->count);
+      }
+      span->arena->count = frame->mark;
+      break;
+
+    case SPAN_IF_PICKED:
+    default:
+      break;
+    }
+  } break;
+
+  case NK_RULE:
+  case NK_RANDOM:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  default:
+    UNREACHABLE_CODE("eval_span");
+  }
+  return true;
+}
+
+/// Evaluate a typechecked expression over the whole span into `result`, which
+/// holds one buffer per number (three for a triple) of `span->count` floats
+void eval_span(Span *span, Node *expr, float **result) {
+  size_t n = span_stride(span->count);
+  size_t base = span->frames->count;
+  span_push(span, expr, result);
+  while (span->frames->count > base) {
+    Span_Frame *frame = &span->frames->items[span->frames->count - 1];
+    if (!eval_span_step(span, frame))
+      continue;
+
+    frame = &span->frames->items[--span->frames->count];
+    if (frame->copy_to) {
+      span->filled[frame->node->slot] = true;
+      memcpy(frame->copy_to, frame->result[0], n * sizeof(float));
+    }
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "node.h"
+#include "simd.h"
+
+// Span evaluator: every node is evaluated over a whole span of pixels (a row
+// of x values with a shared y and t) into float buffers, so the dispatch on
+// Node_Kind is paid once per node per span instead of once per pixel.
+// Booleans are stored as 0 or 1 and a triple is written into three buffers.
+// The operations run through Span_Kernels (simd.h), and every buffer is
+// `span_stride(count)` floats long so the vector kernels can overrun `count`.
+
+// Bounded bump allocator for the scratch buffers of one thread. Buffers are
+// released in stack order by restoring `count`.
+typedef struct {
+  float *items;
+  size_t count;
+  size_t capacity;
+} Span_Arena;
+
+#define SPAN_ARENA_CAPACITY (256 * 1024)
+
+// A node being evaluated by eval_span(), its operands are evaluated into
+// `result` or into `scratch` buffers taken from the arena at `mark`. A
+// shared node is evaluated into its slot buffer and then copied to `copy_to`.
+typedef struct {
+  Node *node;
+  size_t next;
+  float *result[3];
+  float *scratch[4];
+  size_t mark;
+  float *copy_to;
+} Span_Frame;
+
+typedef struct {
+  Span_Frame *items;
+  size_t count;
+  size_t capacity;
+} Span_Frames;
+
+typedef struct {
+  Span_Arena *arena;
+  const Span_Kernels *kernels;
+  const float *xs;
+  float y;
+  float t;
+  size_t count;
+  // Buffers of the shared nodes of a DAG (Node.slot), one `span_stride` apart
+  // and starting at slot 1. A buffer is valid once `filled`, which the
+  // caller clears for every new span.
+  float *slots;
+  bool *filled;
+  // Only grows with the depth of the deepest tree, kept by the caller
+  Span_Frames *frames;
+} Span;
+
+static inline size_t span_stride(size_t count) {
+  return (count + SIMD_MAX_WIDTH - 1) / SIMD_MAX_WIDTH * SIMD_MAX_WIDTH;
+}
+
+void span_arena_init(Span_Arena *arena, size_t capacity);
+void span_arena_free(Span_Arena *arena);
+size_t span_buffers_needed(Node *expr);
+void eval_span(Span *span, Node *expr, float **result);
@@ -0,0 +1,976 @@
+#include "vm.h"
+#include "cse.h"
+
+#define NOB_STRIP_PREFIX
+#include "lib/nob.h"
+
+static void program_emit(Program *program, size_t *depth, Op_Kind op,
+                         float imm, int stack_effect) {
+  da_append(program, ((Inst){.op = op, .imm = imm}));
+  *depth += stack_effect;
+  if (*depth > program->max_stack)
+    program->max_stack = *depth;
+}
+
+static void program_emit_slot(Program *program, size_t *depth, Op_Kind op,
+                              size_t slot, int stack_effect) {
+  program_emit(program, depth, op, 0, stack_effect);
+  program->items[program->count - 1].slot = slot;
+}
+
+static Op_Kind op_from_node_kind(Node_Kind kind) {
+  switch (kind) {
+  case NK_X:
+    return OP_X;
+  case NK_Y:
+    return OP_Y;
+  case NK_T:
+    return OP_T;
+  case NK_SQRT:
+    return OP_SQRT;
+  case NK_ABS:
+    return OP_ABS;
+  case NK_SIN:
+    return OP_SIN;
+  case NK_ADD:
+    return OP_ADD;
+  case NK_MULT:
+    return OP_MULT;
+  case NK_MOD:
+    return OP_MOD;
+  case NK_GT:
+    return OP_GT;
+
+  case NK_NUMBER:
+  case NK_BOOLEAN:
+  case NK_TRIPLE:
+  case NK_IF:
+  case NK_RULE:
+  case NK_RANDOM:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  default:
+    UNREACHABLE_CODE("op_from_node_kind");
+  }
+}
+
+// A node of compile_node_into_program(), `before` is what was stored before
+// the branches of a conditional
+typedef struct {
+  Node *node;
+  size_t next;
+  size_t unless;
+  size_t jump;
+  bool *before;
+} Program_Frame;
+
+typedef struct {
+  Program_Frame *items;
+  size_t count;
+  size_t capacity;
+} Program_Frames;
+
+/// Emit the instructions of `expr` up to its next operand, which is pushed.
+/// Returns false once it has emitted all of them.
+static bool program_step(Program *program, size_t *depth, bool *stored,
+                              Program_Frames *frames, Program_Frame *frame) {
+  Node *expr = frame->node;
+  Node *children[3];
+  size_t children_count = node_children(expr, children);
+  if (expr->kind != NK_IF) {
+    if (frame->next < children_count) {
+      Node *child = children[frame->next++];
+      da_append(frames, ((Program_Frame){.node = child}));
+      return true;
+    }
+    if (children_count > 0 && expr->kind != NK_TRIPLE)
+      program_emit(program, depth, op_from_node_kind(expr->kind), 0,
+                   1 - (int)children_count);
+    return false;
+  }
+
+  // Only the taken branch runs, so what a branch stores is forgotten again:
+  // the other branch and everything after the conditional store it anew
+  size_t stored_size = (program->slot_count + 1) * sizeof(*stored);
+  switch (frame->next++) {
+  case 0:
+    break;
+
+  case 1:
+    frame->unless = program->count;
+    program_emit(program, depth, OP_JUMP_UNLESS, 0, -1);
+    frame->before = malloc(stored_size);
+    assert(frame->before != NULL && "Buy more RAM lol");
+    memcpy(frame->before, stored, stored_size);
+    break;
+
+  case 2:
+    frame->jump = program->count;
+    program_emit(program, depth, OP_JUMP, 0, 0);
+    program->items[frame->unless].target = program->count;
+    memcpy(stored, frame->before, stored_size);
+    *depth -= 3;
+    break;
+
+  default:
+    program->items[frame->jump].target = program->count;
+    memcpy(stored, frame->before, stored_size);
+    free(frame->before);
+    frame->before = NULL;
+    return false;
+  }
+  Node *child = children[frame->next - 1];
+  da_append(frames, ((Program_Frame){.node = child}));
+  return true;
+}
+
+/// Flatten a typechecked expression into postorder instructions. The first
+/// occurrence of a shared node stores its value, the others load it.
+/// Hoisted nodes are always loaded, the caller stores them.
+static bool compile_node_into_program(Program *program, size_t *depth,
+                                      bool *stored, Node *f) {
+  Program_Frames frames = {0};
+  bool ok = true;
+  da_append(&frames, ((Program_Frame){.node = f}));
+  while (frames.count > 0) {
+    Program_Frame *frame = &frames.items[frames.count - 1];
+    Node *expr = frame->node;
+    if (frame->next == 0) {
+      if (expr->hoisted || (expr->slot > 0 && stored[expr->slot])) {
+        program_emit_slot(program, depth, OP_LOAD, expr->slot, +1);
+        frames.count -= 1;
+        continue;
+      }
+
+      switch (expr->kind) {
+      case NK_X:
+      case NK_Y:
+      case NK_T:
+        program_emit(program, depth, op_from_node_kind(expr->kind), 0, +1);
+        break;
+
+      case NK_NUMBER:
+        program_emit(program, depth, OP_PUSH, expr->as.number, +1);
+        break;
+
+      case NK_BOOLEAN:
+        program_emit(program, depth, OP_PUSH, expr->as.boolean, +1);
+        break;
+
+      // Operands first, a triple is just its three numbers left on the stack
+      case NK_SQRT:
+      case NK_ABS:
+      case NK_SIN:
+      case NK_ADD:
+      case NK_MULT:
+      case NK_MOD:
+      case NK_GT:
+      case NK_TRIPLE:
+      case NK_IF:
+        break;
+
+      case NK_RULE:
+      case NK_RANDOM:
+        printf("%s:%d: ERROR: cannot compile a node that is only valid for "
+               "grammar definitions\n",
+               expr->file, expr->line);
+        ok = false;
+        break;
+
+      case NK_MULT_ADD:
+      case NK_SQRT_ABS:
+      case NK_SIN_ABS:
+      case NK_SQUARE:
+      default:
+        UNREACHABLE_CODE("compile_node_into_program");
+      }
+      if (!ok)
+        break;
+    }
+
+    if (program_step(program, depth, stored, &frames, frame))
+      continue;
+    frames.count -= 1;
+    if (expr->slot > 0) {
+      program_emit_slot(program, depth, OP_STORE, expr->slot, 0);
+      stored[expr->slot] = true;
+    }
+  }
+
+  for (size_t i = 0; i < frames.count; ++i)
+    free(frames.items[i].before);
+  free(frames.items);
+  return ok;
+}
+
+bool compile_node_func_into_program(Program *program, Node *f,
+                                    const Math_Funcs *math) {
+  if (!expect_type(f, NK_TRIPLE))
+    return false;
+
+  program->math = math;
+  program->count = 0;
+  program->max_stack = 0;
+  program->slot_count = node_slot_count(f);
+  bool *stored = calloc(program->slot_count + 1, sizeof(*stored));
+  assert(stored != NULL && "Buy more RAM lol");
+  size_t depth = 0;
+  bool ok = compile_node_into_program(program, &depth, stored, f);
+  free(stored);
+  if (!ok)
+    return false;
+  assert(depth == 3);
+  return true;
+}
+
+/// Run the program for a single pixel. `stack` must hold at least
+/// `program->max_stack + program->slot_count` floats, the shared values
+/// live right above the stack with slot 1 at `stack[program->max_stack]`.
+Vector3 program_run(const Program *program, float *stack, float x, float y,
+                    float t) {
+  float *sp = stack;
+  float *slots = stack + program->max_stack - 1;
+
+  for (size_t i = 0; i < program->count; ++i) {
+    const Inst *inst = &program->items[i];
+    switch (inst->op) {
+    case OP_X:
+      *sp++ = x;
+      break;
+    case OP_Y:
+      *sp++ = y;
+      break;
+    case OP_T:
+      *sp++ = t;
+      break;
+    case OP_PUSH:
+      *sp++ = inst->imm;
+      break;
+
+    case OP_SQRT:
+      sp[-1] = UNOP_MAPPER(NK_SQRT, sp[-1]);
+      break;
+    case OP_ABS:
+      sp[-1] = UNOP_MAPPER(NK_ABS, sp[-1]);
+      break;
+    case OP_SIN:
+      sp[-1] = program->math->sin(sp[-1]);
+      break;
+
+    case OP_ADD:
+      sp--;
+      sp[-1] = BINOP_MAPPER(NK_ADD, sp[-1], sp[0]);
+      break;
+    case OP_MULT:
+      sp--;
+      sp[-1] = BINOP_MAPPER(NK_MULT, sp[-1], sp[0]);
+      break;
+    case OP_MOD:
+      sp--;
+      sp[-1] = BINOP_MAPPER(NK_MOD, sp[-1], sp[0]);
+      break;
+    case OP_GT:
+      sp--;
+      sp[-1] = BINOP_MAPPER(NK_GT, sp[-1], sp[0]);
+      break;
+
+    case OP_STORE:
+      slots[inst->slot] = sp[-1];
+      break;
+    case OP_LOAD:
+      *sp++ = slots[inst->slot];
+      break;
+
+    // Targets are always ahead, the loop steps onto them
+    case OP_JUMP_UNLESS:
+      sp--;
+      if (!sp[0])
+        i = inst->target - 1;
+      break;
+    case OP_JUMP:
+      i = inst->target - 1;
+      break;
+
+    case OP_MOV:
+    default:
+      UNREACHABLE_CODE("program_run");
+    }
+  }
+
+  return (Vector3){stack[0], stack[1], stack[2]};
+}
+
+void program_free(Program *program) {
+  da_free(*program);
+  memset(program, 0, sizeof(*program));
+}
+
+// Sethi-Ullman label of a subtree, stored in postorder
+typedef struct {
+  size_t need;  // registers needed to evaluate the subtree
+  size_t width; // fresh registers still holding its result afterwards
+  size_t size;  // amount of nodes in the subtree
+} Reg_Label;
+
+typedef struct {
+  Reg_Label *items;
+  size_t count;
+  size_t capacity;
+} Reg_Labels;
+
+// A node being emitted by compile_node_into_reg_program(): the subtree
+// labeled at `index`, whose operands are emitted in `order` into `operands`.
+// `child` is the operand being emitted now. A conditional keeps the
+// allocation its branches start from in `saved`.
+typedef struct {
+  Node *node;
+  size_t next;
+  size_t index;
+  size_t indices[3];
+  size_t order[3];
+  size_t child;
+  uint8_t operands[3][3];
+  uint8_t result[3];
+  size_t unless;
+  size_t jump;
+  size_t *saved;
+} Reg_Frame;
+
+typedef struct {
+  Reg_Frame *items;
+  size_t count;
+  size_t capacity;
+} Reg_Frames;
+
+typedef struct {
+  Reg_Program *program;
+  Reg_Labels labels;
+  // Pending reads of every register, a register is free again at zero
+  size_t refs[REG_FILE_CAPACITY];
+  // Shared nodes are only emitted once when `share` is set: how many parents
+  // read them and which register holds them once emitted (0 before)
+  bool share;
+  size_t max_inputs;
+  size_t input_count;
+  bool report; // whether running out of registers is an error
+
+  size_t slot_count;
+  size_t *slot_uses;
+  uint8_t *slot_regs;
+  Reg_Frames frames;
+} Reg_Compiler;
+
+static size_t reg_result_width(Node *expr) {
+  return expr->type == NK_TRIPLE ? 3 : 1;
+}
+
+/// Find the labels of the children of the node labeled at `index` and order
+/// them so the most register hungry subtrees are evaluated first, while the
+/// results of the others are not occupying registers yet. Returns the peak
+/// amount of registers needed to evaluate all of them.
+static size_t reg_order_children(Reg_Labels *labels, size_t index,
+                                 size_t children_count, size_t *indices,
+                                 size_t *order) {
+  // Children are laid out right before their parent in postorder
+  size_t child_index = index;
+  for (size_t i = children_count; i > 0; --i) {
+    child_index -= 1;
+    indices[i - 1] = child_index;
+    order[i - 1] = i - 1;
+    child_index -= labels->items[child_index].size - 1;
+  }
+
+  // Stable insertion sort by (need - width), highest first
+  for (size_t i = 1; i < children_count; ++i) {
+    for (size_t j = i; j > 0; --j) {
+      Reg_Label *prev = &labels->items[indices[order[j - 1]]];
+      Reg_Label *curr = &labels->items[indices[order[j]]];
+      if ((long)curr->need - (long)curr->width <=
+          (long)prev->need - (long)prev->width)
+        break;
+      size_t tmp = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = tmp;
+    }
+  }
+
+  size_t peak = 0, held = 0;
+  for (size_t i = 0; i < children_count; ++i) {
+    Reg_Label *label = &labels->items[indices[order[i]]];
+    if (held + label->need > peak)
+      peak = held + label->need;
+    held += label->width;
+  }
+  return peak;
+}
+
+static bool reg_is_input(const Reg_Program *program, Node *expr) {
+  return expr->hoisted && program->inputs[expr->slot] != 0;
+}
+
+static void reg_label(const Reg_Program *program, Reg_Labels *labels,
+                      Node *f) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *expr = frame->node;
+    // Already in its register like x, y and t, the subtree is never emitted
+    if (reg_is_input(program, expr)) {
+      da_append(labels, ((Reg_Label){.size = 1}));
+      frames.count -= 1;
+      continue;
+    }
+
+    Node *children[3];
+    size_t children_count = node_children(expr, children);
+    if (frame->next < children_count) {
+      node_frames_push(&frames, children[frame->next++]);
+      continue;
+    }
+    frames.count -= 1;
+
+    size_t indices[3], order[3];
+    size_t peak = reg_order_children(labels, labels->count, children_count,
+                                     indices, order);
+    Reg_Label label = {.size = 1};
+    for (size_t i = 0; i < children_count; ++i)
+      label.size += labels->items[indices[i]].size;
+    switch (expr->kind) {
+    case NK_X:
+    case NK_Y:
+    case NK_T:
+      break;
+
+    case NK_NUMBER:
+    case NK_BOOLEAN:
+      label.need = label.width = 1;
+      break;
+
+    case NK_SQRT:
+    case NK_ABS:
+    case NK_SIN:
+    case NK_ADD:
+    case NK_MULT:
+    case NK_MOD:
+    case NK_GT:
+    case NK_TRIPLE:
+      label.width = reg_result_width(expr);
+      label.need = peak > label.width ? peak : label.width;
+      break;
+
+    // The condition is dead before the branches run next to the three
+    // registers of the result
+    case NK_IF:
+      label.width = 3;
+      label.need = labels->items[indices[0]].need;
+      for (size_t i = 1; i < 3; ++i) {
+        size_t need = 3 + labels->items[indices[i]].need;
+        label.need = need > label.need ? need : label.need;
+      }
+      break;
+
+    case NK_RULE:
+    case NK_RANDOM:
+    case NK_MULT_ADD:
+    case NK_SQRT_ABS:
+    case NK_SIN_ABS:
+    case NK_SQUARE:
+    default:
+      break;
+    }
+
+    da_append(labels, label);
+  }
+  free(frames.items);
+}
+
+static bool reg_alloc(Reg_Compiler *rc, Node *expr, uint8_t *reg) {
+  for (size_t r = REG_FIRST_FREE; r < REG_FILE_CAPACITY; ++r) {
+    if (rc->refs[r] == 0) {
+      rc->refs[r] = 1;
+      if (r + 1 > rc->program->register_count)
+        rc->program->register_count = r + 1;
+      *reg = r;
+      return true;
+    }
+  }
+
+  // Only the last attempt reports, the others are retried with less pressure
+  if (rc->report)
+    printf("%s:%d: ERROR: function does not fit into %d registers\n",
+           expr->file, expr->line, REG_FILE_CAPACITY);
+  return false;
+}
+
+static void reg_release(Reg_Compiler *rc, uint8_t reg) {
+  if (reg >= REG_FIRST_FREE) {
+    assert(rc->refs[reg] > 0);
+    rc->refs[reg] -= 1;
+  }
+}
+
+// Inputs are live for the whole program, so only some of the hoisted nodes
+// get a register and the others are computed like any other node
+#define REG_MAX_INPUTS ((REG_FILE_CAPACITY - REG_FIRST_FREE) / 4)
+// Never released, the caller fills the register before every run
+#define REG_PINNED (SIZE_MAX / 2)
+
+typedef struct {
+  Node *node;
+  size_t size; // instructions it saves per pixel, roughly
+} Reg_Candidate;
+
+typedef struct {
+  Reg_Candidate *items;
+  size_t count;
+  size_t capacity;
+} Reg_Candidates;
+
+static size_t reg_tree_size(Node *expr) {
+  struct {
+    Node **items;
+    size_t count;
+    size_t capacity;
+  } stack = {0};
+  size_t size = 0;
+  da_append(&stack, expr);
+  while (stack.count > 0) {
+    Node *children[3];
+    size_t children_count = node_children(stack.items[--stack.count],
+                                          children);
+    size += 1;
+    for (size_t i = 0; i < children_count; ++i)
+      da_append(&stack, children[i]);
+  }
+  free(stack.items);
+  return size;
+}
+
+/// Collect the distinct hoisted nodes reachable without passing another one
+static void reg_collect_candidates(Reg_Candidates *candidates, bool *seen,
+                                   Node *f) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *children[3];
+    size_t children_count = node_children(frame->node, children);
+    if (frame->next >= children_count) {
+      frames.count -= 1;
+      continue;
+    }
+
+    Node *child = children[frame->next++];
+    if (!child->hoisted) {
+      node_frames_push(&frames, child);
+    } else if (!seen[child->slot]) {
+      seen[child->slot] = true;
+      da_append(candidates, ((Reg_Candidate){child, reg_tree_size(child)}));
+    }
+  }
+  free(frames.items);
+}
+
+static int reg_compare_candidates(const void *a, const void *b) {
+  size_t lhs = ((const Reg_Candidate *)a)->size;
+  size_t rhs = ((const Reg_Candidate *)b)->size;
+  return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+/// Give the `max_inputs` largest hoisted nodes a register right after x, y
+/// and t, the others are emitted like any other node
+static void reg_pin_inputs(Reg_Compiler *rc, Node *f, size_t slot_count) {
+  bool *seen = calloc(slot_count + 1, sizeof(*seen));
+  assert(seen != NULL && "Buy more RAM lol");
+  Reg_Candidates candidates = {0};
+  reg_collect_candidates(&candidates, seen, f);
+  qsort(candidates.items, candidates.count, sizeof(*candidates.items),
+        reg_compare_candidates);
+  for (size_t i = 0; i < candidates.count && i < rc->max_inputs; ++i) {
+    Node *node = candidates.items[i].node;
+    rc->program->inputs[node->slot] = REG_FIRST_FREE + rc->input_count++;
+  }
+  da_free(candidates);
+  free(seen);
+}
+
+/// Count the parents of every shared node, visiting each of them once
+static void reg_count_uses(Reg_Compiler *rc, Node *f) {
+  Node_Frames frames = {0};
+  node_frames_push(&frames, f);
+  while (frames.count > 0) {
+    Node_Frame *frame = &frames.items[frames.count - 1];
+    Node *children[3];
+    size_t children_count = node_children(frame->node, children);
+    if (frame->next >= children_count) {
+      frames.count -= 1;
+      continue;
+    }
+
+    Node *child = children[frame->next++];
+    size_t slot = child->slot;
+    if (reg_is_input(rc->program, child))
+      continue;
+    if (slot > 0 && rc->slot_uses[slot]++ > 0)
+      continue;
+    node_frames_push(&frames, child);
+  }
+  free(frames.items);
+}
+
+static void reg_emit(Reg_Compiler *rc, Reg_Inst inst) {
+  da_append(rc->program, inst);
+}
+
+typedef enum {
+  REG_STEP_PUSHED,
+  REG_STEP_DONE,
+  REG_STEP_FAILED,
+} Reg_Step;
+
+/// Emit the subtree labeled at `index` into `result`, or push a frame for it.
+/// An input or a shared node emitted already is in its register right away.
+static void reg_push(Reg_Compiler *rc, Node *expr, size_t index,
+                     uint8_t *result) {
+  if (reg_is_input(rc->program, expr)) {
+    result[0] = rc->program->inputs[expr->slot];
+    return;
+  }
+  if (rc->share && expr->slot > 0 && rc->slot_regs[expr->slot] != 0) {
+    result[0] = rc->slot_regs[expr->slot];
+    return;
+  }
+  da_append(&rc->frames, ((Reg_Frame){.node = expr, .index = index}));
+}
+
+/// Push the operand `child` of the frame on top, which may move the frame
+static Reg_Step reg_push_operand(Reg_Compiler *rc, Reg_Frame *frame,
+                                 Node *operand, size_t child) {
+  frame->child = child;
+  reg_push(rc, operand, frame->indices[child], frame->operands[child]);
+  return REG_STEP_PUSHED;
+}
+
+/// Evaluate the operands in Sethi-Ullman order, but keep their results in
+/// operand order. Returns REG_STEP_DONE once the node itself is emitted into
+/// `frame->result`.
+static Reg_Step reg_node_step(Reg_Compiler *rc, Reg_Frame *frame) {
+  Node *expr = frame->node;
+  Node *children[3];
+  size_t children_count = node_children(expr, children);
+  if (frame->next == 0)
+    reg_order_children(&rc->labels, frame->index, children_count,
+                       frame->indices, frame->order);
+  if (frame->next < children_count) {
+    size_t child = frame->order[frame->next++];
+    return reg_push_operand(rc, frame, children[child], child);
+  }
+
+  uint8_t(*operands)[3] = frame->operands;
+  uint8_t *result = frame->result;
+  switch (expr->kind) {
+  case NK_X:
+    result[0] = REG_X;
+    break;
+  case NK_Y:
+    result[0] = REG_Y;
+    break;
+  case NK_T:
+    result[0] = REG_T;
+    break;
+
+  case NK_NUMBER:
+  case NK_BOOLEAN:
+    if (!reg_alloc(rc, expr, &result[0]))
+      return REG_STEP_FAILED;
+    reg_emit(rc, (Reg_Inst){
+                     .op = OP_PUSH,
+                     .dst = result[0],
+                     .imm = expr->kind == NK_NUMBER ? expr->as.number
+                                                    : expr->as.boolean,
+                 });
+    break;
+
+  // Operands die at their use, so the result may reuse one of them
+  case NK_SQRT:
+  case NK_ABS:
+  case NK_SIN:
+    reg_release(rc, operands[0][0]);
+    if (!reg_alloc(rc, expr, &result[0]))
+      return REG_STEP_FAILED;
+    reg_emit(rc, (Reg_Inst){
+                     .op = op_from_node_kind(expr->kind),
+                     .dst = result[0],
+                     .a = operands[0][0],
+                 });
+    break;
+
+  case NK_ADD:
+  case NK_MULT:
+  case NK_MOD:
+  case NK_GT:
+    reg_release(rc, operands[0][0]);
+    reg_release(rc, operands[1][0]);
+    if (!reg_alloc(rc, expr, &result[0]))
+      return REG_STEP_FAILED;
+    reg_emit(rc, (Reg_Inst){
+                     .op = op_from_node_kind(expr->kind),
+                     .dst = result[0],
+                     .a = operands[0][0],
+                     .b = operands[1][0],
+                 });
+    break;
+
+  case NK_TRIPLE:
+    result[0] = operands[0][0];
+    result[1] = operands[1][0];
+    result[2] = operands[2][0];
+    break;
+
+  case NK_RULE:
+  case NK_RANDOM:
+    printf("%s:%d: ERROR: cannot compile a node that is only valid for grammar "
+           "definitions\n",
+           expr->file, expr->line);
+    return REG_STEP_FAILED;
+
+  case NK_IF:
+  case NK_MULT_ADD:
+  case NK_SQRT_ABS:
+  case NK_SIN_ABS:
+  case NK_SQUARE:
+  default:
+    UNREACHABLE_CODE("compile_node_into_reg_program");
+  }
+
+  // The register is read once by every parent
+  if (rc->share && expr->slot > 0) {
+    rc->slot_regs[expr->slot] = result[0];
+    rc->refs[result[0]] += rc->slot_uses[expr->slot] - 1;
+  }
+  return REG_STEP_DONE;
+}
+
+/// Copy the triple of a branch into the registers of the conditional
+static void reg_emit_branch_result(Reg_Compiler *rc, Reg_Frame *frame,
+                                   size_t branch) {
+  for (size_t i = 0; i < 3; ++i) {
+    if (frame->operands[branch][i] != frame->result[i])
+      reg_emit(rc, (Reg_Inst){
+                       .op = OP_MOV,
+                       .dst = frame->result[i],
+                       .a = frame->operands[branch][i],
+                   });
+  }
+}
+
+/// Only the branch the condition picks runs, and both copy their triple into
+/// the same registers, reserved up front. A conditional is always the last
+/// thing its parent computes, so no register is read after it but its
+/// result, and the second branch starts over from the allocation the first
+/// one started with: registers, and shared nodes it has to emit again.
+static Reg_Step reg_if_step(Reg_Compiler *rc, Reg_Frame *frame) {
+  Node *expr = frame->node;
+  size_t slot_regs_size = (rc->slot_count + 1) * sizeof(*rc->slot_regs);
+  switch (frame->next++) {
+  case 0:
+    reg_order_children(&rc->labels, frame->index, 3, frame->indices,
+                       frame->order);
+    return reg_push_operand(rc, frame, expr->as.iff.cond, 0);
+
+  case 1: {
+    // Results are only written at the end of a branch, after the jump read
+    // the condition
+    uint8_t cond = frame->operands[0][0];
+    reg_release(rc, cond);
+    for (size_t i = 0; i < 3; ++i) {
+      if (!reg_alloc(rc, expr, &frame->result[i]))
+        return REG_STEP_FAILED;
+    }
+    frame->unless = rc->program->count;
+    reg_emit(rc, (Reg_Inst){.op = OP_JUMP_UNLESS, .a = cond});
+
+    frame->saved = malloc(sizeof(rc->refs) + slot_regs_size);
+    assert(frame->saved != NULL && "Buy more RAM lol");
+    memcpy(frame->saved, rc->refs, sizeof(rc->refs));
+    memcpy(frame->saved + REG_FILE_CAPACITY, rc->slot_regs, slot_regs_size);
+    return reg_push_operand(rc, frame, expr->as.iff.then, 1);
+  }
+
+  case 2:
+    reg_emit_branch_result(rc, frame, 1);
+    frame->jump = rc->program->count;
+    reg_emit(rc, (Reg_Inst){.op = OP_JUMP});
+    rc->program->items[frame->unless].target = rc->program->count;
+    memcpy(rc->refs, frame->saved, sizeof(rc->refs));
+    memcpy(rc->slot_regs, frame->saved + REG_FILE_CAPACITY, slot_regs_size);
+    return reg_push_operand(rc, frame, expr->as.iff.elze, 2);
+
+  default:
+    reg_emit_branch_result(rc, frame, 2);
+    rc->program->items[frame->jump].target = rc->program->count;
+    free(frame->saved);
+    frame->saved = NULL;
+    return REG_STEP_DONE;
+  }
+}
+
+/// Emit the subtree whose label is at `index` and return the registers
+/// holding its result (three for a triple)
+static bool compile_node_into_reg_program(Reg_Compiler *rc, Node *f,
+                                          size_t index, uint8_t *result) {
+  rc->frames.count = 0;
+  reg_push(rc, f, index, result);
+  while (rc->frames.count > 0) {
+    Reg_Frame *frame = &rc->frames.items[rc->frames.count - 1];
+    Reg_Step step = frame->node->kind == NK_IF ? reg_if_step(rc, frame)
+                                               : reg_node_step(rc, frame);
+    if (step == REG_STEP_FAILED)
+      break;
+    if (step == REG_STEP_PUSHED)
+      continue;
+
+    frame = &rc->frames.items[--rc->frames.count];
+    uint8_t *to = result;
+    if (rc->frames.count > 0) {
+      Reg_Frame *parent = &rc->frames.items[rc->frames.count - 1];
+      to = parent->operands[parent->child];
+    }
+    memcpy(to, frame->result, sizeof(frame->result));
+  }
+
+  bool ok = rc->frames.count == 0;
+  for (size_t i = 0; i < rc->frames.count; ++i)
+    free(rc->frames.items[i].saved);
+  return ok;
+}
+
+static bool compile_reg_program(Reg_Program *program, Reg_Compiler *rc,
+                                Node *f, size_t slot_count) {
+  program->count = 0;
+  rc->input_count = 0;
+  memset(program->inputs, 0, (slot_count + 1) * sizeof(*program->inputs));
+  reg_pin_inputs(rc, f, slot_count);
+  rc->labels.count = 0;
+  reg_label(program, &rc->labels, f);
+
+  program->register_count = REG_FIRST_FREE + rc->input_count;
+  memset(rc->refs, 0, sizeof(rc->refs));
+  for (size_t i = 0; i < rc->input_count; ++i)
+    rc->refs[REG_FIRST_FREE + i] = REG_PINNED;
+  memset(rc->slot_uses, 0, (slot_count + 1) * sizeof(*rc->slot_uses));
+  memset(rc->slot_regs, 0, (slot_count + 1) * sizeof(*rc->slot_regs));
+  reg_count_uses(rc, f);
+  return compile_node_into_reg_program(rc, f, rc->labels.count - 1,
+                                       program->result);
+}
+
+bool compile_node_func_into_reg_program(Reg_Program *program, Node *f,
+                                        const Math_Funcs *math) {
+  if (!expect_type(f, NK_TRIPLE))
+    return false;
+
+  program->math = math;
+  size_t slot_count = node_slot_count(f);
+  Reg_Compiler rc = {.program = program, .slot_count = slot_count};
+  rc.slot_uses = calloc(slot_count + 1, sizeof(*rc.slot_uses));
+  rc.slot_regs = calloc(slot_count + 1, sizeof(*rc.slot_regs));
+  program->inputs = calloc(slot_count + 1, sizeof(*program->inputs));
+  assert(rc.slot_uses != NULL && rc.slot_regs != NULL &&
+         program->inputs != NULL && "Buy more RAM lol");
+
+  // Inputs and shared values stay alive for longer, which may not fit into
+  // the register file where recomputing them does, so they are given up in
+  // that order
+  struct {
+    size_t max_inputs;
+    bool share;
+  } attempts[] = {{REG_MAX_INPUTS, true}, {0, true}, {0, false}};
+  bool ok = false;
+  for (size_t i = 0; i < ARRAY_LEN(attempts) && !ok; ++i) {
+    rc.max_inputs = attempts[i].max_inputs;
+    rc.share = attempts[i].share;
+    rc.report = i + 1 == ARRAY_LEN(attempts);
+    ok = compile_reg_program(program, &rc, f, slot_count);
+  }
+
+  free(rc.slot_uses);
+  free(rc.slot_regs);
+  da_free(rc.labels);
+  da_free(rc.frames);
+  return ok;
+}
+
+/// Run the register program for a single pixel. The registers live on the
+/// stack, which keeps the compiler from reloading the program through them.
+Vector3 reg_program_run(const Reg_Program *program, const float *inputs) {
+  float regs[REG_FILE_CAPACITY];
+  memcpy(regs, inputs, program->register_count * sizeof(*regs));
+  for (size_t i = 0; i < program->count; ++i) {
+    const Reg_Inst *inst = &program->items[i];
+    switch (inst->op) {
+    case OP_PUSH:
+      regs[inst->dst] = inst->imm;
+      break;
+
+    case OP_SQRT:
+      regs[inst->dst] = UNOP_MAPPER(NK_SQRT, regs[inst->a]);
+      break;
+    case OP_ABS:
+      regs[inst->dst] = UNOP_MAPPER(NK_ABS, regs[inst->a]);
+      break;
+    case OP_SIN:
+      regs[inst->dst] = program->math->sin(regs[inst->a]);
+      break;
+
+    case OP_ADD:
+      regs[inst->dst] = BINOP_MAPPER(NK_ADD, regs[inst->a], regs[inst->b]);
+      break;
+    case OP_MULT:
+      regs[inst->dst] = BINOP_MAPPER(NK_MULT, regs[inst->a], regs[inst->b]);
+      break;
+    case OP_MOD:
+      regs[inst->dst] = BINOP_MAPPER(NK_MOD, regs[inst->a], regs[inst->b]);
+      break;
+    case OP_GT:
+      regs[inst->dst] = BINOP_MAPPER(NK_GT, regs[inst->a], regs[inst->b]);
+      break;
+
+    case OP_MOV:
+      regs[inst->dst] = regs[inst->a];
+      break;
+
+    // Targets are always ahead, the loop steps onto them
+    case OP_JUMP_UNLESS:
+      if (!regs[inst->a])
+        i = inst->target - 1;
+      break;
+    case OP_JUMP:
+      i = inst->target - 1;
+      break;
+
+    case OP_X:
+    case OP_Y:
+    case OP_T:
+    case OP_STORE:
+    case OP_LOAD:
+    default:
+      UNREACHABLE_CODE("reg_program_run");
+    }
+  }
+
+  return (Vector3){
+      regs[program->result[0]],
+      regs[program->result[1]],
+      regs[program->result[2]],
+  };
+}
+
+void reg_program_free(Reg_Program *program) {
+  da_free(*program);
+  free(program->inputs);
+  memset(program, 0, sizeof(*program));
+}
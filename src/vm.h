@@ -0,0 +1,102 @@
+#pragma once
+#include <stdint.h>
+
+#include "node.h"
+
+// Stack VM: a typechecked Node tree flattened into postorder instructions.
+// Every value on the stack is a float, booleans are stored as 0 or 1 and a
+// triple occupies three consecutive slots.
+typedef enum {
+  OP_X,
+  OP_Y,
+  OP_T,
+  OP_PUSH,
+
+  // Unary Operations (replace the top of the stack)
+  OP_SQRT,
+  OP_ABS,
+  OP_SIN,
+
+  // Binary Operations (pop rhs, replace lhs)
+  OP_ADD,
+  OP_MULT,
+  OP_MOD,
+  OP_GT,
+
+  // Shared values of a DAG (Node.slot): OP_STORE copies the top of the stack
+  // into `slot`, OP_LOAD pushes it again
+  OP_STORE,
+  OP_LOAD,
+
+  // Conditionals only run the branch they take: OP_JUMP_UNLESS pops the
+  // condition and continues at `target` when it is false, OP_JUMP always
+  // does. Both branches leave their triple in the same place.
+  OP_JUMP_UNLESS,
+  OP_JUMP,
+  OP_MOV, // register VM only: copy `a` into `dst`
+} Op_Kind;
+
+typedef struct {
+  Op_Kind op;
+  float imm;
+  union {
+    size_t slot;
+    size_t target;
+  };
+} Inst;
+
+typedef struct {
+  Inst *items;
+  size_t count;
+  size_t capacity;
+  size_t max_stack;
+  size_t slot_count;
+  const Math_Funcs *math;
+} Program;
+
+bool compile_node_func_into_program(Program *program, Node *f,
+                                    const Math_Funcs *math);
+Vector3 program_run(const Program *program, float *stack, float x, float y,
+                    float t);
+void program_free(Program *program);
+
+// Register VM: the same operations over a fixed register file. Registers 0, 1
+// and 2 always hold x, y and t, OP_PUSH loads `imm` into `dst`, unary and
+// binary operations read `a` (and `b`) and OP_JUMP_UNLESS tests `a`.
+// Subtrees are emitted in Sethi-Ullman order and registers are reused as soon
+// as their value is dead. A shared node of a DAG is emitted once and its
+// register stays alive until its last parent.
+// Hoisted nodes may be inputs: the caller writes their value into the
+// register `inputs[slot]` before running the program.
+#define REG_FILE_CAPACITY 64
+#define REG_X 0
+#define REG_Y 1
+#define REG_T 2
+#define REG_FIRST_FREE 3
+
+typedef struct {
+  Op_Kind op;
+  uint8_t dst;
+  uint8_t a;
+  uint8_t b;
+  union {
+    float imm;
+    uint32_t target;
+  };
+} Reg_Inst;
+
+typedef struct {
+  Reg_Inst *items;
+  size_t count;
+  size_t capacity;
+  size_t register_count;
+  uint8_t result[3];
+  uint8_t *inputs; // register of every input slot, 0 for the others
+  const Math_Funcs *math;
+} Reg_Program;
+
+bool compile_node_func_into_reg_program(Reg_Program *program, Node *f,
+                                        const Math_Funcs *math);
+// `inputs` holds `program->register_count` floats, x, y, t and the inputs set
+Vector3 reg_program_run(const Reg_Program *program, const float *inputs);
+void reg_program_free(Reg_Program *program);